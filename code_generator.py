@@ -309,16 +309,19 @@ def create_primitive_type_definition(type):
   typedefs = {
     "number": "double",
     "integer": "int",
+    "integer64": "int64_t",
     "boolean": "bool"
   }
   defaults = {
     "number": "0",
     "integer": "0",
+    "integer64": "0",
     "boolean": "false"
   }
   jsontypes = {
     "number": "TypeDouble",
     "integer": "TypeInteger",
+    "integer64": "TypeInteger64",
     "boolean": "TypeBoolean",
   }
   return {
@@ -462,6 +465,7 @@ class Protocol(object):
     self.type_definitions = {}
     self.type_definitions["number"] = create_primitive_type_definition("number")
     self.type_definitions["integer"] = create_primitive_type_definition("integer")
+    self.type_definitions["integer64"] = create_primitive_type_definition("integer64")
     self.type_definitions["boolean"] = create_primitive_type_definition("boolean")
     self.type_definitions["object"] = create_object_type_definition()
     self.type_definitions["any"] = create_any_type_definition()
@@ -566,6 +570,36 @@ class Protocol(object):
   def is_imported_dependency(self, domain):
     return domain in self.generate_domains or domain in self.imported_domains
 
+  def binary_fields(self, domain):
+    """Yields (command name, path) for the binary parameters of the commands
+    in |domain|, including those nested within objects, see
+    crdtp::json::BinaryFieldTable. Recursive types are not followed."""
+    types = dict()
+    for d in self.json_api["domains"]:
+      for type in d.get("types", []):
+        types[d["domain"] + "." + type["id"]] = type
+
+    fields = []
+    def visit(command, prop, path, refs):
+      if "$ref" in prop:
+        if prop["$ref"] not in refs and prop["$ref"] in types:
+          visit(command, types[prop["$ref"]], path, refs | {prop["$ref"]})
+        return
+      if prop["type"] == "array":
+        visit(command, prop["items"], path, refs)
+      elif prop["type"] == "binary" or prop["type"].endswith(".binary"):
+        fields.append((command["name"], ".".join(path)))
+      elif prop["type"] == "object":
+        for p in prop.get("properties", []):
+          visit(command, p, path + [p["name"]], refs)
+
+    for command in domain.get("commands", []):
+      if not self.generate_command(domain["domain"], command["name"]):
+        continue
+      for param in command.get("parameters", []):
+        visit(command, param, [param["name"]], set())
+    return sorted(fields)
+
 
 def main():
   jinja_dir, config_file, config = read_config()
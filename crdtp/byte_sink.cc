@@ -0,0 +1,118 @@
+// Copyright 2020 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "byte_sink.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+namespace crdtp {
+// =============================================================================
+// VectorByteSink - Appends to a std::vector<uint8_t> owned by the caller.
+// =============================================================================
+
+void VectorByteSink::Append(span<uint8_t> bytes) {
+  out_->insert(out_->end(), bytes.begin(), bytes.end());
+}
+
+size_t VectorByteSink::size() const {
+  return out_->size();
+}
+
+void VectorByteSink::Overwrite(size_t pos, span<uint8_t> bytes) {
+  assert(pos + bytes.size() <= out_->size());
+  std::copy(bytes.begin(), bytes.end(), out_->begin() + pos);
+}
+
+void VectorByteSink::Clear() {
+  out_->clear();
+}
+
+// =============================================================================
+// FixedByteSink - Writes into a caller provided buffer of fixed capacity.
+// =============================================================================
+
+void FixedByteSink::Append(span<uint8_t> bytes) {
+  if (size_ < capacity_) {
+    size_t n = std::min(bytes.size(), capacity_ - size_);
+    if (n)
+      memcpy(buffer_ + size_, bytes.data(), n);
+  }
+  size_ += bytes.size();
+}
+
+size_t FixedByteSink::size() const {
+  return size_;
+}
+
+void FixedByteSink::Overwrite(size_t pos, span<uint8_t> bytes) {
+  assert(pos + bytes.size() <= size_);
+  // Bytes past the capacity were dropped, so there's nothing to patch.
+  if (pos >= capacity_)
+    return;
+  size_t n = std::min(bytes.size(), capacity_ - pos);
+  memcpy(buffer_ + pos, bytes.data(), n);
+}
+
+void FixedByteSink::Clear() {
+  size_ = 0;
+}
+
+bool FixedByteSink::ok() const {
+  return size_ <= capacity_;
+}
+
+span<uint8_t> FixedByteSink::written() const {
+  return span<uint8_t>(buffer_, std::min(size_, capacity_));
+}
+
+// =============================================================================
+// ChunkedByteSink - Writes into a list of chunks with fixed capacity.
+// =============================================================================
+
+ChunkedByteSink::ChunkedByteSink(size_t chunk_size) : chunk_size_(chunk_size) {
+  assert(chunk_size_ > 0);
+}
+
+void ChunkedByteSink::Append(span<uint8_t> bytes) {
+  size_t ii = 0;
+  while (ii < bytes.size()) {
+    if (chunks_.empty() || chunks_.back().size() == chunk_size_) {
+      chunks_.emplace_back();
+      chunks_.back().reserve(chunk_size_);
+    }
+    std::vector<uint8_t>* chunk = &chunks_.back();
+    size_t n = std::min(bytes.size() - ii, chunk_size_ - chunk->size());
+    chunk->insert(chunk->end(), bytes.begin() + ii, bytes.begin() + ii + n);
+    ii += n;
+  }
+  size_ += bytes.size();
+}
+
+size_t ChunkedByteSink::size() const {
+  return size_;
+}
+
+void ChunkedByteSink::Overwrite(size_t pos, span<uint8_t> bytes) {
+  assert(pos + bytes.size() <= size_);
+  // All chunks but the last one are full, so the chunk index is computed
+  // directly from |pos|. Envelope sizes may straddle a chunk boundary.
+  for (size_t ii = 0; ii < bytes.size(); ++ii, ++pos)
+    chunks_[pos / chunk_size_][pos % chunk_size_] = bytes[ii];
+}
+
+void ChunkedByteSink::Clear() {
+  chunks_.clear();
+  size_ = 0;
+}
+
+std::vector<std::vector<uint8_t>> ChunkedByteSink::TakeChunks() {
+  std::vector<std::vector<uint8_t>> chunks;
+  chunks.swap(chunks_);
+  size_ = 0;
+  return chunks;
+}
+}  // namespace crdtp
@@ -0,0 +1,130 @@
+// Copyright 2020 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CRDTP_BYTE_SINK_H_
+#define CRDTP_BYTE_SINK_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "export.h"
+#include "span.h"
+
+namespace crdtp {
+// =============================================================================
+// ByteSink - Destination for encoded bytes.
+// =============================================================================
+
+// The CBOR encoders (see cbor.h), the ContainerSerializer (protocol_core.h)
+// and Serializable::AppendSerializedToSink write their output through this
+// interface, so that messages may be encoded directly into memory that's
+// owned by the transport (e.g. pre-registered socket buffers, fixed size
+// chunks, or shared memory), rather than into a std::vector<uint8_t> that
+// would subsequently have to be copied.
+//
+// Since envelopes (see cbor::EnvelopeEncoder) carry the byte length of
+// their contents, which is only known after the contents have been written,
+// implementations must support patching bytes that were appended earlier,
+// see ::Overwrite.
+class CRDTP_EXPORT ByteSink {
+ public:
+  virtual ~ByteSink() = default;
+
+  // Appends |bytes| at the end.
+  virtual void Append(span<uint8_t> bytes) = 0;
+
+  // Appends a single |byte| at the end.
+  void Append(uint8_t byte) { Append(span<uint8_t>(&byte, 1)); }
+
+  // The number of bytes that were appended so far. This is the position
+  // at which the next byte will be appended.
+  virtual size_t size() const = 0;
+
+  // Overwrites the bytes at |pos|, which must have been appended before,
+  // that is, |pos + bytes.size() <= size()|.
+  virtual void Overwrite(size_t pos, span<uint8_t> bytes) = 0;
+
+  // Discards all bytes. Used by the encoders when an error is encountered.
+  virtual void Clear() = 0;
+
+  // Yields false iff bytes were dropped because the sink ran out of space.
+  virtual bool ok() const { return true; }
+};
+
+// =============================================================================
+// VectorByteSink - Appends to a std::vector<uint8_t> owned by the caller.
+// =============================================================================
+class CRDTP_EXPORT VectorByteSink : public ByteSink {
+ public:
+  explicit VectorByteSink(std::vector<uint8_t>* out) : out_(out) {}
+
+  void Append(span<uint8_t> bytes) override;
+  using ByteSink::Append;
+  size_t size() const override;
+  void Overwrite(size_t pos, span<uint8_t> bytes) override;
+  void Clear() override;
+
+ private:
+  std::vector<uint8_t>* const out_;
+};
+
+// =============================================================================
+// FixedByteSink - Writes into a caller provided buffer of fixed capacity.
+// =============================================================================
+
+// If more bytes are appended than fit into the buffer, the excess bytes
+// are dropped and ::ok() yields false. ::size() keeps counting, so that
+// after an unsuccessful attempt the caller knows how much space is needed.
+class CRDTP_EXPORT FixedByteSink : public ByteSink {
+ public:
+  FixedByteSink(uint8_t* buffer, size_t capacity)
+      : buffer_(buffer), capacity_(capacity) {}
+
+  void Append(span<uint8_t> bytes) override;
+  using ByteSink::Append;
+  size_t size() const override;
+  void Overwrite(size_t pos, span<uint8_t> bytes) override;
+  void Clear() override;
+  bool ok() const override;
+
+  // The bytes that were written into the buffer.
+  span<uint8_t> written() const;
+
+ private:
+  uint8_t* const buffer_;
+  const size_t capacity_;
+  size_t size_ = 0;
+};
+
+// =============================================================================
+// ChunkedByteSink - Writes into a list of chunks with fixed capacity.
+// =============================================================================
+
+// Every chunk but the last one holds exactly |chunk_size| bytes. This
+// avoids the reallocation and copying which occurs when a single vector
+// grows, and the chunks can be handed to a transport one by one.
+class CRDTP_EXPORT ChunkedByteSink : public ByteSink {
+ public:
+  explicit ChunkedByteSink(size_t chunk_size = 4096);
+
+  void Append(span<uint8_t> bytes) override;
+  using ByteSink::Append;
+  size_t size() const override;
+  void Overwrite(size_t pos, span<uint8_t> bytes) override;
+  void Clear() override;
+
+  const std::vector<std::vector<uint8_t>>& chunks() const { return chunks_; }
+
+  // Moves the chunks out of this sink, leaving it empty.
+  std::vector<std::vector<uint8_t>> TakeChunks();
+
+ private:
+  const size_t chunk_size_;
+  size_t size_ = 0;
+  std::vector<std::vector<uint8_t>> chunks_;
+};
+}  // namespace crdtp
+
+#endif  // CRDTP_BYTE_SINK_H_
@@ -0,0 +1,89 @@
+// Copyright 2020 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "byte_sink.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "test_platform.h"
+
+namespace crdtp {
+// =============================================================================
+// VectorByteSink - Appends to a std::vector<uint8_t> owned by the caller.
+// =============================================================================
+
+TEST(VectorByteSinkTest, AppendsAndOverwrites) {
+  std::vector<uint8_t> out = {1};
+  VectorByteSink sink(&out);
+  sink.Append(SpanFrom("ab"));
+  sink.Append(static_cast<uint8_t>('c'));
+  EXPECT_EQ(4u, sink.size());
+  EXPECT_THAT(out, testing::ElementsAre(1, 'a', 'b', 'c'));
+  sink.Overwrite(1, SpanFrom("xy"));
+  EXPECT_THAT(out, testing::ElementsAre(1, 'x', 'y', 'c'));
+  EXPECT_TRUE(sink.ok());
+  sink.Clear();
+  EXPECT_TRUE(out.empty());
+}
+
+// =============================================================================
+// FixedByteSink - Writes into a caller provided buffer of fixed capacity.
+// =============================================================================
+
+TEST(FixedByteSinkTest, WritesIntoBuffer) {
+  uint8_t buffer[4] = {0, 0, 0, 0};
+  FixedByteSink sink(buffer, sizeof(buffer));
+  sink.Append(SpanFrom("abcd"));
+  sink.Overwrite(2, SpanFrom("x"));
+  EXPECT_TRUE(sink.ok());
+  EXPECT_EQ("abxd", std::string(sink.written().begin(), sink.written().end()));
+}
+
+TEST(FixedByteSinkTest, DropsExcessBytes) {
+  uint8_t buffer[4] = {0, 0, 0, 0};
+  FixedByteSink sink(buffer, sizeof(buffer));
+  sink.Append(SpanFrom("abc"));
+  sink.Append(SpanFrom("def"));
+  EXPECT_FALSE(sink.ok());
+  // The size keeps counting, so the client knows how much space is needed.
+  EXPECT_EQ(6u, sink.size());
+  EXPECT_EQ("abcd", std::string(sink.written().begin(), sink.written().end()));
+  // Overwriting across the capacity only patches the bytes that fit.
+  sink.Overwrite(3, SpanFrom("xyz"));
+  EXPECT_EQ("abcx", std::string(sink.written().begin(), sink.written().end()));
+  sink.Clear();
+  EXPECT_TRUE(sink.ok());
+  EXPECT_EQ(0u, sink.size());
+}
+
+// =============================================================================
+// ChunkedByteSink - Writes into a list of chunks with fixed capacity.
+// =============================================================================
+
+TEST(ChunkedByteSinkTest, SplitsIntoChunks) {
+  ChunkedByteSink sink(/*chunk_size=*/3);
+  sink.Append(SpanFrom("ab"));
+  sink.Append(SpanFrom("cdefg"));
+  EXPECT_EQ(7u, sink.size());
+  ASSERT_EQ(3u, sink.chunks().size());
+  EXPECT_THAT(sink.chunks()[0], testing::ElementsAre('a', 'b', 'c'));
+  EXPECT_THAT(sink.chunks()[1], testing::ElementsAre('d', 'e', 'f'));
+  EXPECT_THAT(sink.chunks()[2], testing::ElementsAre('g'));
+}
+
+TEST(ChunkedByteSinkTest, OverwriteAcrossChunkBoundary) {
+  ChunkedByteSink sink(/*chunk_size=*/3);
+  sink.Append(SpanFrom("abcdefg"));
+  sink.Overwrite(2, SpanFrom("XYZW"));
+  std::vector<std::vector<uint8_t>> chunks = sink.TakeChunks();
+  EXPECT_EQ(0u, sink.size());
+  EXPECT_TRUE(sink.chunks().empty());
+  ASSERT_EQ(3u, chunks.size());
+  EXPECT_THAT(chunks[0], testing::ElementsAre('a', 'b', 'X'));
+  EXPECT_THAT(chunks[1], testing::ElementsAre('Y', 'Z', 'W'));
+  EXPECT_THAT(chunks[2], testing::ElementsAre('g'));
+}
+}  // namespace crdtp
@@ -7,10 +7,22 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <limits>
 #include <stack>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CRDTP_CBOR_USE_SSE2
+#endif
+
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
+    defined(_WIN32)
+#define CRDTP_CBOR_LITTLE_ENDIAN
+#endif
+
 namespace crdtp {
 namespace cbor {
 namespace {
@@ -71,20 +83,59 @@ static constexpr uint8_t kEncodedFalse =
     EncodeInitialByte(MajorType::SIMPLE_VALUE, 20);
 static constexpr uint8_t kEncodedNull =
     EncodeInitialByte(MajorType::SIMPLE_VALUE, 22);
+static constexpr uint8_t kInitialByteForHalf =
+    EncodeInitialByte(MajorType::SIMPLE_VALUE, 25);
+static constexpr uint8_t kInitialByteForSingle =
+    EncodeInitialByte(MajorType::SIMPLE_VALUE, 26);
 static constexpr uint8_t kInitialByteForDouble =
     EncodeInitialByte(MajorType::SIMPLE_VALUE, 27);
 
+// The tag value for a string reference, see StringRefTable. It's greater
+// than 23, so the tag is encoded as kInitialByteForEnvelope (tag with a 1
+// byte value) followed by this byte.
+static constexpr uint8_t kStringRefTag = 25;
+
 // See RFC 7049 Table 3 and Section 2.4.4.2. This is used as a prefix for
 // arbitrary binary data encoded as BYTE_STRING.
 static constexpr uint8_t kExpectedConversionToBase64Tag =
     EncodeInitialByte(MajorType::TAG, 22);
 
+// The encoding routines are templates which work with |C| being either
+// std::vector<uint8_t> or ByteSink; these overloads paper over the
+// differences between the two.
+inline void Append(uint8_t byte, std::vector<uint8_t>* out) {
+  out->push_back(byte);
+}
+inline void Append(uint8_t byte, ByteSink* out) {
+  out->Append(byte);
+}
+inline void Append(span<uint8_t> bytes, std::vector<uint8_t>* out) {
+  out->insert(out->end(), bytes.begin(), bytes.end());
+}
+inline void Append(span<uint8_t> bytes, ByteSink* out) {
+  out->Append(bytes);
+}
+inline void Overwrite(size_t pos,
+                      span<uint8_t> bytes,
+                      std::vector<uint8_t>* out) {
+  std::copy(bytes.begin(), bytes.end(), out->begin() + pos);
+}
+inline void Overwrite(size_t pos, span<uint8_t> bytes, ByteSink* out) {
+  out->Overwrite(pos, bytes);
+}
+inline void Clear(std::vector<uint8_t>* out) {
+  out->clear();
+}
+inline void Clear(ByteSink* out) {
+  out->Clear();
+}
+
 // Writes the bytes for |v| to |out|, starting with the most significant byte.
 // See also: https://commandcenter.blogspot.com/2012/04/byte-order-fallacy.html
 template <typename T>
-void WriteBytesMostSignificantByteFirst(T v, std::vector<uint8_t>* out) {
+void WriteBytesMostSignificantByteFirst(T v, uint8_t* out) {
   for (int shift_bytes = sizeof(T) - 1; shift_bytes >= 0; --shift_bytes)
-    out->push_back(0xff & (v >> (shift_bytes * 8)));
+    *out++ = 0xff & (v >> (shift_bytes * 8));
 }
 
 // Extracts sizeof(T) bytes from |in| to extract a value of type T
@@ -150,39 +201,55 @@ size_t ReadTokenStart(span<uint8_t> bytes, MajorType* type, uint64_t* value) {
   return 0;
 }
 
-// Writes the start of a token with |type|. The |value| may indicate the size,
-// or it may be the payload if the value is an unsigned integer.
-void WriteTokenStart(MajorType type,
-                     uint64_t value,
-                     std::vector<uint8_t>* encoded) {
+// Writes the start of a token with |type| into |buffer|, which must have
+// room for at least 9 bytes. Returns the number of bytes written.
+size_t WriteTokenStartToBuffer(MajorType type,
+                               uint64_t value,
+                               uint8_t* buffer) {
   if (value < 24) {
     // Values 0-23 are encoded directly into the additional info of the
     // initial byte.
-    encoded->push_back(EncodeInitialByte(type, /*additional_info=*/value));
-    return;
+    buffer[0] = EncodeInitialByte(type, /*additional_info=*/value);
+    return 1;
   }
   if (value <= std::numeric_limits<uint8_t>::max()) {
     // Values 24-255 are encoded with one initial byte, followed by the value.
-    encoded->push_back(EncodeInitialByte(type, kAdditionalInformation1Byte));
-    encoded->push_back(value);
-    return;
+    buffer[0] = EncodeInitialByte(type, kAdditionalInformation1Byte);
+    buffer[1] = value;
+    return 2;
   }
   if (value <= std::numeric_limits<uint16_t>::max()) {
     // Values 256-65535: 1 initial byte + 2 bytes payload.
-    encoded->push_back(EncodeInitialByte(type, kAdditionalInformation2Bytes));
-    WriteBytesMostSignificantByteFirst<uint16_t>(value, encoded);
-    return;
+    buffer[0] = EncodeInitialByte(type, kAdditionalInformation2Bytes);
+    WriteBytesMostSignificantByteFirst<uint16_t>(value, buffer + 1);
+    return 3;
   }
   if (value <= std::numeric_limits<uint32_t>::max()) {
     // 32 bit uint: 1 initial byte + 4 bytes payload.
-    encoded->push_back(EncodeInitialByte(type, kAdditionalInformation4Bytes));
+    buffer[0] = EncodeInitialByte(type, kAdditionalInformation4Bytes);
     WriteBytesMostSignificantByteFirst<uint32_t>(static_cast<uint32_t>(value),
-                                                 encoded);
-    return;
+                                                 buffer + 1);
+    return 5;
   }
   // 64 bit uint: 1 initial byte + 8 bytes payload.
-  encoded->push_back(EncodeInitialByte(type, kAdditionalInformation8Bytes));
-  WriteBytesMostSignificantByteFirst<uint64_t>(value, encoded);
+  buffer[0] = EncodeInitialByte(type, kAdditionalInformation8Bytes);
+  WriteBytesMostSignificantByteFirst<uint64_t>(value, buffer + 1);
+  return 9;
+}
+
+// Writes the start of a token with |type|. The |value| may indicate the size,
+// or it may be the payload if the value is an unsigned integer.
+template <typename C>
+void WriteTokenStartTmpl(MajorType type, uint64_t value, C* encoded) {
+  uint8_t buffer[1 + sizeof(uint64_t)];
+  size_t size = WriteTokenStartToBuffer(type, value, buffer);
+  Append(span<uint8_t>(buffer, size), encoded);
+}
+
+void WriteTokenStart(MajorType type,
+                     uint64_t value,
+                     std::vector<uint8_t>* encoded) {
+  WriteTokenStartTmpl(type, value, encoded);
 }
 }  // namespace internals
 
@@ -245,18 +312,49 @@ uint8_t EncodeStop() {
   return kStopByte;
 }
 
-void EncodeInt32(int32_t value, std::vector<uint8_t>* out) {
+void EncodeDefiniteLengthArrayStart(uint64_t length,
+                                    std::vector<uint8_t>* out) {
+  internals::WriteTokenStartTmpl(MajorType::ARRAY, length, out);
+}
+
+void EncodeDefiniteLengthArrayStart(uint64_t length, ByteSink* out) {
+  internals::WriteTokenStartTmpl(MajorType::ARRAY, length, out);
+}
+
+void EncodeDefiniteLengthMapStart(uint64_t num_pairs,
+                                  std::vector<uint8_t>* out) {
+  internals::WriteTokenStartTmpl(MajorType::MAP, num_pairs, out);
+}
+
+void EncodeDefiniteLengthMapStart(uint64_t num_pairs, ByteSink* out) {
+  internals::WriteTokenStartTmpl(MajorType::MAP, num_pairs, out);
+}
+
+namespace {
+template <typename C>
+void EncodeInt32Tmpl(int32_t value, C* out) {
   if (value >= 0) {
-    internals::WriteTokenStart(MajorType::UNSIGNED, value, out);
+    internals::WriteTokenStartTmpl(MajorType::UNSIGNED, value, out);
   } else {
     uint64_t representation = static_cast<uint64_t>(-(value + 1));
-    internals::WriteTokenStart(MajorType::NEGATIVE, representation, out);
+    internals::WriteTokenStartTmpl(MajorType::NEGATIVE, representation, out);
   }
 }
 
-void EncodeString16(span<uint16_t> in, std::vector<uint8_t>* out) {
+template <typename C>
+void EncodeInt64Tmpl(int64_t value, C* out) {
+  if (value >= 0) {
+    internals::WriteTokenStartTmpl(MajorType::UNSIGNED, value, out);
+  } else {
+    uint64_t representation = static_cast<uint64_t>(-(value + 1));
+    internals::WriteTokenStartTmpl(MajorType::NEGATIVE, representation, out);
+  }
+}
+
+template <typename C>
+void EncodeString16Tmpl(span<uint16_t> in, C* out) {
   uint64_t byte_length = static_cast<uint64_t>(in.size_bytes());
-  internals::WriteTokenStart(MajorType::BYTE_STRING, byte_length, out);
+  internals::WriteTokenStartTmpl(MajorType::BYTE_STRING, byte_length, out);
   // When emitting UTF16 characters, we always write the least significant byte
   // first; this is because it's the native representation for X86.
   // TODO(johannes): Implement a more efficient thing here later, e.g.
@@ -266,118 +364,543 @@ void EncodeString16(span<uint16_t> in, std::vector<uint8_t>* out) {
   // golden files, unittests, etc. that port easily and universally.
   // See also:
   // https://commandcenter.blogspot.com/2012/04/byte-order-fallacy.html
+  uint8_t buffer[256];
+  size_t pos = 0;
   for (const uint16_t two_bytes : in) {
-    out->push_back(two_bytes);
-    out->push_back(two_bytes >> 8);
+    if (pos == sizeof(buffer)) {
+      Append(span<uint8_t>(buffer, pos), out);
+      pos = 0;
+    }
+    buffer[pos++] = two_bytes;
+    buffer[pos++] = two_bytes >> 8;
   }
+  Append(span<uint8_t>(buffer, pos), out);
 }
 
-void EncodeString8(span<uint8_t> in, std::vector<uint8_t>* out) {
-  internals::WriteTokenStart(MajorType::STRING,
-                             static_cast<uint64_t>(in.size_bytes()), out);
-  out->insert(out->end(), in.begin(), in.end());
+template <typename C>
+void EncodeString8Tmpl(span<uint8_t> in, C* out) {
+  internals::WriteTokenStartTmpl(MajorType::STRING,
+                                 static_cast<uint64_t>(in.size_bytes()), out);
+  Append(in, out);
 }
 
-void EncodeFromLatin1(span<uint8_t> latin1, std::vector<uint8_t>* out) {
-  for (size_t ii = 0; ii < latin1.size(); ++ii) {
-    if (latin1[ii] <= 127)
+// The following routines convert Latin-1 and UTF-16 strings to UTF-8.
+// Since DevTools strings are mostly US-ASCII, they process runs of ASCII
+// characters 16 at a time if SSE2 is available; everything else is
+// handled one character at a time.
+
+// Yields the number of leading US-ASCII characters in |in|.
+size_t CountLeadingASCII(const uint8_t* in, size_t size) {
+  size_t ii = 0;
+#if defined(CRDTP_CBOR_USE_SSE2)
+  for (; ii + 16 <= size; ii += 16) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    if (_mm_movemask_epi8(chars))  // Any byte with the high bit set?
+      break;
+  }
+#endif
+  while (ii < size && in[ii] < 0x80)
+    ++ii;
+  return ii;
+}
+
+size_t CountLeadingASCII(const uint16_t* in, size_t size) {
+  size_t ii = 0;
+#if defined(CRDTP_CBOR_USE_SSE2)
+  const __m128i non_ascii_bits = _mm_set1_epi16(static_cast<int16_t>(0xff80));
+  const __m128i zero = _mm_setzero_si128();
+  for (; ii + 8 <= size; ii += 8) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    const __m128i ascii =
+        _mm_cmpeq_epi16(_mm_and_si128(chars, non_ascii_bits), zero);
+    if (_mm_movemask_epi8(ascii) != 0xffff)
+      break;
+  }
+#endif
+  while (ii < size && in[ii] < 0x80)
+    ++ii;
+  return ii;
+}
+
+// Like CountLeadingASCII, but also copies the US-ASCII characters (one
+// byte each) to |out|, which must have room for |size| bytes.
+size_t CopyLeadingASCII(const uint8_t* in, size_t size, uint8_t* out) {
+  const size_t ascii = CountLeadingASCII(in, size);
+  memcpy(out, in, ascii);
+  return ascii;
+}
+
+size_t CopyLeadingASCII(const uint16_t* in, size_t size, uint8_t* out) {
+  size_t ii = 0;
+#if defined(CRDTP_CBOR_USE_SSE2)
+  const __m128i non_ascii_bits = _mm_set1_epi16(static_cast<int16_t>(0xff80));
+  const __m128i zero = _mm_setzero_si128();
+  for (; ii + 16 <= size; ii += 16) {
+    const __m128i low =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    const __m128i high =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii + 8));
+    const __m128i ascii = _mm_cmpeq_epi16(
+        _mm_and_si128(_mm_or_si128(low, high), non_ascii_bits), zero);
+    if (_mm_movemask_epi8(ascii) != 0xffff)
+      break;
+    // All characters are < 0x80, so the saturation doesn't kick in.
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + ii),
+                     _mm_packus_epi16(low, high));
+  }
+#endif
+  for (; ii < size && in[ii] < 0x80; ++ii)
+    out[ii] = static_cast<uint8_t>(in[ii]);
+  return ii;
+}
+
+bool IsHighSurrogate(uint16_t ch) {
+  return ch >= 0xd800 && ch <= 0xdbff;
+}
+
+bool IsLowSurrogate(uint16_t ch) {
+  return ch >= 0xdc00 && ch <= 0xdfff;
+}
+
+// Computes the length of |utf16| when converted to UTF-8. Yields false
+// if |utf16| has unpaired surrogates, which UTF-8 can't represent.
+bool UTF8LengthOfUTF16(span<uint16_t> utf16, size_t* length) {
+  size_t utf8_length = 0;
+  size_t ii = 0;
+  while (ii < utf16.size()) {
+    const size_t ascii =
+        CountLeadingASCII(utf16.data() + ii, utf16.size() - ii);
+    utf8_length += ascii;
+    ii += ascii;
+    if (ii == utf16.size())
+      break;
+    const uint16_t ch = utf16[ii++];
+    if (ch < 0x800) {
+      utf8_length += 2;
+    } else if (IsHighSurrogate(ch)) {
+      if (ii == utf16.size() || !IsLowSurrogate(utf16[ii]))
+        return false;
+      ++ii;
+      utf8_length += 4;
+    } else if (IsLowSurrogate(ch)) {
+      return false;
+    } else {
+      utf8_length += 3;
+    }
+  }
+  *length = utf8_length;
+  return true;
+}
+
+// Appends |utf16|, which must not have unpaired surrogates, as UTF-8.
+template <typename C>
+void AppendUTF8FromUTF16(span<uint16_t> utf16, C* out) {
+  uint8_t buffer[256];
+  size_t pos = 0;
+  size_t ii = 0;
+  while (ii < utf16.size()) {
+    const size_t ascii =
+        CopyLeadingASCII(utf16.data() + ii,
+                         std::min(utf16.size() - ii, sizeof(buffer) - pos),
+                         buffer + pos);
+    ii += ascii;
+    pos += ascii;
+    if (sizeof(buffer) - pos < 4) {  // Room for the longest sequence.
+      Append(span<uint8_t>(buffer, pos), out);
+      pos = 0;
       continue;
-    // If there's at least one non-ASCII char, convert to UTF8.
-    std::vector<uint8_t> utf8(latin1.begin(), latin1.begin() + ii);
-    for (; ii < latin1.size(); ++ii) {
-      if (latin1[ii] <= 127) {
-        utf8.push_back(latin1[ii]);
-      } else {
-        // 0xC0 means it's a UTF8 sequence with 2 bytes.
-        utf8.push_back((latin1[ii] >> 6) | 0xc0);
-        utf8.push_back((latin1[ii] | 0x80) & 0xbf);
-      }
     }
-    EncodeString8(SpanFrom(utf8), out);
-    return;
+    if (ii == utf16.size())
+      break;
+    const uint32_t ch = utf16[ii++];
+    if (ch < 0x800) {
+      buffer[pos++] = 0xc0 | (ch >> 6);
+      buffer[pos++] = 0x80 | (ch & 0x3f);
+    } else if (IsHighSurrogate(ch)) {
+      const uint32_t codepoint =
+          0x10000 + ((ch - 0xd800) << 10) + (utf16[ii++] - 0xdc00);
+      buffer[pos++] = 0xf0 | (codepoint >> 18);
+      buffer[pos++] = 0x80 | ((codepoint >> 12) & 0x3f);
+      buffer[pos++] = 0x80 | ((codepoint >> 6) & 0x3f);
+      buffer[pos++] = 0x80 | (codepoint & 0x3f);
+    } else {
+      buffer[pos++] = 0xe0 | (ch >> 12);
+      buffer[pos++] = 0x80 | ((ch >> 6) & 0x3f);
+      buffer[pos++] = 0x80 | (ch & 0x3f);
+    }
   }
-  EncodeString8(latin1, out);
+  Append(span<uint8_t>(buffer, pos), out);
 }
 
-void EncodeFromUTF16(span<uint16_t> utf16, std::vector<uint8_t>* out) {
-  // If there's at least one non-ASCII char, encode as STRING16 (UTF16).
-  for (uint16_t ch : utf16) {
-    if (ch <= 127)
+template <typename C>
+void EncodeFromLatin1Tmpl(span<uint8_t> latin1, C* out) {
+  size_t ii = CountLeadingASCII(latin1.data(), latin1.size());
+  if (ii == latin1.size()) {
+    EncodeString8Tmpl(latin1, out);
+    return;
+  }
+  // There's at least one non-ASCII char, which takes two bytes in UTF-8.
+  size_t utf8_length = latin1.size();
+  for (; ii < latin1.size(); ++ii)
+    utf8_length += latin1[ii] >> 7;
+  internals::WriteTokenStartTmpl(MajorType::STRING,
+                                 static_cast<uint64_t>(utf8_length), out);
+  uint8_t buffer[256];
+  size_t pos = 0;
+  ii = 0;
+  while (ii < latin1.size()) {
+    const size_t ascii =
+        CopyLeadingASCII(latin1.data() + ii,
+                         std::min(latin1.size() - ii, sizeof(buffer) - pos),
+                         buffer + pos);
+    ii += ascii;
+    pos += ascii;
+    if (sizeof(buffer) - pos < 2) {
+      Append(span<uint8_t>(buffer, pos), out);
+      pos = 0;
       continue;
-    EncodeString16(utf16, out);
+    }
+    if (ii == latin1.size())
+      break;
+    // 0xC0 means it's a UTF8 sequence with 2 bytes.
+    buffer[pos++] = (latin1[ii] >> 6) | 0xc0;
+    buffer[pos++] = (latin1[ii] | 0x80) & 0xbf;
+    ++ii;
+  }
+  Append(span<uint8_t>(buffer, pos), out);
+}
+
+template <typename C>
+void EncodeFromUTF16Tmpl(span<uint16_t> utf16, C* out) {
+  size_t utf8_length;
+  if (!UTF8LengthOfUTF16(utf16, &utf8_length)) {
+    // Unpaired surrogates can only be represented as STRING16 (UTF16).
+    EncodeString16Tmpl(utf16, out);
     return;
   }
-  // It's all US-ASCII, strip out every second byte and encode as UTF8.
-  internals::WriteTokenStart(MajorType::STRING,
-                             static_cast<uint64_t>(utf16.size()), out);
-  out->insert(out->end(), utf16.begin(), utf16.end());
+  internals::WriteTokenStartTmpl(MajorType::STRING,
+                                 static_cast<uint64_t>(utf8_length), out);
+  AppendUTF8FromUTF16(utf16, out);
 }
 
-void EncodeBinary(span<uint8_t> in, std::vector<uint8_t>* out) {
-  out->push_back(kExpectedConversionToBase64Tag);
+template <typename C>
+void EncodeBinaryTmpl(span<uint8_t> in, C* out) {
+  Append(kExpectedConversionToBase64Tag, out);
   uint64_t byte_length = static_cast<uint64_t>(in.size_bytes());
-  internals::WriteTokenStart(MajorType::BYTE_STRING, byte_length, out);
-  out->insert(out->end(), in.begin(), in.end());
+  internals::WriteTokenStartTmpl(MajorType::BYTE_STRING, byte_length, out);
+  Append(in, out);
+}
+}  // namespace
+
+void EncodeInt32(int32_t value, std::vector<uint8_t>* out) {
+  EncodeInt32Tmpl(value, out);
+}
+
+void EncodeInt32(int32_t value, ByteSink* out) {
+  EncodeInt32Tmpl(value, out);
+}
+
+void EncodeInt64(int64_t value, std::vector<uint8_t>* out) {
+  EncodeInt64Tmpl(value, out);
+}
+
+void EncodeInt64(int64_t value, ByteSink* out) {
+  EncodeInt64Tmpl(value, out);
+}
+
+void EncodeUint64(uint64_t value, std::vector<uint8_t>* out) {
+  internals::WriteTokenStartTmpl(MajorType::UNSIGNED, value, out);
+}
+
+void EncodeUint64(uint64_t value, ByteSink* out) {
+  internals::WriteTokenStartTmpl(MajorType::UNSIGNED, value, out);
+}
+
+void EncodeString16(span<uint16_t> in, std::vector<uint8_t>* out) {
+  EncodeString16Tmpl(in, out);
+}
+
+void EncodeString16(span<uint16_t> in, ByteSink* out) {
+  EncodeString16Tmpl(in, out);
+}
+
+void EncodeString8(span<uint8_t> in, std::vector<uint8_t>* out) {
+  EncodeString8Tmpl(in, out);
+}
+
+void EncodeString8(span<uint8_t> in, ByteSink* out) {
+  EncodeString8Tmpl(in, out);
+}
+
+void EncodeFromLatin1(span<uint8_t> latin1, std::vector<uint8_t>* out) {
+  EncodeFromLatin1Tmpl(latin1, out);
+}
+
+void EncodeFromLatin1(span<uint8_t> latin1, ByteSink* out) {
+  EncodeFromLatin1Tmpl(latin1, out);
+}
+
+void EncodeFromUTF16(span<uint16_t> utf16, std::vector<uint8_t>* out) {
+  EncodeFromUTF16Tmpl(utf16, out);
+}
+
+void EncodeFromUTF16(span<uint16_t> utf16, ByteSink* out) {
+  EncodeFromUTF16Tmpl(utf16, out);
+}
+
+void EncodeBinary(span<uint8_t> in, std::vector<uint8_t>* out) {
+  EncodeBinaryTmpl(in, out);
+}
+
+void EncodeBinary(span<uint8_t> in, ByteSink* out) {
+  EncodeBinaryTmpl(in, out);
 }
 
 // A double is encoded with a specific initial byte
 // (kInitialByteForDouble) plus the 64 bits of payload for its value.
 constexpr size_t kEncodedDoubleSize = 1 + sizeof(uint64_t);
+// Likewise for half (kInitialByteForHalf) and single
+// (kInitialByteForSingle) precision floats.
+constexpr size_t kEncodedHalfSize = 1 + sizeof(uint16_t);
+constexpr size_t kEncodedSingleSize = 1 + sizeof(uint32_t);
 
 // An envelope is encoded with a specific initial byte
 // (kInitialByteForEnvelope), plus the start byte for a BYTE_STRING with a 32
 // bit wide length, plus a 32 bit length for that string.
 constexpr size_t kEncodedEnvelopeHeaderSize = 1 + 1 + sizeof(uint32_t);
 
-void EncodeDouble(double value, std::vector<uint8_t>* out) {
+namespace {
+template <typename C>
+void EncodeDoubleTmpl(double value, C* out) {
   // The additional_info=27 indicates 64 bits for the double follow.
   // See RFC 7049 Section 2.3, Table 1.
-  out->push_back(kInitialByteForDouble);
+  uint8_t buffer[kEncodedDoubleSize];
+  buffer[0] = kInitialByteForDouble;
   union {
     double from_double;
     uint64_t to_uint64;
   } reinterpret;
   reinterpret.from_double = value;
-  WriteBytesMostSignificantByteFirst<uint64_t>(reinterpret.to_uint64, out);
+  WriteBytesMostSignificantByteFirst<uint64_t>(reinterpret.to_uint64,
+                                               buffer + 1);
+  Append(span<uint8_t>(buffer, kEncodedDoubleSize), out);
+}
+
+// Yields true iff the single precision float with bits |single| is exactly
+// representable as a half precision float (IEEE 754 binary16), in which
+// case its bits are stored into |half|. NaN must be excluded by the caller.
+bool SingleToHalf(uint32_t single, uint16_t* half) {
+  const uint16_t sign = static_cast<uint16_t>((single >> 16) & 0x8000);
+  const uint32_t exponent = (single >> 23) & 0xff;
+  const uint32_t mantissa = single & 0x7fffff;
+  if (exponent == 0xff) {  // Infinity.
+    *half = sign | 0x7c00;
+    return true;
+  }
+  if (exponent == 0) {  // Zero; single precision subnormals are too small.
+    if (mantissa)
+      return false;
+    *half = sign;
+    return true;
+  }
+  const int unbiased = static_cast<int>(exponent) - 127;
+  if (unbiased >= -14 && unbiased <= 15) {  // Half precision normal.
+    if (mantissa & 0x1fff)
+      return false;
+    *half = sign | static_cast<uint16_t>((unbiased + 15) << 10) |
+            static_cast<uint16_t>(mantissa >> 13);
+    return true;
+  }
+  if (unbiased >= -24 && unbiased < -14) {  // Half precision subnormal.
+    // The value is (0x800000 | mantissa) * 2^(unbiased - 23), and the
+    // subnormal half has value m * 2^-24.
+    const uint32_t significand = 0x800000 | mantissa;
+    const int shift = -(unbiased + 1);
+    if (significand & ((1u << shift) - 1))
+      return false;
+    *half = sign | static_cast<uint16_t>(significand >> shift);
+    return true;
+  }
+  return false;
+}
+
+template <typename C>
+void EncodeCompactDoubleTmpl(double value, C* out) {
+  // Narrowing a finite value beyond the float range is undefined.
+  if (std::isfinite(value) &&
+      std::fabs(value) > std::numeric_limits<float>::max()) {
+    EncodeDoubleTmpl(value, out);
+    return;
+  }
+  const float single = static_cast<float>(value);
+  // This comparison is false for NaN, so it's encoded with 64 bits.
+  if (static_cast<double>(single) != value) {
+    EncodeDoubleTmpl(value, out);
+    return;
+  }
+  union {
+    float from_float;
+    uint32_t to_uint32;
+  } reinterpret;
+  reinterpret.from_float = single;
+  uint16_t half;
+  if (SingleToHalf(reinterpret.to_uint32, &half)) {
+    uint8_t buffer[kEncodedHalfSize];
+    buffer[0] = kInitialByteForHalf;
+    WriteBytesMostSignificantByteFirst<uint16_t>(half, buffer + 1);
+    Append(span<uint8_t>(buffer, kEncodedHalfSize), out);
+    return;
+  }
+  uint8_t buffer[kEncodedSingleSize];
+  buffer[0] = kInitialByteForSingle;
+  WriteBytesMostSignificantByteFirst<uint32_t>(reinterpret.to_uint32,
+                                               buffer + 1);
+  Append(span<uint8_t>(buffer, kEncodedSingleSize), out);
+}
+}  // namespace
+
+void EncodeDouble(double value, std::vector<uint8_t>* out) {
+  EncodeDoubleTmpl(value, out);
+}
+
+void EncodeDouble(double value, ByteSink* out) {
+  EncodeDoubleTmpl(value, out);
+}
+
+void EncodeCompactDouble(double value, std::vector<uint8_t>* out) {
+  EncodeCompactDoubleTmpl(value, out);
+}
+
+void EncodeCompactDouble(double value, ByteSink* out) {
+  EncodeCompactDoubleTmpl(value, out);
 }
 
 // =============================================================================
 // cbor::EnvelopeEncoder - for wrapping submessages
 // =============================================================================
 
-void EnvelopeEncoder::EncodeStart(std::vector<uint8_t>* out) {
-  assert(byte_size_pos_ == 0);
-  out->push_back(kInitialByteForEnvelope);
-  out->push_back(kInitialByteFor32BitLengthByteString);
-  byte_size_pos_ = out->size();
-  out->resize(out->size() + sizeof(uint32_t));
+namespace {
+template <typename C>
+size_t EncodeEnvelopeStart(C* out) {
+  // The four bytes for the size are patched up by EncodeEnvelopeStop.
+  static constexpr uint8_t kEnvelopeHeader[kEncodedEnvelopeHeaderSize] = {
+      kInitialByteForEnvelope, kInitialByteFor32BitLengthByteString, 0, 0, 0,
+      0};
+  Append(span<uint8_t>(kEnvelopeHeader, kEncodedEnvelopeHeaderSize), out);
+  return out->size() - sizeof(uint32_t);
 }
 
-bool EnvelopeEncoder::EncodeStop(std::vector<uint8_t>* out) {
-  assert(byte_size_pos_ != 0);
+template <typename C>
+bool EncodeEnvelopeStop(size_t byte_size_pos, C* out) {
   // The byte size is the size of the payload, that is, all the
   // bytes that were written past the byte size position itself.
-  uint64_t byte_size = out->size() - (byte_size_pos_ + sizeof(uint32_t));
+  uint64_t byte_size = out->size() - (byte_size_pos + sizeof(uint32_t));
   // We store exactly 4 bytes, so at most INT32MAX, with most significant
   // byte first.
   if (byte_size > std::numeric_limits<uint32_t>::max())
     return false;
-  for (int shift_bytes = sizeof(uint32_t) - 1; shift_bytes >= 0;
-       --shift_bytes) {
-    (*out)[byte_size_pos_++] = 0xff & (byte_size >> (shift_bytes * 8));
-  }
+  uint8_t buffer[sizeof(uint32_t)];
+  WriteBytesMostSignificantByteFirst<uint32_t>(
+      static_cast<uint32_t>(byte_size), buffer);
+  Overwrite(byte_size_pos, span<uint8_t>(buffer, sizeof(uint32_t)), out);
   return true;
 }
+}  // namespace
+
+void EnvelopeEncoder::EncodeStart(std::vector<uint8_t>* out) {
+  assert(byte_size_pos_ == 0);
+  byte_size_pos_ = EncodeEnvelopeStart(out);
+}
+
+void EnvelopeEncoder::EncodeStart(ByteSink* out) {
+  assert(byte_size_pos_ == 0);
+  byte_size_pos_ = EncodeEnvelopeStart(out);
+}
+
+bool EnvelopeEncoder::EncodeStop(std::vector<uint8_t>* out) {
+  assert(byte_size_pos_ != 0);
+  return EncodeEnvelopeStop(byte_size_pos_, out);
+}
+
+bool EnvelopeEncoder::EncodeStop(ByteSink* out) {
+  assert(byte_size_pos_ != 0);
+  return EncodeEnvelopeStop(byte_size_pos_, out);
+}
+
+// =============================================================================
+// cbor::StringRefTable - session scoped string references
+// =============================================================================
+
+// Shorter strings don't get smaller by referencing them, and longer
+// strings would make the tables too large.
+static constexpr size_t kMinStringRefLength = 4;
+static constexpr size_t kMaxStringRefLength = 1024;
+
+StringRefTable::StringRefTable(size_t max_entries)
+    : max_entries_(max_entries) {}
+
+StringRefTable::~StringRefTable() {}
+
+bool StringRefTable::FindOrAdd(span<uint8_t> str, uint32_t* index) {
+  if (!IsEligible(str))
+    return false;
+  std::string key(str.begin(), str.end());
+  auto it = indices_.find(key);
+  if (it != indices_.end()) {
+    *index = it->second;
+    return true;
+  }
+  if (strings_.size() < max_entries_) {
+    indices_.emplace(key, static_cast<uint32_t>(strings_.size()));
+    strings_.push_back(std::move(key));
+  }
+  return false;
+}
+
+void StringRefTable::Add(span<uint8_t> str) {
+  if (IsEligible(str) && strings_.size() < max_entries_)
+    strings_.emplace_back(str.begin(), str.end());
+}
+
+span<uint8_t> StringRefTable::Get(uint32_t index) const {
+  assert(index < strings_.size());
+  return SpanFrom(strings_[index]);
+}
+
+size_t StringRefTable::size() const {
+  return strings_.size();
+}
+
+void StringRefTable::Truncate(size_t size) {
+  while (strings_.size() > size) {
+    indices_.erase(strings_.back());
+    strings_.pop_back();
+  }
+}
+
+bool StringRefTable::IsEligible(span<uint8_t> str) const {
+  return str.size() >= kMinStringRefLength &&
+         str.size() <= kMaxStringRefLength;
+}
 
 // =============================================================================
 // cbor::NewCBOREncoder - for encoding from a streaming parser
 // =============================================================================
 
 namespace {
+template <typename C>
 class CBOREncoder : public ParserHandler {
  public:
-  CBOREncoder(std::vector<uint8_t>* out, Status* status)
-      : out_(out), status_(status) {
+  CBOREncoder(C* out,
+              Status* status,
+              StringRefTable* string_refs,
+              bool compact_doubles)
+      : out_(out),
+        status_(status),
+        string_refs_(string_refs),
+        compact_doubles_(compact_doubles) {
     *status_ = Status();
   }
 
@@ -386,13 +909,13 @@ class CBOREncoder : public ParserHandler {
       return;
     envelopes_.emplace_back();
     envelopes_.back().EncodeStart(out_);
-    out_->push_back(kInitialByteIndefiniteLengthMap);
+    Append(kInitialByteIndefiniteLengthMap, out_);
   }
 
   void HandleMapEnd() override {
     if (!status_->ok())
       return;
-    out_->push_back(kStopByte);
+    Append(kStopByte, out_);
     assert(!envelopes_.empty());
     if (!envelopes_.back().EncodeStop(out_)) {
       HandleError(
@@ -407,13 +930,13 @@ class CBOREncoder : public ParserHandler {
       return;
     envelopes_.emplace_back();
     envelopes_.back().EncodeStart(out_);
-    out_->push_back(kInitialByteIndefiniteLengthArray);
+    Append(kInitialByteIndefiniteLengthArray, out_);
   }
 
   void HandleArrayEnd() override {
     if (!status_->ok())
       return;
-    out_->push_back(kStopByte);
+    Append(kStopByte, out_);
     assert(!envelopes_.empty());
     if (!envelopes_.back().EncodeStop(out_)) {
       HandleError(
@@ -426,12 +949,28 @@ class CBOREncoder : public ParserHandler {
   void HandleString8(span<uint8_t> chars) override {
     if (!status_->ok())
       return;
+    uint32_t index;
+    if (string_refs_ && string_refs_->FindOrAdd(chars, &index)) {
+      uint8_t tag[] = {kInitialByteForEnvelope, kStringRefTag};
+      Append(span<uint8_t>(tag, sizeof(tag)), out_);
+      internals::WriteTokenStartTmpl(MajorType::UNSIGNED, index, out_);
+      return;
+    }
     EncodeString8(chars, out_);
   }
 
   void HandleString16(span<uint16_t> chars) override {
     if (!status_->ok())
       return;
+    size_t utf8_length;
+    if (string_refs_ && UTF8LengthOfUTF16(chars, &utf8_length)) {
+      // EncodeFromUTF16 would emit STRING8, so the receiver records it.
+      std::vector<uint8_t> utf8;
+      utf8.reserve(utf8_length);
+      AppendUTF8FromUTF16(chars, &utf8);
+      HandleString8(SpanFrom(utf8));
+      return;
+    }
     EncodeFromUTF16(chars, out_);
   }
 
@@ -444,7 +983,10 @@ class CBOREncoder : public ParserHandler {
   void HandleDouble(double value) override {
     if (!status_->ok())
       return;
-    EncodeDouble(value, out_);
+    if (compact_doubles_)
+      EncodeCompactDouble(value, out_);
+    else
+      EncodeDouble(value, out_);
   }
 
   void HandleInt32(int32_t value) override {
@@ -453,37 +995,73 @@ class CBOREncoder : public ParserHandler {
     EncodeInt32(value, out_);
   }
 
+  void HandleInt64(int64_t value) override {
+    if (!status_->ok())
+      return;
+    EncodeInt64(value, out_);
+  }
+
   void HandleBool(bool value) override {
     if (!status_->ok())
       return;
     // See RFC 7049 Section 2.3, Table 2.
-    out_->push_back(value ? kEncodedTrue : kEncodedFalse);
+    Append(value ? kEncodedTrue : kEncodedFalse, out_);
   }
 
   void HandleNull() override {
     if (!status_->ok())
       return;
     // See RFC 7049 Section 2.3, Table 2.
-    out_->push_back(kEncodedNull);
+    Append(kEncodedNull, out_);
   }
 
   void HandleError(Status error) override {
     if (!status_->ok())
       return;
     *status_ = error;
-    out_->clear();
+    Clear(out_);
   }
 
  private:
-  std::vector<uint8_t>* out_;
+  C* out_;
   std::vector<EnvelopeEncoder> envelopes_;
   Status* status_;
+  StringRefTable* string_refs_;
+  const bool compact_doubles_;
 };
 }  // namespace
 
 std::unique_ptr<ParserHandler> NewCBOREncoder(std::vector<uint8_t>* out,
                                               Status* status) {
-  return std::unique_ptr<ParserHandler>(new CBOREncoder(out, status));
+  return std::unique_ptr<ParserHandler>(
+      new CBOREncoder<std::vector<uint8_t>>(out, status, nullptr, false));
+}
+
+std::unique_ptr<ParserHandler> NewCBOREncoder(ByteSink* out, Status* status) {
+  return std::unique_ptr<ParserHandler>(
+      new CBOREncoder<ByteSink>(out, status, nullptr, false));
+}
+
+Status EncodeWithStringRefs(span<uint8_t> bytes,
+                            StringRefTable* string_refs,
+                            std::vector<uint8_t>* out) {
+  const size_t string_refs_size = string_refs->size();
+  Status status;
+  CBOREncoder<std::vector<uint8_t>> encoder(out, &status, string_refs,
+                                            /*compact_doubles=*/false);
+  ParseCBOR(bytes, &encoder);
+  if (!status.ok())
+    string_refs->Truncate(string_refs_size);
+  return status;
+}
+
+Status EncodeWithCompactDoubles(span<uint8_t> bytes,
+                                std::vector<uint8_t>* out) {
+  Status status;
+  CBOREncoder<std::vector<uint8_t>> encoder(out, &status, nullptr,
+                                            /*compact_doubles=*/true);
+  ParseCBOR(bytes, &encoder);
+  return status;
 }
 
 // =============================================================================
@@ -494,6 +1072,11 @@ CBORTokenizer::CBORTokenizer(span<uint8_t> bytes) : bytes_(bytes) {
   ReadNextToken(/*enter_envelope=*/false);
 }
 
+CBORTokenizer::CBORTokenizer(span<uint8_t> bytes, StringRefTable* string_refs)
+    : bytes_(bytes), string_refs_(string_refs) {
+  ReadNextToken(/*enter_envelope=*/false);
+}
+
 CBORTokenizer::~CBORTokenizer() {}
 
 CBORTokenTag CBORTokenizer::TokenTag() const {
@@ -512,6 +1095,43 @@ void CBORTokenizer::EnterEnvelope() {
   ReadNextToken(/*enter_envelope=*/true);
 }
 
+void CBORTokenizer::SkipValue() {
+  if (token_tag_ == CBORTokenTag::STOP) {
+    SetError(Error::CBOR_UNSUPPORTED_VALUE);
+    return;
+  }
+  if (token_tag_ != CBORTokenTag::MAP_START &&
+      token_tag_ != CBORTokenTag::ARRAY_START) {
+    // Scalars and envelopes; for the latter, ::Next() jumps past the
+    // contents in one step.
+    Next();
+    return;
+  }
+  const Error eof_error = token_tag_ == CBORTokenTag::MAP_START
+                              ? Error::CBOR_UNEXPECTED_EOF_IN_MAP
+                              : Error::CBOR_UNEXPECTED_EOF_IN_ARRAY;
+  size_t depth = 0;
+  do {
+    switch (token_tag_) {
+      case CBORTokenTag::ERROR_VALUE:
+        return;
+      case CBORTokenTag::DONE:
+        SetError(eof_error);
+        return;
+      case CBORTokenTag::MAP_START:
+      case CBORTokenTag::ARRAY_START:
+        ++depth;
+        break;
+      case CBORTokenTag::STOP:
+        --depth;
+        break;
+      default:
+        break;
+    }
+    ReadNextToken(/*enter_envelope=*/false);
+  } while (depth > 0);
+}
+
 Status CBORTokenizer::Status() const {
   return status_;
 }
@@ -532,8 +1152,46 @@ int32_t CBORTokenizer::GetInt32() const {
           : -static_cast<int64_t>(token_start_internal_value_) - 1);
 }
 
+int64_t CBORTokenizer::GetInt64() const {
+  assert(token_tag_ == CBORTokenTag::INT32 ||
+         token_tag_ == CBORTokenTag::INT64);
+  // The range checks happen in ::ReadNextToken().
+  return token_start_type_ == MajorType::UNSIGNED
+             ? static_cast<int64_t>(token_start_internal_value_)
+             : -static_cast<int64_t>(token_start_internal_value_) - 1;
+}
+
+uint64_t CBORTokenizer::GetUint64() const {
+  assert(token_tag_ == CBORTokenTag::UINT64);
+  return token_start_internal_value_;
+}
+
 double CBORTokenizer::GetDouble() const {
   assert(token_tag_ == CBORTokenTag::DOUBLE);
+  if (token_byte_length_ == kEncodedHalfSize) {
+    const uint16_t half = ReadBytesMostSignificantByteFirst<uint16_t>(
+        bytes_.subspan(status_.pos + 1));
+    const int exponent = (half >> 10) & 0x1f;
+    const int mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0)  // Zero or subnormal.
+      value = std::ldexp(mantissa, -24);
+    else if (exponent == 0x1f)
+      value = mantissa ? std::numeric_limits<double>::quiet_NaN()
+                       : std::numeric_limits<double>::infinity();
+    else
+      value = std::ldexp(mantissa + 1024, exponent - 25);
+    return (half & 0x8000) ? -value : value;
+  }
+  if (token_byte_length_ == kEncodedSingleSize) {
+    union {
+      uint32_t from_uint32;
+      float to_float;
+    } reinterpret;
+    reinterpret.from_uint32 = ReadBytesMostSignificantByteFirst<uint32_t>(
+        bytes_.subspan(status_.pos + 1));
+    return reinterpret.to_float;
+  }
   union {
     uint64_t from_uint64;
     double to_double;
@@ -545,6 +1203,8 @@ double CBORTokenizer::GetDouble() const {
 
 span<uint8_t> CBORTokenizer::GetString8() const {
   assert(token_tag_ == CBORTokenTag::STRING8);
+  if (string_ref_.data())
+    return string_ref_;
   auto length = static_cast<size_t>(token_start_internal_value_);
   return bytes_.subspan(status_.pos + (token_byte_length_ - length), length);
 }
@@ -561,6 +1221,19 @@ span<uint8_t> CBORTokenizer::GetBinary() const {
   return bytes_.subspan(status_.pos + (token_byte_length_ - length), length);
 }
 
+bool CBORTokenizer::HasDefiniteLength() const {
+  assert(token_tag_ == CBORTokenTag::MAP_START ||
+         token_tag_ == CBORTokenTag::ARRAY_START);
+  return bytes_[status_.pos] != kInitialByteIndefiniteLengthMap &&
+         bytes_[status_.pos] != kInitialByteIndefiniteLengthArray;
+}
+
+size_t CBORTokenizer::GetDefiniteLength() const {
+  assert(HasDefiniteLength());
+  // The range checks happen in ::ReadContainerStart().
+  return static_cast<size_t>(token_start_internal_value_);
+}
+
 span<uint8_t> CBORTokenizer::GetEnvelope() const {
   assert(token_tag_ == CBORTokenTag::ENVELOPE);
   auto length = static_cast<size_t>(token_start_internal_value_);
@@ -600,14 +1273,34 @@ static const uint64_t kMaxValidLength =
     std::min<uint64_t>(std::numeric_limits<uint64_t>::max() >> 2,
                        std::numeric_limits<size_t>::max());
 
+// Tracks indefinite length maps / arrays in |remaining_items_|.
+static constexpr uint64_t kIndefiniteLength =
+    std::numeric_limits<uint64_t>::max();
+
 void CBORTokenizer::ReadNextToken(bool enter_envelope) {
   if (enter_envelope) {
     status_.pos += kEncodedEnvelopeHeaderSize;
+  } else if (status_.pos == Status::npos()) {
+    status_.pos = 0;
   } else {
-    status_.pos =
-        status_.pos == Status::npos() ? 0 : status_.pos + token_byte_length_;
+    // Unless we're moving past the start of a map or array, the current
+    // token completes an item within the enclosing map or array.
+    if (!remaining_items_.empty() &&
+        remaining_items_.back() != kIndefiniteLength &&
+        token_tag_ != CBORTokenTag::MAP_START &&
+        token_tag_ != CBORTokenTag::ARRAY_START) {
+      --remaining_items_.back();
+    }
+    status_.pos += token_byte_length_;
   }
   status_.error = Error::OK;
+  string_ref_ = span<uint8_t>();
+  if (!remaining_items_.empty() && remaining_items_.back() == 0) {
+    // All items of a definite length map or array were read.
+    remaining_items_.pop_back();
+    SetToken(CBORTokenTag::STOP, 0);
+    return;
+  }
   if (status_.pos >= bytes_.size()) {
     token_tag_ = CBORTokenTag::DONE;
     return;
@@ -615,12 +1308,24 @@ void CBORTokenizer::ReadNextToken(bool enter_envelope) {
   const size_t remaining_bytes = bytes_.size() - status_.pos;
   switch (bytes_[status_.pos]) {
     case kStopByte:
+      if (!remaining_items_.empty()) {
+        // A definite length map or array can't be stopped early.
+        if (remaining_items_.back() != kIndefiniteLength) {
+          SetError(Error::CBOR_INVALID_DEFINITE_LENGTH);
+          return;
+        }
+        remaining_items_.pop_back();
+      }
       SetToken(CBORTokenTag::STOP, 1);
       return;
     case kInitialByteIndefiniteLengthMap:
+      if (!remaining_items_.empty())
+        remaining_items_.push_back(kIndefiniteLength);
       SetToken(CBORTokenTag::MAP_START, 1);
       return;
     case kInitialByteIndefiniteLengthArray:
+      if (!remaining_items_.empty())
+        remaining_items_.push_back(kIndefiniteLength);
       SetToken(CBORTokenTag::ARRAY_START, 1);
       return;
     case kEncodedTrue:
@@ -651,15 +1356,26 @@ void CBORTokenizer::ReadNextToken(bool enter_envelope) {
       SetToken(CBORTokenTag::BINARY, static_cast<size_t>(token_byte_length));
       return;
     }
-    case kInitialByteForDouble: {  // DOUBLE
-      if (kEncodedDoubleSize > remaining_bytes) {
+    case kInitialByteForHalf:    // DOUBLE (half precision)
+    case kInitialByteForSingle:  // DOUBLE (single precision)
+    case kInitialByteForDouble: {
+      const size_t encoded_size =
+          bytes_[status_.pos] == kInitialByteForHalf     ? kEncodedHalfSize
+          : bytes_[status_.pos] == kInitialByteForSingle ? kEncodedSingleSize
+                                                         : kEncodedDoubleSize;
+      if (encoded_size > remaining_bytes) {
         SetError(Error::CBOR_INVALID_DOUBLE);
         return;
       }
-      SetToken(CBORTokenTag::DOUBLE, kEncodedDoubleSize);
+      SetToken(CBORTokenTag::DOUBLE, encoded_size);
       return;
     }
-    case kInitialByteForEnvelope: {  // ENVELOPE
+    case kInitialByteForEnvelope: {  // ENVELOPE or STRING8 (reference)
+      if (string_refs_ && remaining_bytes > 1 &&
+          bytes_[status_.pos + 1] == kStringRefTag) {
+        ReadStringRef();
+        return;
+      }
       if (kEncodedEnvelopeHeaderSize > remaining_bytes) {
         SetError(Error::CBOR_INVALID_ENVELOPE);
         return;
@@ -690,20 +1406,28 @@ void CBORTokenizer::ReadNextToken(bool enter_envelope) {
           bytes_.subspan(status_.pos), &token_start_type_,
           &token_start_internal_value_);
       switch (token_start_type_) {
-        case MajorType::UNSIGNED:  // INT32.
+        case MajorType::UNSIGNED:  // INT32 / INT64 / UINT64.
           // INT32 is a signed int32 (int32 makes sense for the
           // inspector protocol, it's not a CBOR limitation), so we check
           // against the signed max, so that the allowable values are
-          // 0, 1, 2, ... 2^31 - 1.
-          if (!bytes_read ||
-              static_cast<uint64_t>(std::numeric_limits<int32_t>::max()) <
-                  static_cast<uint64_t>(token_start_internal_value_)) {
+          // 0, 1, 2, ... 2^31 - 1. Larger values are INT64 up to the
+          // int64_t max, and UINT64 beyond.
+          if (!bytes_read) {
             SetError(Error::CBOR_INVALID_INT32);
             return;
           }
-          SetToken(CBORTokenTag::INT32, bytes_read);
+          if (token_start_internal_value_ <=
+              static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+            SetToken(CBORTokenTag::INT32, bytes_read);
+          } else if (token_start_internal_value_ <=
+                     static_cast<uint64_t>(
+                         std::numeric_limits<int64_t>::max())) {
+            SetToken(CBORTokenTag::INT64, bytes_read);
+          } else {
+            SetToken(CBORTokenTag::UINT64, bytes_read);
+          }
           return;
-        case MajorType::NEGATIVE: {  // INT32.
+        case MajorType::NEGATIVE: {  // INT32 / INT64.
           // INT32 is a signed int32 (int32 makes sense for the
           // inspector protocol, it's not a CBOR limitation); in CBOR, the
           // negative values for INT32 are represented as NEGATIVE, that is, -1
@@ -714,13 +1438,22 @@ void CBORTokenizer::ReadNextToken(bool enter_envelope) {
           // We check the payload in token_start_internal_value_ against
           // that range (2^31-1 is also known as
           // std::numeric_limits<int32_t>::max()).
-          if (!bytes_read ||
-              static_cast<uint64_t>(token_start_internal_value_) >
-                  static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+          // Likewise, values down to -2^63 are INT64.
+          if (!bytes_read) {
             SetError(Error::CBOR_INVALID_INT32);
             return;
           }
-          SetToken(CBORTokenTag::INT32, bytes_read);
+          if (token_start_internal_value_ <=
+              static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+            SetToken(CBORTokenTag::INT32, bytes_read);
+            return;
+          }
+          if (token_start_internal_value_ >
+              static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+            SetError(Error::CBOR_INVALID_INT64);
+            return;
+          }
+          SetToken(CBORTokenTag::INT64, bytes_read);
           return;
         }
         case MajorType::STRING: {  // STRING8.
@@ -735,6 +1468,8 @@ void CBORTokenizer::ReadNextToken(bool enter_envelope) {
           }
           SetToken(CBORTokenTag::STRING8,
                    static_cast<size_t>(token_byte_length));
+          if (string_refs_)
+            string_refs_->Add(GetString8());
           return;
         }
         case MajorType::BYTE_STRING: {  // STRING16.
@@ -756,6 +1491,8 @@ void CBORTokenizer::ReadNextToken(bool enter_envelope) {
         }
         case MajorType::ARRAY:
         case MajorType::MAP:
+          ReadContainerStart(token_start_type_, bytes_read, remaining_bytes);
+          return;
         case MajorType::TAG:
         case MajorType::SIMPLE_VALUE:
           SetError(Error::CBOR_UNSUPPORTED_VALUE);
@@ -765,7 +1502,45 @@ void CBORTokenizer::ReadNextToken(bool enter_envelope) {
   }
 }
 
-void CBORTokenizer::SetToken(CBORTokenTag token_tag, size_t token_byte_length) {
+void CBORTokenizer::ReadContainerStart(MajorType type,
+                                       size_t bytes_read,
+                                       size_t remaining_bytes) {
+  // Each item occupies at least one byte, so a length which exceeds the
+  // remaining bytes can't be valid. This check also bounds the memory
+  // that clients reserve based on ::GetDefiniteLength().
+  if (!bytes_read || token_start_internal_value_ > kMaxValidLength) {
+    SetError(Error::CBOR_INVALID_DEFINITE_LENGTH);
+    return;
+  }
+  const uint64_t num_items = type == MajorType::MAP
+                                 ? token_start_internal_value_ * 2
+                                 : token_start_internal_value_;
+  if (num_items > remaining_bytes - bytes_read) {
+    SetError(Error::CBOR_INVALID_DEFINITE_LENGTH);
+    return;
+  }
+  remaining_items_.push_back(num_items);
+  SetToken(type == MajorType::MAP ? CBORTokenTag::MAP_START
+                                  : CBORTokenTag::ARRAY_START,
+           bytes_read);
+}
+
+void CBORTokenizer::ReadStringRef() {
+  // The two bytes for the tag are followed by the index, as UNSIGNED.
+  MajorType type;
+  uint64_t index;
+  const size_t bytes_read = internals::ReadTokenStart(
+      bytes_.subspan(status_.pos + 2), &type, &index);
+  if (!bytes_read || type != MajorType::UNSIGNED ||
+      index >= string_refs_->size()) {
+    SetError(Error::CBOR_INVALID_STRING_REF);
+    return;
+  }
+  string_ref_ = string_refs_->Get(static_cast<uint32_t>(index));
+  SetToken(CBORTokenTag::STRING8, 2 + bytes_read);
+}
+
+void CBORTokenizer::SetToken(CBORTokenTag token_tag, size_t token_byte_length) {
   token_tag_ = token_tag;
   token_byte_length_ = token_byte_length;
 }
@@ -780,88 +1555,46 @@ void CBORTokenizer::SetError(Error error) {
 // =============================================================================
 
 namespace {
-// When parsing CBOR, we limit recursion depth for objects and arrays
-// to this constant.
-static constexpr int kStackLimit = 300;
-
-// Below are three parsing routines for CBOR, which cover enough
-// to roundtrip JSON messages.
-bool ParseMap(int32_t stack_depth,
-              CBORTokenizer* tokenizer,
-              ParserHandler* out);
-bool ParseArray(int32_t stack_depth,
-                CBORTokenizer* tokenizer,
-                ParserHandler* out);
-bool ParseValue(int32_t stack_depth,
-                CBORTokenizer* tokenizer,
-                ParserHandler* out);
-bool ParseEnvelope(int32_t stack_depth,
-                   CBORTokenizer* tokenizer,
-                   ParserHandler* out);
+// An open map or array for ParseValues.
+struct ParseFrame {
+  bool is_map;
+  // The position past the wrapping envelope, or npos if there's none.
+  size_t envelope_end;
+};
 
-void ParseUTF16String(CBORTokenizer* tokenizer, ParserHandler* out) {
-  std::vector<uint16_t> value;
+void ParseUTF16String(CBORTokenizer* tokenizer,
+                      std::vector<uint16_t>* string16_buffer,
+                      ParserHandler* out) {
   span<uint8_t> rep = tokenizer->GetString16WireRep();
+#if defined(CRDTP_CBOR_LITTLE_ENDIAN)
+  // The wire representation is little endian, so if it's suitably aligned,
+  // it can be passed on without copying.
+  if (reinterpret_cast<uintptr_t>(rep.data()) % alignof(uint16_t) == 0) {
+    out->HandleString16(span<uint16_t>(
+        reinterpret_cast<const uint16_t*>(rep.data()), rep.size() / 2));
+    tokenizer->Next();
+    return;
+  }
+#endif
+  // Otherwise, convert into a buffer that's reused for the entire message.
+  string16_buffer->resize(rep.size() / 2);
   for (size_t ii = 0; ii < rep.size(); ii += 2)
-    value.push_back((rep[ii + 1] << 8) | rep[ii]);
-  out->HandleString16(span<uint16_t>(value.data(), value.size()));
+    (*string16_buffer)[ii / 2] = (rep[ii + 1] << 8) | rep[ii];
+  out->HandleString16(
+      span<uint16_t>(string16_buffer->data(), string16_buffer->size()));
   tokenizer->Next();
 }
 
-bool ParseUTF8String(CBORTokenizer* tokenizer, ParserHandler* out) {
+void ParseUTF8String(CBORTokenizer* tokenizer, ParserHandler* out) {
   assert(tokenizer->TokenTag() == CBORTokenTag::STRING8);
   out->HandleString8(tokenizer->GetString8());
   tokenizer->Next();
-  return true;
-}
-
-bool ParseEnvelope(int32_t stack_depth,
-                   CBORTokenizer* tokenizer,
-                   ParserHandler* out) {
-  assert(tokenizer->TokenTag() == CBORTokenTag::ENVELOPE);
-  // Before we enter the envelope, we save the position that we
-  // expect to see after we're done parsing the envelope contents.
-  // This way we can compare and produce an error if the contents
-  // didn't fit exactly into the envelope length.
-  size_t pos_past_envelope = tokenizer->Status().pos +
-                             kEncodedEnvelopeHeaderSize +
-                             tokenizer->GetEnvelopeContents().size();
-  tokenizer->EnterEnvelope();
-  switch (tokenizer->TokenTag()) {
-    case CBORTokenTag::ERROR_VALUE:
-      out->HandleError(tokenizer->Status());
-      return false;
-    case CBORTokenTag::MAP_START:
-      if (!ParseMap(stack_depth + 1, tokenizer, out))
-        return false;
-      break;  // Continue to check pos_past_envelope below.
-    case CBORTokenTag::ARRAY_START:
-      if (!ParseArray(stack_depth + 1, tokenizer, out))
-        return false;
-      break;  // Continue to check pos_past_envelope below.
-    default:
-      out->HandleError(Status{Error::CBOR_MAP_OR_ARRAY_EXPECTED_IN_ENVELOPE,
-                              tokenizer->Status().pos});
-      return false;
-  }
-  // The contents of the envelope parsed OK, now check that we're at
-  // the expected position.
-  if (pos_past_envelope != tokenizer->Status().pos) {
-    out->HandleError(Status{Error::CBOR_ENVELOPE_CONTENTS_LENGTH_MISMATCH,
-                            tokenizer->Status().pos});
-    return false;
-  }
-  return true;
 }
 
-bool ParseValue(int32_t stack_depth,
-                CBORTokenizer* tokenizer,
-                ParserHandler* out) {
-  if (stack_depth > kStackLimit) {
-    out->HandleError(
-        Status{Error::CBOR_STACK_LIMIT_EXCEEDED, tokenizer->Status().pos});
-    return false;
-  }
+// Parses a value other than a map, array or envelope.
+bool ParseScalar(CBORTokenizer* tokenizer,
+                 std::vector<uint16_t>* string16_buffer,
+                 ParserHandler* out) {
   switch (tokenizer->TokenTag()) {
     case CBORTokenTag::ERROR_VALUE:
       out->HandleError(tokenizer->Status());
@@ -870,136 +1603,837 @@ bool ParseValue(int32_t stack_depth,
       out->HandleError(Status{Error::CBOR_UNEXPECTED_EOF_EXPECTED_VALUE,
                               tokenizer->Status().pos});
       return false;
-    case CBORTokenTag::ENVELOPE:
-      return ParseEnvelope(stack_depth, tokenizer, out);
     case CBORTokenTag::TRUE_VALUE:
       out->HandleBool(true);
-      tokenizer->Next();
-      return true;
+      break;
     case CBORTokenTag::FALSE_VALUE:
       out->HandleBool(false);
-      tokenizer->Next();
-      return true;
+      break;
     case CBORTokenTag::NULL_VALUE:
       out->HandleNull();
-      tokenizer->Next();
-      return true;
+      break;
     case CBORTokenTag::INT32:
       out->HandleInt32(tokenizer->GetInt32());
-      tokenizer->Next();
-      return true;
+      break;
+    case CBORTokenTag::INT64:
+      out->HandleInt64(tokenizer->GetInt64());
+      break;
+    case CBORTokenTag::UINT64:
+      // There's no handler method for these; like JSON numbers beyond
+      // the int64_t range, they're represented as double.
+      out->HandleDouble(static_cast<double>(tokenizer->GetUint64()));
+      break;
     case CBORTokenTag::DOUBLE:
       out->HandleDouble(tokenizer->GetDouble());
-      tokenizer->Next();
-      return true;
+      break;
     case CBORTokenTag::STRING8:
-      return ParseUTF8String(tokenizer, out);
+      ParseUTF8String(tokenizer, out);
+      return true;
     case CBORTokenTag::STRING16:
-      ParseUTF16String(tokenizer, out);
+      ParseUTF16String(tokenizer, string16_buffer, out);
       return true;
-    case CBORTokenTag::BINARY: {
+    case CBORTokenTag::BINARY:
       out->HandleBinary(tokenizer->GetBinary());
-      tokenizer->Next();
-      return true;
-    }
-    case CBORTokenTag::MAP_START:
-      return ParseMap(stack_depth + 1, tokenizer, out);
-    case CBORTokenTag::ARRAY_START:
-      return ParseArray(stack_depth + 1, tokenizer, out);
+      break;
     default:
       out->HandleError(
           Status{Error::CBOR_UNSUPPORTED_VALUE, tokenizer->Status().pos});
       return false;
   }
+  tokenizer->Next();
+  return true;
 }
 
-// |bytes| must start with the indefinite length array byte, so basically,
-// ParseArray may only be called after an indefinite length array has been
-// detected.
-bool ParseArray(int32_t stack_depth,
+// Parses a value; for a map or array (possibly wrapped in an envelope),
+// only its start is parsed and a frame is pushed onto |stack|.
+bool ParseValue(int stack_limit,
                 CBORTokenizer* tokenizer,
+                std::vector<uint16_t>* string16_buffer,
+                std::vector<ParseFrame>* stack,
                 ParserHandler* out) {
-  assert(tokenizer->TokenTag() == CBORTokenTag::ARRAY_START);
-  tokenizer->Next();
-  out->HandleArrayBegin();
-  while (tokenizer->TokenTag() != CBORTokenTag::STOP) {
-    if (tokenizer->TokenTag() == CBORTokenTag::DONE) {
-      out->HandleError(
-          Status{Error::CBOR_UNEXPECTED_EOF_IN_ARRAY, tokenizer->Status().pos});
-      return false;
-    }
-    if (tokenizer->TokenTag() == CBORTokenTag::ERROR_VALUE) {
-      out->HandleError(tokenizer->Status());
-      return false;
+  if (stack->size() > static_cast<size_t>(stack_limit)) {
+    out->HandleError(
+        Status{Error::CBOR_STACK_LIMIT_EXCEEDED, tokenizer->Status().pos});
+    return false;
+  }
+  size_t envelope_end = Status::npos();
+  if (tokenizer->TokenTag() == CBORTokenTag::ENVELOPE) {
+    // Before we enter the envelope, we save the position that we
+    // expect to see after we're done parsing the envelope contents.
+    // This way we can compare and produce an error if the contents
+    // didn't fit exactly into the envelope length.
+    envelope_end = tokenizer->Status().pos + kEncodedEnvelopeHeaderSize +
+                   tokenizer->GetEnvelopeContents().size();
+    tokenizer->EnterEnvelope();
+    switch (tokenizer->TokenTag()) {
+      case CBORTokenTag::ERROR_VALUE:
+        out->HandleError(tokenizer->Status());
+        return false;
+      case CBORTokenTag::MAP_START:
+      case CBORTokenTag::ARRAY_START:
+        break;
+      default:
+        out->HandleError(Status{Error::CBOR_MAP_OR_ARRAY_EXPECTED_IN_ENVELOPE,
+                                tokenizer->Status().pos});
+        return false;
     }
-    // Parse value.
-    if (!ParseValue(stack_depth, tokenizer, out))
-      return false;
   }
-  out->HandleArrayEnd();
+  switch (tokenizer->TokenTag()) {
+    case CBORTokenTag::MAP_START:
+      out->HandleMapBegin();
+      stack->push_back(ParseFrame{/*is_map=*/true, envelope_end});
+      break;
+    case CBORTokenTag::ARRAY_START:
+      out->HandleArrayBegin();
+      stack->push_back(ParseFrame{/*is_map=*/false, envelope_end});
+      break;
+    default:
+      return ParseScalar(tokenizer, string16_buffer, out);
+  }
   tokenizer->Next();
   return true;
 }
 
-// |bytes| must start with the indefinite length array byte, so basically,
-// ParseArray may only be called after an indefinite length array has been
-// detected.
-bool ParseMap(int32_t stack_depth,
-              CBORTokenizer* tokenizer,
-              ParserHandler* out) {
-  assert(tokenizer->TokenTag() == CBORTokenTag::MAP_START);
-  out->HandleMapBegin();
-  tokenizer->Next();
-  while (tokenizer->TokenTag() != CBORTokenTag::STOP) {
-    if (tokenizer->TokenTag() == CBORTokenTag::DONE) {
-      out->HandleError(
-          Status{Error::CBOR_UNEXPECTED_EOF_IN_MAP, tokenizer->Status().pos});
-      return false;
-    }
-    if (tokenizer->TokenTag() == CBORTokenTag::ERROR_VALUE) {
-      out->HandleError(tokenizer->Status());
-      return false;
+// Parses the value at the current position of |tokenizer|, including the
+// contents of maps and arrays. Rather than recursing, this tracks the open
+// maps and arrays on an explicit stack, so the depth of the message,
+// bounded by |stack_limit|, doesn't affect the call stack.
+bool ParseValues(int stack_limit,
+                 CBORTokenizer* tokenizer,
+                 std::vector<uint16_t>* string16_buffer,
+                 ParserHandler* out) {
+  std::vector<ParseFrame> stack;
+  if (!ParseValue(stack_limit, tokenizer, string16_buffer, &stack, out))
+    return false;
+  while (!stack.empty()) {
+    const ParseFrame& frame = stack.back();
+    switch (tokenizer->TokenTag()) {
+      case CBORTokenTag::STOP: {
+        if (frame.is_map)
+          out->HandleMapEnd();
+        else
+          out->HandleArrayEnd();
+        tokenizer->Next();
+        // For an envelope, check that the contents end at the expected
+        // position.
+        if (frame.envelope_end != Status::npos() &&
+            frame.envelope_end != tokenizer->Status().pos) {
+          out->HandleError(Status{Error::CBOR_ENVELOPE_CONTENTS_LENGTH_MISMATCH,
+                                  tokenizer->Status().pos});
+          return false;
+        }
+        stack.pop_back();
+        continue;
+      }
+      case CBORTokenTag::DONE: {
+        const Error error = frame.is_map ? Error::CBOR_UNEXPECTED_EOF_IN_MAP
+                                         : Error::CBOR_UNEXPECTED_EOF_IN_ARRAY;
+        out->HandleError(Status{error, tokenizer->Status().pos});
+        return false;
+      }
+      case CBORTokenTag::ERROR_VALUE:
+        out->HandleError(tokenizer->Status());
+        return false;
+      default:
+        break;
     }
-    // Parse key.
-    if (tokenizer->TokenTag() == CBORTokenTag::STRING8) {
-      if (!ParseUTF8String(tokenizer, out))
+    // Within a map, a key precedes each value.
+    if (frame.is_map) {
+      if (tokenizer->TokenTag() == CBORTokenTag::STRING8) {
+        ParseUTF8String(tokenizer, out);
+      } else if (tokenizer->TokenTag() == CBORTokenTag::STRING16) {
+        ParseUTF16String(tokenizer, string16_buffer, out);
+      } else {
+        out->HandleError(
+            Status{Error::CBOR_INVALID_MAP_KEY, tokenizer->Status().pos});
         return false;
-    } else if (tokenizer->TokenTag() == CBORTokenTag::STRING16) {
-      ParseUTF16String(tokenizer, out);
-    } else {
-      out->HandleError(
-          Status{Error::CBOR_INVALID_MAP_KEY, tokenizer->Status().pos});
-      return false;
+      }
     }
-    // Parse value.
-    if (!ParseValue(stack_depth, tokenizer, out))
+    if (!ParseValue(stack_limit, tokenizer, string16_buffer, &stack, out))
       return false;
   }
-  out->HandleMapEnd();
-  tokenizer->Next();
   return true;
 }
-}  // namespace
 
-void ParseCBOR(span<uint8_t> bytes, ParserHandler* out) {
+// Like ParseCBOR, but yields false iff an error was sent to |out|.
+bool ParseMessage(span<uint8_t> bytes,
+                  ParserHandler* out,
+                  StringRefTable* string_refs,
+                  int stack_limit) {
   if (bytes.empty()) {
     out->HandleError(Status{Error::CBOR_NO_INPUT, 0});
-    return;
+    return false;
   }
-  CBORTokenizer tokenizer(bytes);
+  CBORTokenizer tokenizer(bytes, string_refs);
   if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE) {
     out->HandleError(tokenizer.Status());
+    return false;
+  }
+  std::vector<uint16_t> string16_buffer;
+  if (!ParseValues(stack_limit, &tokenizer, &string16_buffer, out))
+    return false;
+  if (tokenizer.TokenTag() == CBORTokenTag::DONE)
+    return true;
+  if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE) {
+    out->HandleError(tokenizer.Status());
+    return false;
+  }
+  out->HandleError(Status{Error::CBOR_TRAILING_JUNK, tokenizer.Status().pos});
+  return false;
+}
+}  // namespace
+
+void ParseCBOR(span<uint8_t> bytes, ParserHandler* out) {
+  ParseCBOR(bytes, out, /*string_refs=*/nullptr, kDefaultStackLimit);
+}
+
+void ParseCBOR(span<uint8_t> bytes,
+               ParserHandler* out,
+               StringRefTable* string_refs) {
+  ParseCBOR(bytes, out, string_refs, kDefaultStackLimit);
+}
+
+void ParseCBOR(span<uint8_t> bytes,
+               ParserHandler* out,
+               StringRefTable* string_refs,
+               int stack_limit) {
+  const size_t string_refs_size = string_refs ? string_refs->size() : 0;
+  if (!ParseMessage(bytes, out, string_refs, stack_limit) && string_refs)
+    string_refs->Truncate(string_refs_size);
+}
+
+// =============================================================================
+// cbor::StreamingCBORParser - for parsing messages as they arrive in chunks
+// =============================================================================
+
+namespace {
+// Yields the byte size of the token at the start of |bytes|, or 0 if
+// |bytes| is too short to tell. Maps, arrays and envelopes are represented
+// by their start (e.g. the envelope header), not including their contents.
+// Invalid tokens yield a size that lets CBORTokenizer report the error.
+size_t StreamingTokenSize(span<uint8_t> bytes) {
+  if (bytes.empty())
+    return 0;
+  switch (bytes[0]) {
+    case kStopByte:
+    case kInitialByteIndefiniteLengthMap:
+    case kInitialByteIndefiniteLengthArray:
+      return 1;
+    case kInitialByteForEnvelope:  // ENVELOPE or string reference.
+      if (bytes.size() < 2)
+        return 0;
+      return bytes[1] == kInitialByteFor32BitLengthByteString
+                 ? kEncodedEnvelopeHeaderSize
+                 : 2;
+    case kExpectedConversionToBase64Tag: {  // BINARY
+      const size_t byte_string_size = StreamingTokenSize(bytes.subspan(1));
+      return byte_string_size ? 1 + byte_string_size : 0;
+    }
+    default:
+      break;
+  }
+  const uint8_t additional_info = bytes[0] & kAdditionalInformationMask;
+  if (additional_info > 27)
+    return 1;
+  const size_t token_start_size =
+      additional_info < 24 ? 1 : 1 + (size_t{1} << (additional_info - 24));
+  if (bytes.size() < token_start_size)
+    return 0;
+  MajorType type;
+  uint64_t value;
+  internals::ReadTokenStart(bytes, &type, &value);
+  if ((type != MajorType::STRING && type != MajorType::BYTE_STRING) ||
+      value > kMaxValidLength) {
+    return token_start_size;
+  }
+  return token_start_size + static_cast<size_t>(value);
+}
+}  // namespace
+
+StreamingCBORParser::StreamingCBORParser(ParserHandler* out, int stack_limit)
+    : out_(out), stack_limit_(stack_limit), envelope_end_(Status::npos()) {}
+
+StreamingCBORParser::~StreamingCBORParser() {}
+
+void StreamingCBORParser::Parse(span<uint8_t> chunk) {
+  // First, complete a token that was split across chunks. Until its size
+  // is known, we take one byte at a time, since token starts are short.
+  while (!pending_.empty() && !chunk.empty() && status_.ok()) {
+    size_t size = StreamingTokenSize(SpanFrom(pending_));
+    const size_t n = size ? std::min(size - pending_.size(), chunk.size()) : 1;
+    pending_.insert(pending_.end(), chunk.begin(), chunk.begin() + n);
+    chunk = chunk.subspan(n);
+    // The byte we just took may be the one which makes the size known, and
+    // for short tokens (e.g. 18 64) it may also be the last one.
+    if (!size)
+      size = StreamingTokenSize(SpanFrom(pending_));
+    if (pending_.size() == size) {
+      ConsumeToken(SpanFrom(pending_));
+      pending_.clear();
+    }
+  }
+  // Then, parse directly from |chunk|.
+  while (!chunk.empty() && status_.ok()) {
+    if (done_) {
+      SetError(Error::CBOR_TRAILING_JUNK, pos_);
+      return;
+    }
+    const size_t size = StreamingTokenSize(chunk);
+    if (!size || size > chunk.size()) {
+      pending_.assign(chunk.begin(), chunk.end());
+      return;
+    }
+    ConsumeToken(chunk.subspan(0, size));
+    chunk = chunk.subspan(size);
+  }
+}
+
+void StreamingCBORParser::Finish() {
+  if (!status_.ok() || done_)
     return;
+  if (!pending_.empty() &&
+      StreamingTokenSize(SpanFrom(pending_)) == pending_.size()) {
+    ConsumeToken(SpanFrom(pending_));
+    pending_.clear();
+    if (!status_.ok() || done_)
+      return;
   }
-  if (!ParseValue(/*stack_depth=*/0, &tokenizer, out))
+  const size_t end = pos_ + pending_.size();
+  if (end == 0)
+    SetError(Error::CBOR_NO_INPUT, 0);
+  else if (stack_.empty() || envelope_end_ != Status::npos())
+    SetError(Error::CBOR_UNEXPECTED_EOF_EXPECTED_VALUE, end);
+  else if (stack_.back().is_map)
+    SetError(Error::CBOR_UNEXPECTED_EOF_IN_MAP, end);
+  else
+    SetError(Error::CBOR_UNEXPECTED_EOF_IN_ARRAY, end);
+}
+
+void StreamingCBORParser::ConsumeToken(span<uint8_t> token) {
+  const size_t pos = pos_;
+  const size_t limit = envelope_end_ != Status::npos() ? envelope_end_
+                       : stack_.empty()                ? Status::npos()
+                                                       : stack_.back().limit;
+  if (limit != Status::npos() && pos + token.size() > limit) {
+    SetError(Error::CBOR_ENVELOPE_CONTENTS_LENGTH_MISMATCH, pos);
     return;
-  if (tokenizer.TokenTag() == CBORTokenTag::DONE)
+  }
+  pos_ += token.size();
+  const MajorType type = static_cast<MajorType>(token[0] >> kMajorTypeBitShift);
+  const bool is_container_start =
+      type == MajorType::MAP || type == MajorType::ARRAY;
+  if (envelope_end_ != Status::npos() && !is_container_start) {
+    SetError(Error::CBOR_MAP_OR_ARRAY_EXPECTED_IN_ENVELOPE, pos);
     return;
+  }
+  if (token[0] == kStopByte) {
+    if (stack_.empty() || (stack_.back().is_map && !AtMapKey())) {
+      SetError(Error::CBOR_UNSUPPORTED_VALUE, pos);
+      return;
+    }
+    if (stack_.back().num_items != kIndefiniteLength) {
+      SetError(Error::CBOR_INVALID_DEFINITE_LENGTH, pos);
+      return;
+    }
+    if (CloseContainer())
+      CompleteItem();
+    return;
+  }
+  const bool is_envelope = token.size() == kEncodedEnvelopeHeaderSize &&
+                           token[0] == kInitialByteForEnvelope &&
+                           token[1] == kInitialByteFor32BitLengthByteString;
+  if (AtMapKey() && (is_envelope || is_container_start)) {
+    SetError(Error::CBOR_INVALID_MAP_KEY, pos);
+    return;
+  }
+  // Like ParseCBOR, we limit the depth of values (but not keys) to the
+  // number of enclosing maps and arrays. For a map or array wrapped in an
+  // envelope, the envelope is the value.
+  if (!AtMapKey() && envelope_end_ == Status::npos() &&
+      stack_.size() > static_cast<size_t>(stack_limit_)) {
+    SetError(Error::CBOR_STACK_LIMIT_EXCEEDED, pos);
+    return;
+  }
+  if (is_envelope) {
+    const uint64_t envelope_end =
+        pos_ + ReadBytesMostSignificantByteFirst<uint32_t>(token.subspan(2));
+    if (limit != Status::npos() && envelope_end > limit) {
+      SetError(Error::CBOR_INVALID_ENVELOPE, pos);
+      return;
+    }
+    envelope_end_ = static_cast<size_t>(envelope_end);
+    return;
+  }
+  if (token[0] == kInitialByteIndefiniteLengthMap ||
+      token[0] == kInitialByteIndefiniteLengthArray) {
+    OpenContainer(token[0] == kInitialByteIndefiniteLengthMap,
+                  kIndefiniteLength);
+    return;
+  }
+  if (is_container_start) {  // Definite length map or array.
+    MajorType container_type;
+    uint64_t length;
+    if (!internals::ReadTokenStart(token, &container_type, &length) ||
+        length > kMaxValidLength) {
+      SetError(Error::CBOR_INVALID_DEFINITE_LENGTH, pos);
+      return;
+    }
+    const bool is_map = container_type == MajorType::MAP;
+    OpenContainer(is_map, is_map ? length * 2 : length);
+    return;
+  }
+  // A scalar value, or a key.
+  CBORTokenizer tokenizer(token);
   if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE) {
-    out->HandleError(tokenizer.Status());
+    SetError(tokenizer.Status().error, pos + tokenizer.Status().pos);
     return;
   }
-  out->HandleError(Status{Error::CBOR_TRAILING_JUNK, tokenizer.Status().pos});
+  if (AtMapKey() && tokenizer.TokenTag() != CBORTokenTag::STRING8 &&
+      tokenizer.TokenTag() != CBORTokenTag::STRING16) {
+    SetError(Error::CBOR_INVALID_MAP_KEY, pos);
+    return;
+  }
+  ParseScalar(&tokenizer, &string16_buffer_, out_);
+  CompleteItem();
+}
+
+void StreamingCBORParser::OpenContainer(bool is_map, uint64_t num_items) {
+  Frame frame;
+  frame.is_map = is_map;
+  frame.num_items = num_items;
+  frame.items_read = 0;
+  frame.envelope_end = envelope_end_;
+  frame.limit = envelope_end_ != Status::npos() ? envelope_end_
+                : stack_.empty()                ? Status::npos()
+                                                : stack_.back().limit;
+  envelope_end_ = Status::npos();
+  stack_.push_back(frame);
+  if (is_map)
+    out_->HandleMapBegin();
+  else
+    out_->HandleArrayBegin();
+  if (num_items == 0 && CloseContainer())
+    CompleteItem();
+}
+
+bool StreamingCBORParser::CloseContainer() {
+  const Frame& frame = stack_.back();
+  if (frame.envelope_end != Status::npos() && frame.envelope_end != pos_) {
+    SetError(Error::CBOR_ENVELOPE_CONTENTS_LENGTH_MISMATCH, pos_);
+    return false;
+  }
+  if (frame.is_map)
+    out_->HandleMapEnd();
+  else
+    out_->HandleArrayEnd();
+  stack_.pop_back();
+  return true;
+}
+
+void StreamingCBORParser::CompleteItem() {
+  for (;;) {
+    if (stack_.empty()) {
+      done_ = true;
+      return;
+    }
+    Frame& frame = stack_.back();
+    ++frame.items_read;
+    if (frame.num_items == kIndefiniteLength ||
+        frame.items_read < frame.num_items) {
+      return;
+    }
+    // That was the last item of a definite length map or array.
+    if (!CloseContainer())
+      return;
+  }
+}
+
+bool StreamingCBORParser::AtMapKey() const {
+  return envelope_end_ == Status::npos() && !stack_.empty() &&
+         stack_.back().is_map && stack_.back().items_read % 2 == 0;
+}
+
+void StreamingCBORParser::SetError(Error error, size_t pos) {
+  status_ = crdtp::Status(error, pos);
+  out_->HandleError(status_);
+}
+
+// =============================================================================
+// cbor::CBORIndex - structural index for random access into CBOR messages
+// =============================================================================
+
+CBORIndex::CBORIndex(span<uint8_t> bytes) : bytes_(bytes) {
+  Build();
+}
+
+CBORIndex::~CBORIndex() {}
+
+Status CBORIndex::Status() const {
+  return status_;
+}
+
+CBORIndex::Cursor CBORIndex::Root() const {
+  return Cursor(this, 0);
+}
+
+// Builds the index with an explicit stack instead of recursion, checking
+// the same constraints as ParseCBOR (see above).
+void CBORIndex::Build() {
+  if (bytes_.empty()) {
+    SetError(crdtp::Status{Error::CBOR_NO_INPUT, 0});
+    return;
+  }
+  // Messages are limited to 4 GB (see top of cbor.h); this lets us store
+  // positions as uint32_t.
+  if (bytes_.size() > std::numeric_limits<uint32_t>::max()) {
+    SetError(crdtp::Status{Error::CBOR_ENVELOPE_SIZE_LIMIT_EXCEEDED, 0});
+    return;
+  }
+  // A map, array, or envelope for which we haven't seen the end yet.
+  struct OpenContainer {
+    size_t entry;
+    // For envelopes, the byte position past the envelope.
+    size_t pos_past_envelope;
+    // For maps, the number of keys and values seen so far.
+    size_t num_items;
+  };
+  std::vector<OpenContainer> open;
+  CBORTokenizer tokenizer(bytes_);
+  while (true) {
+    const CBORTokenTag tag = tokenizer.TokenTag();
+    const size_t pos = tokenizer.Status().pos;
+    if (tag == CBORTokenTag::ERROR_VALUE) {
+      SetError(tokenizer.Status());
+      return;
+    }
+    OpenContainer* parent = open.empty() ? nullptr : &open.back();
+    const CBORTokenTag parent_tag =
+        parent ? entries_[parent->entry].tag : CBORTokenTag::DONE;
+    if (tag == CBORTokenTag::DONE) {
+      Error error = Error::CBOR_UNEXPECTED_EOF_EXPECTED_VALUE;
+      if (parent_tag == CBORTokenTag::MAP_START)
+        error = Error::CBOR_UNEXPECTED_EOF_IN_MAP;
+      else if (parent_tag == CBORTokenTag::ARRAY_START)
+        error = Error::CBOR_UNEXPECTED_EOF_IN_ARRAY;
+      SetError(crdtp::Status{error, pos});
+      return;
+    }
+    if (parent_tag == CBORTokenTag::ENVELOPE && tag != CBORTokenTag::MAP_START &&
+        tag != CBORTokenTag::ARRAY_START) {
+      SetError(
+          crdtp::Status{Error::CBOR_MAP_OR_ARRAY_EXPECTED_IN_ENVELOPE, pos});
+      return;
+    }
+    if (parent_tag == CBORTokenTag::MAP_START && parent->num_items % 2 == 0 &&
+        tag != CBORTokenTag::STOP && tag != CBORTokenTag::STRING8 &&
+        tag != CBORTokenTag::STRING16) {
+      SetError(crdtp::Status{Error::CBOR_INVALID_MAP_KEY, pos});
+      return;
+    }
+    const size_t entry = entries_.size();
+    if (tag == CBORTokenTag::STOP) {
+      // A STOP may only end a map (after a value) or an array.
+      if (!(parent_tag == CBORTokenTag::MAP_START &&
+            parent->num_items % 2 == 0) &&
+          parent_tag != CBORTokenTag::ARRAY_START) {
+        SetError(crdtp::Status{Error::CBOR_UNSUPPORTED_VALUE, pos});
+        return;
+      }
+      entries_.push_back(Entry{static_cast<uint32_t>(pos),
+                               static_cast<uint32_t>(entry + 1), tag});
+      entries_[parent->entry].next = static_cast<uint32_t>(entry + 1);
+      open.pop_back();
+      tokenizer.Next();
+    } else {
+      entries_.push_back(Entry{static_cast<uint32_t>(pos),
+                               static_cast<uint32_t>(entry + 1), tag});
+      if (parent)
+        ++parent->num_items;
+      switch (tag) {
+        case CBORTokenTag::ENVELOPE:
+          open.push_back(
+              OpenContainer{entry, pos + tokenizer.GetEnvelope().size(), 0});
+          tokenizer.EnterEnvelope();
+          continue;
+        case CBORTokenTag::MAP_START:
+        case CBORTokenTag::ARRAY_START:
+          open.push_back(OpenContainer{entry, 0, 0});
+          tokenizer.Next();
+          continue;
+        default:
+          tokenizer.Next();
+          break;
+      }
+    }
+    // A value was completed; this may complete the enclosing envelopes.
+    while (!open.empty() &&
+           entries_[open.back().entry].tag == CBORTokenTag::ENVELOPE) {
+      if (open.back().pos_past_envelope != tokenizer.Status().pos) {
+        SetError(crdtp::Status{Error::CBOR_ENVELOPE_CONTENTS_LENGTH_MISMATCH,
+                              tokenizer.Status().pos});
+        return;
+      }
+      entries_[open.back().entry].next =
+          static_cast<uint32_t>(entries_.size());
+      open.pop_back();
+    }
+    if (open.empty())
+      break;
+  }
+  // The top-level value is complete, so we expect to be at the end.
+  if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE) {
+    SetError(tokenizer.Status());
+    return;
+  }
+  if (tokenizer.TokenTag() != CBORTokenTag::DONE)
+    SetError(crdtp::Status{Error::CBOR_TRAILING_JUNK, tokenizer.Status().pos});
+}
+
+void CBORIndex::SetError(crdtp::Status status) {
+  status_ = status;
+  entries_.clear();
+}
+
+CBORTokenTag CBORIndex::Cursor::TokenTag() const {
+  if (entry_ >= index_->entries_.size())
+    return CBORTokenTag::DONE;
+  return index_->entries_[entry_].tag;
+}
+
+size_t CBORIndex::Cursor::pos() const {
+  if (entry_ >= index_->entries_.size())
+    return index_->bytes_.size();
+  return index_->entries_[entry_].pos;
+}
+
+span<uint8_t> CBORIndex::Cursor::Bytes() const {
+  if (entry_ >= index_->entries_.size())
+    return span<uint8_t>();
+  const size_t next = index_->entries_[entry_].next;
+  const size_t end = next < index_->entries_.size()
+                         ? index_->entries_[next].pos
+                         : index_->bytes_.size();
+  return index_->bytes_.subspan(pos(), end - pos());
+}
+
+CBORTokenizer CBORIndex::Cursor::Tokenize() const {
+  return CBORTokenizer(Bytes());
+}
+
+CBORIndex::Cursor CBORIndex::Cursor::NextSibling() const {
+  assert(TokenTag() != CBORTokenTag::STOP &&
+         TokenTag() != CBORTokenTag::DONE);
+  return Cursor(index_, index_->entries_[entry_].next);
+}
+
+CBORIndex::Cursor CBORIndex::Cursor::FirstChild() const {
+  assert(TokenTag() == CBORTokenTag::ENVELOPE ||
+         TokenTag() == CBORTokenTag::MAP_START ||
+         TokenTag() == CBORTokenTag::ARRAY_START);
+  return Cursor(index_, entry_ + 1);
+}
+
+CBORIndex::Cursor CBORIndex::Cursor::FindMapValue(span<uint8_t> key) const {
+  Cursor map = *this;
+  if (map.TokenTag() == CBORTokenTag::ENVELOPE)
+    map = map.FirstChild();
+  assert(map.TokenTag() == CBORTokenTag::MAP_START);
+  Cursor cursor = map.FirstChild();
+  while (cursor.TokenTag() != CBORTokenTag::STOP) {
+    Cursor value = cursor.NextSibling();
+    if (cursor.TokenTag() == CBORTokenTag::STRING8 &&
+        SpanEquals(cursor.Tokenize().GetString8(), key)) {
+      return value;
+    }
+    cursor = value.NextSibling();
+  }
+  return cursor;
+}
+
+// =============================================================================
+// cbor::CBORPath - for extracting individual values from CBOR messages
+// =============================================================================
+
+namespace {
+// True iff |tokenizer| is positioned at a value, as opposed to the end of
+// a map / array, the end of the message or an error.
+bool AtValue(const CBORTokenizer& tokenizer) {
+  return tokenizer.TokenTag() != CBORTokenTag::STOP &&
+         tokenizer.TokenTag() != CBORTokenTag::DONE &&
+         tokenizer.TokenTag() != CBORTokenTag::ERROR_VALUE;
+}
+}  // namespace
+
+CBORPath::CBORPath(span<uint8_t> path) : path_(path.begin(), path.end()) {
+  size_t pos = 0;
+  while (pos < path_.size()) {
+    if (path_[pos] == '[') {
+      ++pos;
+      const size_t digits_pos = pos;
+      uint64_t index = 0;
+      for (; pos < path_.size() && path_[pos] >= '0' && path_[pos] <= '9';
+           ++pos) {
+        index = index * 10 + (path_[pos] - '0');
+        if (index > std::numeric_limits<uint32_t>::max())
+          break;
+      }
+      if (pos == digits_pos || pos == path_.size() || path_[pos] != ']') {
+        ok_ = false;
+        steps_.clear();
+        return;
+      }
+      ++pos;
+      steps_.push_back(Step{0, 0, static_cast<size_t>(index), true});
+      continue;
+    }
+    // Keys other than the first one are preceded by '.'.
+    if (!steps_.empty()) {
+      if (path_[pos] != '.') {
+        ok_ = false;
+        steps_.clear();
+        return;
+      }
+      ++pos;
+    }
+    const size_t key_pos = pos;
+    while (pos < path_.size() && path_[pos] != '.' && path_[pos] != '[' &&
+           path_[pos] != ']') {
+      ++pos;
+    }
+    if (pos == key_pos) {
+      ok_ = false;
+      steps_.clear();
+      return;
+    }
+    steps_.push_back(Step{key_pos, pos - key_pos, 0, false});
+  }
+}
+
+CBORPath::~CBORPath() = default;
+
+bool CBORPath::Walk(CBORTokenizer* tokenizer) const {
+  if (!ok_)
+    return false;
+  for (const Step& step : steps_) {
+    if (tokenizer->TokenTag() == CBORTokenTag::ENVELOPE)
+      tokenizer->EnterEnvelope();
+    if (step.is_index) {
+      if (tokenizer->TokenTag() != CBORTokenTag::ARRAY_START)
+        return false;
+      tokenizer->Next();
+      for (size_t ii = 0; ii < step.index; ++ii) {
+        if (!AtValue(*tokenizer))
+          return false;
+        tokenizer->SkipValue();
+      }
+      continue;
+    }
+    if (tokenizer->TokenTag() != CBORTokenTag::MAP_START)
+      return false;
+    tokenizer->Next();
+    span<uint8_t> key(path_.data() + step.key_pos, step.key_size);
+    for (;;) {
+      if (!AtValue(*tokenizer))
+        return false;
+      const bool match = tokenizer->TokenTag() == CBORTokenTag::STRING8 &&
+                         SpanEquals(tokenizer->GetString8(), key);
+      tokenizer->SkipValue();  // The key.
+      if (match)
+        break;
+      tokenizer->SkipValue();  // The value.
+    }
+  }
+  return AtValue(*tokenizer);
+}
+
+span<uint8_t> CBORPath::Find(span<uint8_t> message) const {
+  CBORTokenizer tokenizer(message);
+  if (!Walk(&tokenizer))
+    return span<uint8_t>();
+  const size_t start = tokenizer.Status().pos;
+  // Like CBORTokenizer::SkipValue, but values which are truncated or
+  // otherwise malformed are rejected, whereas an error in the token
+  // following the value isn't our concern.
+  size_t depth = 0;
+  do {
+    switch (tokenizer.TokenTag()) {
+      case CBORTokenTag::ERROR_VALUE:
+      case CBORTokenTag::DONE:
+        return span<uint8_t>();
+      case CBORTokenTag::MAP_START:
+      case CBORTokenTag::ARRAY_START:
+        ++depth;
+        break;
+      case CBORTokenTag::STOP:
+        --depth;
+        break;
+      default:
+        break;
+    }
+    tokenizer.Next();
+  } while (depth > 0);
+  return message.subspan(start, tokenizer.Status().pos - start);
+}
+
+bool CBORPath::FindBool(span<uint8_t> message, bool* value) const {
+  CBORTokenizer tokenizer(message);
+  if (!Walk(&tokenizer))
+    return false;
+  if (tokenizer.TokenTag() == CBORTokenTag::TRUE_VALUE) {
+    *value = true;
+    return true;
+  }
+  if (tokenizer.TokenTag() == CBORTokenTag::FALSE_VALUE) {
+    *value = false;
+    return true;
+  }
+  return false;
+}
+
+bool CBORPath::FindInt32(span<uint8_t> message, int32_t* value) const {
+  CBORTokenizer tokenizer(message);
+  if (!Walk(&tokenizer) || tokenizer.TokenTag() != CBORTokenTag::INT32)
+    return false;
+  *value = tokenizer.GetInt32();
+  return true;
+}
+
+bool CBORPath::FindInt64(span<uint8_t> message, int64_t* value) const {
+  CBORTokenizer tokenizer(message);
+  if (!Walk(&tokenizer) || (tokenizer.TokenTag() != CBORTokenTag::INT32 &&
+                            tokenizer.TokenTag() != CBORTokenTag::INT64)) {
+    return false;
+  }
+  *value = tokenizer.GetInt64();
+  return true;
+}
+
+bool CBORPath::FindDouble(span<uint8_t> message, double* value) const {
+  CBORTokenizer tokenizer(message);
+  if (!Walk(&tokenizer))
+    return false;
+  switch (tokenizer.TokenTag()) {
+    case CBORTokenTag::DOUBLE:
+      *value = tokenizer.GetDouble();
+      return true;
+    case CBORTokenTag::INT32:
+    case CBORTokenTag::INT64:
+      *value = static_cast<double>(tokenizer.GetInt64());
+      return true;
+    case CBORTokenTag::UINT64:
+      *value = static_cast<double>(tokenizer.GetUint64());
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool CBORPath::FindString8(span<uint8_t> message, span<uint8_t>* value) const {
+  CBORTokenizer tokenizer(message);
+  if (!Walk(&tokenizer) || tokenizer.TokenTag() != CBORTokenTag::STRING8)
+    return false;
+  *value = tokenizer.GetString8();
+  return true;
 }
 
 // =============================================================================
@@ -1042,5 +2476,162 @@ Status AppendString8EntryToCBORMap(span<uint8_t> string8_key,
   *(out) = new_envelope_size & 0xff;
   return Status();
 }
+
+// =============================================================================
+// cbor::SetEntryInCBORMap - for in-place editing of messages
+// =============================================================================
+
+namespace {
+// Implements SetEntryInCBORMap, and, if |encoded_value| is empty,
+// RemoveEntryFromCBORMap.
+Status EditCBORMap(span<span<uint8_t>> path,
+                   span<uint8_t> encoded_value,
+                   std::vector<uint8_t>* cbor) {
+  assert(!path.empty());
+  span<uint8_t> bytes(cbor->data(), cbor->size());
+  CBORTokenizer tokenizer(bytes);
+  if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE)
+    return tokenizer.Status();
+  if (tokenizer.TokenTag() != CBORTokenTag::ENVELOPE)
+    return Status(Error::CBOR_INVALID_ENVELOPE, 0);
+  if (tokenizer.GetEnvelope().size() != bytes.size())
+    return Status(Error::CBOR_TRAILING_JUNK, tokenizer.GetEnvelope().size());
+  // The positions of the envelopes which enclose the entry.
+  std::vector<size_t> envelopes;
+  size_t entry_start = 0;  // Position of the key.
+  size_t value_start = 0;
+  size_t value_end = 0;
+  bool found = false;
+  bool definite_length = false;
+  for (size_t depth = 0; depth < path.size(); ++depth) {
+    // The tokenizer is at the envelope for the map that we search next.
+    envelopes.push_back(tokenizer.Status().pos);
+    tokenizer.EnterEnvelope();
+    if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE)
+      return tokenizer.Status();
+    if (tokenizer.TokenTag() != CBORTokenTag::MAP_START)
+      return Status(Error::CBOR_MAP_START_EXPECTED, tokenizer.Status().pos);
+    definite_length = tokenizer.HasDefiniteLength();
+    tokenizer.Next();
+    found = false;
+    for (;;) {
+      if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE)
+        return tokenizer.Status();
+      if (tokenizer.TokenTag() == CBORTokenTag::STOP)
+        break;
+      if (tokenizer.TokenTag() == CBORTokenTag::DONE)
+        return Status(Error::CBOR_UNEXPECTED_EOF_IN_MAP,
+                      tokenizer.Status().pos);
+      if (tokenizer.TokenTag() != CBORTokenTag::STRING8 &&
+          tokenizer.TokenTag() != CBORTokenTag::STRING16) {
+        return Status(Error::CBOR_INVALID_MAP_KEY, tokenizer.Status().pos);
+      }
+      entry_start = tokenizer.Status().pos;
+      found = tokenizer.TokenTag() == CBORTokenTag::STRING8 &&
+              SpanEquals(tokenizer.GetString8(), path[depth]);
+      tokenizer.Next();
+      if (tokenizer.TokenTag() == CBORTokenTag::DONE)
+        return Status(Error::CBOR_UNEXPECTED_EOF_IN_MAP,
+                      tokenizer.Status().pos);
+      if (found)
+        break;
+      tokenizer.SkipValue();
+    }
+    if (!found)
+      break;
+    value_start = tokenizer.Status().pos;
+    if (depth + 1 < path.size()) {
+      if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE)
+        return tokenizer.Status();
+      if (tokenizer.TokenTag() != CBORTokenTag::ENVELOPE)
+        return Status(Error::CBOR_MAP_START_EXPECTED, value_start);
+      continue;
+    }
+    tokenizer.SkipValue();
+    if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE)
+      return tokenizer.Status();
+    value_end = tokenizer.Status().pos;
+  }
+
+  // Determine which bytes to replace with which.
+  size_t pos;
+  size_t erase_size;
+  std::vector<uint8_t> insert;
+  if (found) {
+    if (encoded_value.empty()) {
+      pos = entry_start;
+      erase_size = value_end - entry_start;
+    } else {
+      pos = value_start;
+      erase_size = value_end - value_start;
+      insert.assign(encoded_value.begin(), encoded_value.end());
+    }
+  } else {
+    if (encoded_value.empty())
+      return Status();  // Nothing to remove.
+    if (envelopes.size() < path.size()) {
+      // A nested map along the path is missing.
+      return Status(Error::CBOR_MAP_START_EXPECTED, tokenizer.Status().pos);
+    }
+    pos = tokenizer.Status().pos;  // The STOP of the innermost map.
+    erase_size = 0;
+    EncodeString8(path[path.size() - 1], &insert);
+    insert.insert(insert.end(), encoded_value.begin(), encoded_value.end());
+  }
+  if (definite_length && (!found || encoded_value.empty()))
+    return Status(Error::CBOR_INVALID_DEFINITE_LENGTH, pos);
+
+  // Patch the envelope byte lengths first, so that |cbor| stays unmodified
+  // if one of them exceeds the limit.
+  const int64_t delta = static_cast<int64_t>(insert.size()) -
+                        static_cast<int64_t>(erase_size);
+  std::vector<uint32_t> envelope_sizes;
+  for (size_t envelope_pos : envelopes) {
+    const int64_t envelope_size =
+        ReadBytesMostSignificantByteFirst<uint32_t>(
+            bytes.subspan(envelope_pos + 2)) +
+        delta;
+    if (envelope_size > std::numeric_limits<uint32_t>::max())
+      return Status(Error::CBOR_ENVELOPE_SIZE_LIMIT_EXCEEDED, envelope_pos);
+    envelope_sizes.push_back(static_cast<uint32_t>(envelope_size));
+  }
+  for (size_t ii = 0; ii < envelopes.size(); ++ii) {
+    WriteBytesMostSignificantByteFirst<uint32_t>(
+        envelope_sizes[ii], cbor->data() + envelopes[ii] + 2);
+  }
+  // Overwrite in place where possible, and only move the tail of the
+  // message by the difference.
+  const size_t overlap = std::min(erase_size, insert.size());
+  std::copy(insert.begin(), insert.begin() + overlap, cbor->begin() + pos);
+  if (erase_size > overlap) {
+    cbor->erase(cbor->begin() + pos + overlap,
+                cbor->begin() + pos + erase_size);
+  } else {
+    cbor->insert(cbor->begin() + pos + overlap, insert.begin() + overlap,
+                 insert.end());
+  }
+  return Status();
+}
+}  // namespace
+
+Status SetEntryInCBORMap(span<span<uint8_t>> path,
+                         span<uint8_t> encoded_value,
+                         std::vector<uint8_t>* cbor) {
+  // |encoded_value| must hold exactly one value.
+  CBORTokenizer tokenizer(encoded_value);
+  if (encoded_value.empty() || tokenizer.TokenTag() == CBORTokenTag::STOP)
+    return Status(Error::CBOR_UNEXPECTED_EOF_EXPECTED_VALUE, 0);
+  tokenizer.SkipValue();
+  if (tokenizer.TokenTag() == CBORTokenTag::ERROR_VALUE)
+    return tokenizer.Status();
+  if (tokenizer.TokenTag() != CBORTokenTag::DONE)
+    return Status(Error::CBOR_TRAILING_JUNK, tokenizer.Status().pos);
+  return EditCBORMap(path, encoded_value, cbor);
+}
+
+Status RemoveEntryFromCBORMap(span<span<uint8_t>> path,
+                              std::vector<uint8_t>* cbor) {
+  return EditCBORMap(path, span<uint8_t>(), cbor);
+}
 }  // namespace cbor
 }  // namespace crdtp
@@ -7,10 +7,13 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "byte_sink.h"
 #include "export.h"
 #include "parser_handler.h"
 #include "span.h"
@@ -19,7 +22,11 @@ namespace crdtp {
 namespace cbor {
 // The binary encoding for the inspector protocol follows the CBOR specification
 // (RFC 7049). Additional constraints:
-// - Only indefinite length maps and arrays are supported.
+// - Maps and arrays are usually encoded with indefinite length. Definite
+//   length maps and arrays are supported as well; for these, decoders may
+//   use the length to pre-size their containers. Encoders emit them only if
+//   requested (see EncodeDefiniteLengthArrayStart), since older versions of
+//   this library don't accept them.
 // - Maps and arrays are wrapped with an envelope, that is, a
 //   CBOR tag with value 24 followed by a byte string specifying
 //   the byte length of the enclosed map / array. The byte string
@@ -27,8 +34,9 @@ namespace cbor {
 // - At the top level, a message must be an indefinite length map
 //   wrapped by an envelope.
 // - Maximal size for messages is 2^32 (4 GB).
-// - For scalars, we support only the int32_t range, encoded as
-//   UNSIGNED/NEGATIVE (major types 0 / 1).
+// - For integers, we support the int64_t range and unsigned values up to
+//   the uint64_t max, encoded as UNSIGNED/NEGATIVE (major types 0 / 1).
+//   Values in the int32_t range are presented as INT32 by the tokenizer.
 // - UTF16 strings, including with unbalanced surrogate pairs, are encoded
 //   as CBOR BYTE_STRING (major type 2). For such strings, the number of
 //   bytes encoded must be even.
@@ -66,6 +74,10 @@ CRDTP_EXPORT Status CheckCBORMessage(span<uint8_t> msg);
 // Encoding individual CBOR items
 // =============================================================================
 
+// The encoding routines below come in two flavors: One which appends to a
+// std::vector<uint8_t>, and one which appends to a ByteSink (see byte_sink.h).
+// Both produce the same bytes.
+
 // Some constants for CBOR tokens that only take a single byte on the wire.
 CRDTP_EXPORT uint8_t EncodeTrue();
 CRDTP_EXPORT uint8_t EncodeFalse();
@@ -74,37 +86,87 @@ CRDTP_EXPORT uint8_t EncodeIndefiniteLengthArrayStart();
 CRDTP_EXPORT uint8_t EncodeIndefiniteLengthMapStart();
 CRDTP_EXPORT uint8_t EncodeStop();
 
+// Starts a definite length array with |length| elements (major type 4).
+// Unlike for indefinite length arrays, no STOP byte follows the elements.
+CRDTP_EXPORT void EncodeDefiniteLengthArrayStart(uint64_t length,
+                                                 std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeDefiniteLengthArrayStart(uint64_t length,
+                                                 ByteSink* out);
+
+// Starts a definite length map with |num_pairs| key / value pairs
+// (major type 5). No STOP byte follows the keys and values.
+CRDTP_EXPORT void EncodeDefiniteLengthMapStart(uint64_t num_pairs,
+                                               std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeDefiniteLengthMapStart(uint64_t num_pairs,
+                                               ByteSink* out);
+
 // Encodes |value| as |UNSIGNED| (major type 0) iff >= 0, or |NEGATIVE|
 // (major type 1) iff < 0.
 CRDTP_EXPORT void EncodeInt32(int32_t value, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeInt32(int32_t value, ByteSink* out);
+
+// Encodes |value| as |UNSIGNED| (major type 0) iff >= 0, or |NEGATIVE|
+// (major type 1) iff < 0. For values in the int32_t range, this produces
+// the same bytes as EncodeInt32.
+CRDTP_EXPORT void EncodeInt64(int64_t value, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeInt64(int64_t value, ByteSink* out);
+
+// Encodes |value| as |UNSIGNED| (major type 0).
+CRDTP_EXPORT void EncodeUint64(uint64_t value, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeUint64(uint64_t value, ByteSink* out);
 
 // Encodes a UTF16 string as a BYTE_STRING (major type 2). Each utf16
 // character in |in| is emitted with most significant byte first,
 // appending to |out|.
 CRDTP_EXPORT void EncodeString16(span<uint16_t> in, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeString16(span<uint16_t> in, ByteSink* out);
 
 // Encodes a UTF8 string |in| as STRING (major type 3).
 CRDTP_EXPORT void EncodeString8(span<uint8_t> in, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeString8(span<uint8_t> in, ByteSink* out);
 
 // Encodes the given |latin1| string as STRING8.
 // If any non-ASCII character is present, it will be represented
 // as a 2 byte UTF8 sequence.
 CRDTP_EXPORT void EncodeFromLatin1(span<uint8_t> latin1,
                                    std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeFromLatin1(span<uint8_t> latin1, ByteSink* out);
 
-// Encodes the given |utf16| string as STRING8 if it's entirely US-ASCII.
-// Otherwise, encodes as STRING16.
+// Encodes the given |utf16| string as STRING8, converting it to UTF8.
+// Only if it has unpaired surrogates, which UTF8 can't represent, it's
+// encoded as STRING16.
 CRDTP_EXPORT void EncodeFromUTF16(span<uint16_t> utf16,
                                   std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeFromUTF16(span<uint16_t> utf16, ByteSink* out);
 
 // Encodes arbitrary binary data in |in| as a BYTE_STRING (major type 2) with
 // definitive length, prefixed with tag 22 indicating expected conversion to
 // base64 (see RFC 7049, Table 3 and Section 2.4.4.2).
 CRDTP_EXPORT void EncodeBinary(span<uint8_t> in, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeBinary(span<uint8_t> in, ByteSink* out);
 
 // Encodes / decodes a double as Major type 7 (SIMPLE_VALUE),
 // with additional info = 27, followed by 8 bytes in big endian.
 CRDTP_EXPORT void EncodeDouble(double value, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeDouble(double value, ByteSink* out);
+
+// Encodes a double as Major type 7 (SIMPLE_VALUE) using the shortest of
+// half precision (additional info = 25, 2 bytes), single precision
+// (additional info = 26, 4 bytes) or double precision (as EncodeDouble)
+// that represents |value| exactly. NaN is always written with 8 bytes,
+// to preserve its payload. The tokenizer accepts all three widths,
+// but decoders that only understand EncodeDouble's output don't, which
+// is why this is opt-in (see also EncodeWithCompactDoubles).
+CRDTP_EXPORT void EncodeCompactDouble(double value, std::vector<uint8_t>* out);
+CRDTP_EXPORT void EncodeCompactDouble(double value, ByteSink* out);
+
+// Transcodes the CBOR encoded message |bytes| (e.g., as produced by
+// ProtocolObject::Serialize) into |out|, writing its doubles with
+// EncodeCompactDouble. This is for the transport boundary, once the
+// receiving end is known to accept half and single precision floats. If
+// an error occurs, |out| is cleared.
+CRDTP_EXPORT Status EncodeWithCompactDoubles(span<uint8_t> bytes,
+                                             std::vector<uint8_t>* out);
 
 // =============================================================================
 // cbor::EnvelopeEncoder - for wrapping submessages
@@ -123,14 +185,79 @@ class CRDTP_EXPORT EnvelopeEncoder {
   // byte size in |byte_size_pos_|. Also emits empty bytes for the
   // byte sisze so that encoding can continue.
   void EncodeStart(std::vector<uint8_t>* out);
+  void EncodeStart(ByteSink* out);
   // This records the current size in |out| at position byte_size_pos_.
   // Returns true iff successful.
   bool EncodeStop(std::vector<uint8_t>* out);
+  bool EncodeStop(ByteSink* out);
 
  private:
   size_t byte_size_pos_ = 0;
 };
 
+// =============================================================================
+// cbor::StringRefTable - session scoped string references
+// =============================================================================
+
+// DevTools messages repeat the same map keys and values (e.g. "nodeId",
+// frame ids, URLs) over and over. A StringRefTable remembers the STRING8
+// items that were sent within a session, so that subsequent occurrences
+// can be encoded as a reference, that is, CBOR tag 25 (as in the
+// stringref extension) followed by the UNSIGNED index into the table.
+//
+// The sender and the receiver each keep a table for the session, and both
+// add every STRING8 literal that's at least 4 and at most 1024 bytes long,
+// in message order, until |max_entries| is reached; so both ends must
+// agree on |max_entries| and on the use of this mode (e.g. by negotiating
+// it when the FrontendChannel / session is created). Since this requires
+// both ends to see all strings of all messages in order, complete messages
+// are encoded via EncodeWithStringRefs and expanded via ParseCBOR at the
+// transport boundary; other consumers (CBORIndex, Dispatchable, etc.)
+// don't understand string references. If a message fails to encode or to
+// parse, the strings it added are discarded again, so that the tables
+// stay in sync.
+//
+// A table is used either for encoding (::FindOrAdd) or for decoding
+// (::Add, ::Get), not both.
+class CRDTP_EXPORT StringRefTable {
+ public:
+  explicit StringRefTable(size_t max_entries = 1024);
+  ~StringRefTable();
+
+  // Encoding: Yields true and sets |index| if |str| was added before;
+  // otherwise, adds |str| if it's eligible and yields false.
+  bool FindOrAdd(span<uint8_t> str, uint32_t* index);
+
+  // Decoding: Adds |str| if it's eligible.
+  void Add(span<uint8_t> str);
+  // Decoding: The string at |index|, which must be less than ::size().
+  span<uint8_t> Get(uint32_t index) const;
+
+  size_t size() const;
+  // Discards the strings that were added since ::size() was |size|.
+  void Truncate(size_t size);
+
+ private:
+  bool IsEligible(span<uint8_t> str) const;
+
+  const size_t max_entries_;
+  // For encoding, the index of each string in |strings_|.
+  std::unordered_map<std::string, uint32_t> indices_;
+  // The strings in the order in which they were added. A deque, so that
+  // the spans returned by ::Get remain valid when strings are added.
+  std::deque<std::string> strings_;
+};
+
+// Transcodes the CBOR encoded message |bytes| (e.g., as produced by
+// ProtocolObject::Serialize) into |out|, encoding the strings that were
+// sent before within the session as references into |string_refs|. This
+// is the only way to produce string references, as the table must see
+// each message in full. If an error occurs, |out| is cleared and
+// |string_refs| is left as it was.
+CRDTP_EXPORT Status EncodeWithStringRefs(span<uint8_t> bytes,
+                                         StringRefTable* string_refs,
+                                         std::vector<uint8_t>* out);
+
 // =============================================================================
 // cbor::NewCBOREncoder - for encoding from a streaming parser
 // =============================================================================
@@ -143,6 +270,12 @@ CRDTP_EXPORT std::unique_ptr<ParserHandler> NewCBOREncoder(
     std::vector<uint8_t>* out,
     Status* status);
 
+// Like above, but encodes into |out|, which may be e.g. a FixedByteSink or a
+// ChunkedByteSink (see byte_sink.h). For a FixedByteSink, the client must
+// check |out->ok()| to detect whether the buffer was large enough.
+CRDTP_EXPORT std::unique_ptr<ParserHandler> NewCBOREncoder(ByteSink* out,
+                                                           Status* status);
+
 // =============================================================================
 // cbor::CBORTokenizer - for parsing individual CBOR items
 // =============================================================================
@@ -150,7 +283,7 @@ CRDTP_EXPORT std::unique_ptr<ParserHandler> NewCBOREncoder(
 // Tags for the tokens within a CBOR message that CBORTokenizer understands.
 // Note that this is not the same terminology as the CBOR spec (RFC 7049),
 // but rather, our adaptation. For instance, we lump unsigned and signed
-// major type into INT32 here (and disallow values outside the int32_t range).
+// major type into INT32 / INT64 here.
 enum class CBORTokenTag {
   // Encountered an error in the structure of the message. Consult
   // status() for details.
@@ -161,6 +294,10 @@ enum class CBORTokenTag {
   NULL_VALUE,
   // An int32_t (signed 32 bit integer).
   INT32,
+  // An int64_t (signed 64 bit integer) outside of the int32_t range.
+  INT64,
+  // A uint64_t (unsigned 64 bit integer) outside of the int64_t range.
+  UINT64,
   // A double (64 bit floating point).
   DOUBLE,
   // A UTF8 string.
@@ -169,13 +306,15 @@ enum class CBORTokenTag {
   STRING16,
   // A binary string.
   BINARY,
-  // Starts an indefinite length map; after the map start we expect
-  // alternating keys and values, followed by STOP.
+  // Starts a map; after the map start we expect alternating keys and
+  // values, followed by STOP.
   MAP_START,
-  // Starts an indefinite length array; after the array start we
-  // expect values, followed by STOP.
+  // Starts an array; after the array start we expect values, followed
+  // by STOP.
   ARRAY_START,
-  // Ends a map or an array.
+  // Ends a map or an array. For definite length maps and arrays, which
+  // don't carry a stop byte on the wire, the tokenizer produces this token
+  // after the last element; it's zero bytes long.
   STOP,
   // An envelope indicator, wrapping a map or array.
   // Internally this carries the byte length of the wrapped
@@ -206,6 +345,11 @@ enum class MajorType {
 class CRDTP_EXPORT CBORTokenizer {
  public:
   explicit CBORTokenizer(span<uint8_t> bytes);
+  // Like above, but resolves string references (see StringRefTable) and
+  // adds STRING8 literals to |string_refs|. These references are presented
+  // as STRING8 tokens. Since all strings of the session must be seen in
+  // order, ::EnterEnvelope should be used rather than skipping envelopes.
+  CBORTokenizer(span<uint8_t> bytes, StringRefTable* string_refs);
   ~CBORTokenizer();
 
   // Identifies the current token that we're looking at,
@@ -221,6 +365,14 @@ class CRDTP_EXPORT CBORTokenizer {
   // letting the client explore the nested structure.
   void EnterEnvelope();
 
+  // Advances past the current value, including all nested contents.
+  // Unlike ::Next(), this also skips the contents of a map or array
+  // (MAP_START / ARRAY_START) which isn't wrapped by an envelope, by
+  // scanning for the matching STOP; nested envelopes are still skipped
+  // in constant time, using their byte length. If TokenTag() is STOP,
+  // that is, there's no value to skip, this results in an error.
+  void SkipValue();
+
   // If TokenTag() is CBORTokenTag::ERROR_VALUE, then Status().error describes
   // the error more precisely; otherwise it'll be set to Error::OK.
   // In either case, Status().pos is the current position.
@@ -232,7 +384,15 @@ class CRDTP_EXPORT CBORTokenizer {
   // To be called only if ::TokenTag() == CBORTokenTag::INT32.
   int32_t GetInt32() const;
 
+  // To be called only if ::TokenTag() == CBORTokenTag::INT64 or
+  // ::TokenTag() == CBORTokenTag::INT32.
+  int64_t GetInt64() const;
+
+  // To be called only if ::TokenTag() == CBORTokenTag::UINT64.
+  uint64_t GetUint64() const;
+
   // To be called only if ::TokenTag() == CBORTokenTag::DOUBLE.
+  // Handles half, single and double precision encodings.
   double GetDouble() const;
 
   // To be called only if ::TokenTag() == CBORTokenTag::STRING8.
@@ -245,6 +405,17 @@ class CRDTP_EXPORT CBORTokenizer {
   // To be called only if ::TokenTag() == CBORTokenTag::BINARY.
   span<uint8_t> GetBinary() const;
 
+  // To be called only if ::TokenTag() is CBORTokenTag::MAP_START or
+  // CBORTokenTag::ARRAY_START. Yields true iff the map or array was encoded
+  // with definite length.
+  bool HasDefiniteLength() const;
+
+  // To be called only if ::HasDefiniteLength(). For arrays, yields the
+  // number of elements; for maps, the number of key / value pairs.
+  // This is suitable for pre-sizing a container, since the tokenizer
+  // ensures that the message is large enough to hold that many elements.
+  size_t GetDefiniteLength() const;
+
   // To be called only if ::TokenTag() == CBORTokenTag::ENVELOPE.
   // Returns the envelope including its payload; message which
   // can be passed to the CBORTokenizer constructor, which will
@@ -261,27 +432,281 @@ class CRDTP_EXPORT CBORTokenizer {
 
  private:
   void ReadNextToken(bool enter_envelope);
+  void ReadContainerStart(MajorType type,
+                          size_t bytes_read,
+                          size_t remaining_bytes);
+  void ReadStringRef();
   void SetToken(CBORTokenTag token, size_t token_byte_length);
   void SetError(Error error);
 
   span<uint8_t> bytes_;
+  StringRefTable* const string_refs_ = nullptr;
+  // For a STRING8 token which is a string reference, the referenced string.
+  span<uint8_t> string_ref_;
   CBORTokenTag token_tag_;
   struct Status status_;
   size_t token_byte_length_;
   MajorType token_start_type_;
   uint64_t token_start_internal_value_;
+  // For each open definite length map / array, the number of items (keys
+  // and values) which remain to be read, so that STOP can be produced
+  // after the last one. Indefinite length maps / arrays nested within are
+  // tracked as well (with kIndefiniteLength), since their items don't
+  // count towards the enclosing container. Empty unless a definite length
+  // map or array is encountered.
+  std::vector<uint64_t> remaining_items_;
 };
 
 // =============================================================================
 // cbor::ParseCBOR - for receiving streaming parser events for CBOR messages
 // =============================================================================
 
+// The nesting depth of maps and arrays beyond which the parsers report
+// Error::CBOR_STACK_LIMIT_EXCEEDED, unless another limit is provided.
+constexpr int kDefaultStackLimit = 300;
+
 // Parses a CBOR encoded message from |bytes|, sending events to
 // |out|. If an error occurs, sends |out->HandleError|, and parsing stops.
 // The client is responsible for discarding the already received information in
 // that case.
 CRDTP_EXPORT void ParseCBOR(span<uint8_t> bytes, ParserHandler* out);
 
+// Like above, but resolves string references (see StringRefTable) and
+// records the strings within |bytes| in |string_refs|. If an error occurs,
+// |string_refs| is left as it was.
+CRDTP_EXPORT void ParseCBOR(span<uint8_t> bytes,
+                            ParserHandler* out,
+                            StringRefTable* string_refs);
+
+// Like above, with |string_refs| optional, but limits the nesting depth to
+// |stack_limit| rather than kDefaultStackLimit. The parser keeps track of
+// open maps and arrays on the heap, so deeply nested messages don't use
+// up the call stack.
+CRDTP_EXPORT void ParseCBOR(span<uint8_t> bytes,
+                            ParserHandler* out,
+                            StringRefTable* string_refs,
+                            int stack_limit);
+
+// =============================================================================
+// cbor::StreamingCBORParser - for parsing messages as they arrive in chunks
+// =============================================================================
+
+// Like ParseCBOR, but the message is provided in chunks of arbitrary size
+// via ::Parse, e.g. as they're received from a socket, and the events for
+// each complete token are sent to |out| right away. Only the bytes of a
+// token which is split across chunks are buffered, so a large message
+// (e.g. a heap snapshot) can be transcoded or dispatched while it's still
+// being received.
+//
+// Since an envelope is parsed before its contents arrive, a length
+// mismatch is detected once the wrapped map or array ends, rather than
+// upfront; the events for the contents were already sent by then, so as
+// with ParseCBOR, |out| must discard what it received when it gets an
+// error. String references (see StringRefTable) aren't supported.
+class CRDTP_EXPORT StreamingCBORParser {
+ public:
+  explicit StreamingCBORParser(ParserHandler* out,
+                               int stack_limit = kDefaultStackLimit);
+  ~StreamingCBORParser();
+
+  // Parses |chunk|, which continues the bytes from previous calls.
+  void Parse(span<uint8_t> chunk);
+
+  // Indicates that there are no more chunks. Sends an error to |out| if
+  // the message is incomplete.
+  void Finish();
+
+  // Error::OK unless an error was sent to |out|.
+  struct Status Status() const { return status_; }
+
+  // True once the message was parsed completely.
+  bool done() const { return done_; }
+
+ private:
+  // An open map or array.
+  struct Frame {
+    bool is_map;
+    uint64_t num_items;  // Keys and values; kIndefiniteLength if unknown.
+    uint64_t items_read;
+    size_t envelope_end;  // Position past the wrapping envelope, or npos.
+    size_t limit;         // Position past the innermost envelope, or npos.
+  };
+
+  void ConsumeToken(span<uint8_t> token);
+  void OpenContainer(bool is_map, uint64_t num_items);
+  bool CloseContainer();
+  void CompleteItem();
+  bool AtMapKey() const;
+  void SetError(Error error, size_t pos);
+
+  ParserHandler* const out_;
+  const int stack_limit_;
+  struct Status status_;
+  bool done_ = false;
+  // Position of the next byte to be parsed, counting from the first chunk.
+  size_t pos_ = 0;
+  // The start of a token which is split across chunks.
+  std::vector<uint8_t> pending_;
+  // Set after an envelope header, until the wrapped map or array starts.
+  size_t envelope_end_;
+  std::vector<Frame> stack_;
+  std::vector<uint16_t> string16_buffer_;
+};
+
+// =============================================================================
+// cbor::CBORIndex - structural index for random access into CBOR messages
+// =============================================================================
+
+// CBORIndex records the tokens of a CBOR message, as produced by
+// CBORTokenizer when entering every envelope, in a flat array. Each map,
+// array and envelope knows where its contents end, so that after the
+// index is built (one pass over the message), a CBORIndex::Cursor steps
+// from a value to its next sibling in constant time, regardless of the
+// size of the value. This is useful for messages that get inspected more
+// than once, e.g. when routing a message and then decoding parts of it.
+class CRDTP_EXPORT CBORIndex {
+ public:
+  class Cursor;
+
+  // Builds the index for |bytes|, which must outlive it. Like ParseCBOR,
+  // this expects exactly one value and checks the same structural
+  // constraints (envelope lengths, map keys, etc.); see ::status().
+  explicit CBORIndex(span<uint8_t> bytes);
+  ~CBORIndex();
+
+  // Status().ok() iff the message was indexed successfully. Otherwise,
+  // the index is empty.
+  struct Status Status() const;
+
+  span<uint8_t> bytes() const { return bytes_; }
+
+  // The number of indexed tokens, including the STOP tokens.
+  size_t size() const { return entries_.size(); }
+
+  // A cursor pointing at the top-level value; DONE if the index is empty.
+  Cursor Root() const;
+
+ private:
+  struct Entry {
+    // Byte offset of the token within |bytes_|.
+    uint32_t pos;
+    // Index of the entry past this value, including all nested tokens
+    // for maps, arrays and envelopes.
+    uint32_t next;
+    CBORTokenTag tag;
+  };
+
+  void Build();
+  void SetError(struct Status status);
+
+  span<uint8_t> bytes_;
+  struct Status status_;
+  std::vector<Entry> entries_;
+};
+
+// A lightweight position within a CBORIndex, which must outlive it.
+// Moving a cursor never scans the message; it's always O(1).
+class CRDTP_EXPORT CBORIndex::Cursor {
+ public:
+  // The token at the cursor. Past the last element of a map or array,
+  // this is STOP; past the top-level value, DONE.
+  CBORTokenTag TokenTag() const;
+
+  // The byte offset of the token at the cursor within the message.
+  size_t pos() const;
+
+  // The bytes of the value at the cursor. For maps, arrays and envelopes,
+  // this includes the nested contents; for an envelope, this is
+  // equivalent to CBORTokenizer::GetEnvelope().
+  span<uint8_t> Bytes() const;
+
+  // A tokenizer for ::Bytes(), positioned at the value at the cursor,
+  // so that its accessors (e.g. GetInt32, GetString8) can be used.
+  // Note that Status().pos for this tokenizer is relative to ::pos().
+  CBORTokenizer Tokenize() const;
+
+  // Skips past the value at the cursor, including nested contents.
+  // Cannot be called if TokenTag() is STOP or DONE.
+  Cursor NextSibling() const;
+
+  // For an ENVELOPE, yields the map or array inside of it. For
+  // MAP_START / ARRAY_START, yields the first key / element or STOP.
+  Cursor FirstChild() const;
+
+  // For a map (MAP_START, or an ENVELOPE wrapping a map), yields the value
+  // for the STRING8 key |key|, or the STOP token ending the map if no
+  // such key exists. This steps over values in O(1) each.
+  Cursor FindMapValue(span<uint8_t> key) const;
+
+ private:
+  friend class CBORIndex;
+  Cursor(const CBORIndex* index, size_t entry) : index_(index), entry_(entry) {}
+
+  const CBORIndex* index_;
+  size_t entry_;
+};
+
+// =============================================================================
+// cbor::CBORPath - for extracting individual values from CBOR messages
+// =============================================================================
+
+// A compiled path, such as "params.frameId" or "result.nodes[3].name",
+// which selects a value within a CBOR message. A path is a sequence of map
+// keys, separated by '.', and array indices in brackets; keys are compared
+// against STRING8 map keys and may not contain '.', '[' or ']'. The empty
+// path selects the top-level value. Envelopes are entered implicitly.
+//
+// Evaluating a path walks the message with a CBORTokenizer, skipping the
+// values that aren't on the path without decoding them, and doesn't
+// allocate. This is much cheaper than ParseCBOR or building a CBORIndex
+// when only a few values of a message are of interest.
+class CRDTP_EXPORT CBORPath {
+ public:
+  // Compiles |path|; see ::ok().
+  explicit CBORPath(span<uint8_t> path);
+  ~CBORPath();
+
+  // False iff the path passed to the constructor is malformed, in which
+  // case nothing will be found.
+  bool ok() const { return ok_; }
+
+  // Yields the bytes of the value selected by this path within |message|,
+  // or an empty span if there's no such value or the message is malformed
+  // before the value is reached. For maps, arrays and envelopes, this
+  // includes the nested contents. The result may be passed to the
+  // CBORTokenizer constructor, or to ::Find of another path.
+  span<uint8_t> Find(span<uint8_t> message) const;
+
+  // Like ::Find, but the value must be of the indicated type, which is
+  // then stored into |value|. Returns false if not.
+  bool FindBool(span<uint8_t> message, bool* value) const;
+  bool FindInt32(span<uint8_t> message, int32_t* value) const;
+  // Accepts INT32 as well.
+  bool FindInt64(span<uint8_t> message, int64_t* value) const;
+  // Accepts integers as well.
+  bool FindDouble(span<uint8_t> message, double* value) const;
+  // |value| points into |message|.
+  bool FindString8(span<uint8_t> message, span<uint8_t>* value) const;
+
+ private:
+  struct Step {
+    // Offset and length of the map key within |path_|, unless
+    // |is_index|, in which case |index| is the array index.
+    size_t key_pos;
+    size_t key_size;
+    size_t index;
+    bool is_index;
+  };
+
+  // Positions |tokenizer| at the value selected by this path. Returns
+  // false if there's no such value.
+  bool Walk(CBORTokenizer* tokenizer) const;
+
+  std::vector<uint8_t> path_;
+  std::vector<Step> steps_;
+  bool ok_ = true;
+};
+
 // =============================================================================
 // cbor::AppendString8EntryToMap - for limited in-place editing of messages
 // =============================================================================
@@ -293,6 +718,29 @@ CRDTP_EXPORT Status AppendString8EntryToCBORMap(span<uint8_t> string8_key,
                                                 span<uint8_t> string8_value,
                                                 std::vector<uint8_t>* cbor);
 
+// =============================================================================
+// cbor::SetEntryInCBORMap - for in-place editing of messages
+// =============================================================================
+
+// These functions edit a |cbor| message directly, e.g. for a proxy which
+// rewrites the "id" or "sessionId" of the messages it routes, without
+// parsing and re-encoding them. |path| holds the keys leading from the
+// top-level map through nested maps to the entry, e.g. {"params", "url"}.
+// The byte lengths of the envelopes enclosing the entry are patched up.
+// Maps which get an entry inserted or removed must have indefinite length.
+// Status.ok() iff successful; if not, |cbor| is unmodified.
+
+// Sets the value of the entry at |path| to |encoded_value|, which must be
+// a single CBOR value (e.g. as produced by EncodeInt32 or EncodeString8).
+// If the last key isn't present, the entry is appended to its map.
+CRDTP_EXPORT Status SetEntryInCBORMap(span<span<uint8_t>> path,
+                                      span<uint8_t> encoded_value,
+                                      std::vector<uint8_t>* cbor);
+
+// Removes the entry at |path|, if it's present.
+CRDTP_EXPORT Status RemoveEntryFromCBORMap(span<span<uint8_t>> path,
+                                           std::vector<uint8_t>* cbor);
+
 namespace internals {  // Exposed only for writing tests.
 CRDTP_EXPORT size_t ReadTokenStart(span<uint8_t> bytes,
                                    cbor::MajorType* type,
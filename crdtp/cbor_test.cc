@@ -218,7 +218,7 @@ TEST(EncodeDecodeInt32Test, CantRoundtripUint32) {
   // std::numerical_limits<int32_t>::max(), so we can't encode
   // it with EncodeInt32. However, CBOR does support this, so we
   // encode it here manually with the internal routine, just to observe
-  // that it's considered an invalid int32 by CBORTokenizer.
+  // that it's not considered an INT32 by CBORTokenizer.
   std::vector<uint8_t> encoded;
   internals::WriteTokenStart(MajorType::UNSIGNED, 0xdeadbeef, &encoded);
   // 1 for initial byte, 4 for the uint32.
@@ -228,11 +228,11 @@ TEST(EncodeDecodeInt32Test, CantRoundtripUint32) {
       encoded,
       ElementsAreArray(std::array<uint8_t, 5>{{26, 0xde, 0xad, 0xbe, 0xef}}));
 
-  // Now try to decode; we treat this as an invalid INT32.
+  // Now try to decode; 0xdeadbeef is > std::numerical_limits<int32_t>::max(),
+  // so it's an INT64.
   CBORTokenizer tokenizer(SpanFrom(encoded));
-  // 0xdeadbeef is > std::numerical_limits<int32_t>::max().
-  EXPECT_EQ(CBORTokenTag::ERROR_VALUE, tokenizer.TokenTag());
-  EXPECT_THAT(tokenizer.Status(), StatusIs(Error::CBOR_INVALID_INT32, 0u));
+  EXPECT_EQ(CBORTokenTag::INT64, tokenizer.TokenTag());
+  EXPECT_EQ(0xdeadbeef, tokenizer.GetInt64());
 }
 
 TEST(EncodeDecodeInt32Test, DecodeErrorCases) {
@@ -248,12 +248,6 @@ TEST(EncodeDecodeInt32Test, DecodeErrorCases) {
                "additional info = 27 would require 8 bytes of payload (but "
                "it's 3)"},
       TestCase{{29}, "additional info = 29 isn't recognized"},
-      TestCase{{1 << 5 | 27, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
-               "Max UINT64 payload is outside the allowed range"},
-      TestCase{{1 << 5 | 26, 0xff, 0xff, 0xff, 0xff},
-               "Max UINT32 payload is outside the allowed range"},
-      TestCase{{1 << 5 | 26, 0x80, 0x00, 0x00, 0x00},
-               "UINT32 payload w/ high bit set is outside the allowed range"},
   }};
   for (const TestCase& test : tests) {
     SCOPED_TRACE(test.msg);
@@ -263,6 +257,59 @@ TEST(EncodeDecodeInt32Test, DecodeErrorCases) {
   }
 }
 
+TEST(EncodeDecodeInt64Test, RoundtripsExamples) {
+  std::vector<int64_t> examples = {
+      0,
+      -1,
+      std::numeric_limits<int32_t>::max(),
+      std::numeric_limits<int32_t>::min(),
+      static_cast<int64_t>(std::numeric_limits<int32_t>::max()) + 1,
+      static_cast<int64_t>(std::numeric_limits<int32_t>::min()) - 1,
+      1000LL * 1000 * 1000 * 1000 * 1000,
+      std::numeric_limits<int64_t>::max(),
+      std::numeric_limits<int64_t>::min()};
+  for (int64_t example : examples) {
+    SCOPED_TRACE(std::string("example ") + std::to_string(example));
+    std::vector<uint8_t> encoded;
+    EncodeInt64(example, &encoded);
+    CBORTokenizer tokenizer(SpanFrom(encoded));
+    if (example >= std::numeric_limits<int32_t>::min() &&
+        example <= std::numeric_limits<int32_t>::max()) {
+      // Small values are encoded exactly like EncodeInt32 would.
+      std::vector<uint8_t> encoded_int32;
+      EncodeInt32(static_cast<int32_t>(example), &encoded_int32);
+      EXPECT_THAT(encoded, ElementsAreArray(encoded_int32));
+      EXPECT_EQ(CBORTokenTag::INT32, tokenizer.TokenTag());
+    } else {
+      EXPECT_EQ(CBORTokenTag::INT64, tokenizer.TokenTag());
+    }
+    EXPECT_EQ(example, tokenizer.GetInt64());
+    tokenizer.Next();
+    EXPECT_EQ(CBORTokenTag::DONE, tokenizer.TokenTag());
+  }
+}
+
+TEST(EncodeDecodeInt64Test, RoundtripsUint64) {
+  std::vector<uint8_t> encoded;
+  EncodeUint64(std::numeric_limits<uint64_t>::max(), &encoded);
+  EXPECT_THAT(encoded, ElementsAreArray(std::array<uint8_t, 9>{
+                           {27, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                            0xff}}));
+  CBORTokenizer tokenizer(SpanFrom(encoded));
+  EXPECT_EQ(CBORTokenTag::UINT64, tokenizer.TokenTag());
+  EXPECT_EQ(std::numeric_limits<uint64_t>::max(), tokenizer.GetUint64());
+}
+
+TEST(EncodeDecodeInt64Test, NegativeOutsideOfInt64Range) {
+  // -2^64 is a perfectly fine value to encode as CBOR negative, but it's
+  // outside the int64_t range.
+  std::vector<uint8_t> encoded = {1 << 5 | 27, 0xff, 0xff, 0xff, 0xff,
+                                  0xff,        0xff, 0xff, 0xff};
+  CBORTokenizer tokenizer(SpanFrom(encoded));
+  EXPECT_EQ(CBORTokenTag::ERROR_VALUE, tokenizer.TokenTag());
+  EXPECT_THAT(tokenizer.Status(), StatusIs(Error::CBOR_INVALID_INT64, 0u));
+}
+
 TEST(EncodeDecodeInt32Test, RoundtripsMinus24) {
   // This roundtrips the int32_t value -24 through the pair of EncodeInt32 /
   // CBORTokenizer; this is interesting since -24 is encoded as
@@ -483,6 +530,15 @@ TEST(EncodeFromLatin1Test, ConvertsToUTF8IfNeeded) {
       {"\xA5 500 are about \xA3 3.50; a y with umlaut is \xFF",
        "¥ 500 are about £ 3.50; a y with umlaut is ÿ"}};
 
+  // A long one, to exercise the vectorized paths.
+  std::string latin1_long = "\xA5";
+  std::string utf8_long = "¥";
+  for (int ii = 0; ii < 300; ++ii) {
+    latin1_long += ii % 7 ? 'x' : '\xFF';
+    utf8_long += ii % 7 ? "x" : "ÿ";
+  }
+  examples.emplace_back(latin1_long, utf8_long);
+
   for (const auto& example : examples) {
     const std::string& latin1 = example.first;
     const std::string& expected_utf8 = example.second;
@@ -510,21 +566,48 @@ TEST(EncodeFromUTF16Test, ConvertsToUTF8IfEasy) {
   EXPECT_THAT(decoded_str, testing::Eq("easy"));
 }
 
-TEST(EncodeFromUTF16Test, EncodesAsString16IfNeeded) {
-  // Since this message contains non-ASCII characters, the routine is
-  // forced to encode as UTF16. We see this below by checking that the
-  // token tag is STRING16.
-  std::vector<uint16_t> msg = {'H', 'e', 'l',    'l',    'o',
-                               ',', ' ', 0xd83c, 0xdf0e, '.'};
+TEST(EncodeFromUTF16Test, ConvertsToUTF8) {
+  // One, two, three and four byte UTF8 sequences (the latter from a
+  // surrogate pair), and enough ASCII to exercise the vectorized paths.
+  std::vector<uint16_t> msg = {'H', 'e', 'l',    'l',    'o',   ',',
+                               ' ', 0xe4, 0x20ac, 0xd83c, 0xdf0e, '.'};
+  std::string expected = "Hello, ä€🌎.";
+  for (int ii = 0; ii < 300; ++ii) {
+    msg.push_back('a' + ii % 26);
+    expected.push_back('a' + ii % 26);
+  }
+  msg.push_back(0x7ff);
+  expected += "\xdf\xbf";
   std::vector<uint8_t> encoded;
   EncodeFromUTF16(span<uint16_t>(msg.data(), msg.size()), &encoded);
 
   CBORTokenizer tokenizer(SpanFrom(encoded));
-  EXPECT_EQ(CBORTokenTag::STRING16, tokenizer.TokenTag());
-  std::vector<uint16_t> decoded =
-      String16WireRepToHost(tokenizer.GetString16WireRep());
-  std::string utf8_decoded = UTF16ToUTF8(SpanFrom(decoded));
-  EXPECT_EQ("Hello, 🌎.", utf8_decoded);
+  EXPECT_EQ(CBORTokenTag::STRING8, tokenizer.TokenTag());
+  EXPECT_EQ(expected, std::string(tokenizer.GetString8().begin(),
+                                  tokenizer.GetString8().end()));
+  tokenizer.Next();
+  EXPECT_EQ(CBORTokenTag::DONE, tokenizer.TokenTag());
+
+  // Same bytes via ByteSink.
+  std::vector<uint8_t> encoded_via_sink;
+  VectorByteSink sink(&encoded_via_sink);
+  EncodeFromUTF16(span<uint16_t>(msg.data(), msg.size()), &sink);
+  EXPECT_EQ(encoded, encoded_via_sink);
+}
+
+TEST(EncodeFromUTF16Test, EncodesAsString16IfNeeded) {
+  // Unpaired surrogates can't be represented in UTF8, so the routine is
+  // forced to encode as UTF16. We see this below by checking that the
+  // token tag is STRING16.
+  for (const std::vector<uint16_t>& msg : std::vector<std::vector<uint16_t>>{
+           {'H', 'i', 0xd83c}, {0xdf0e, 'H', 'i'}, {0xd83c, 'H', 'i'}}) {
+    std::vector<uint8_t> encoded;
+    EncodeFromUTF16(span<uint16_t>(msg.data(), msg.size()), &encoded);
+
+    CBORTokenizer tokenizer(SpanFrom(encoded));
+    EXPECT_EQ(CBORTokenTag::STRING16, tokenizer.TokenTag());
+    EXPECT_EQ(msg, String16WireRepToHost(tokenizer.GetString16WireRep()));
+  }
 }
 
 //
@@ -621,6 +704,125 @@ TEST(EncodeDecodeDoubleTest, RoundtripsAdditionalExamples) {
   }
 }
 
+//
+// EncodeCompactDouble / CBORTokenTag::DOUBLE
+//
+TEST(EncodeDecodeCompactDoubleTest, RFC7049Examples) {
+  // https://tools.ietf.org/html/rfc7049#appendix-A
+  struct Example {
+    double value;
+    std::vector<uint8_t> encoded;
+  };
+  std::vector<Example> examples = {
+      {0.0, {0xf9, 0x00, 0x00}},
+      {-0.0, {0xf9, 0x80, 0x00}},
+      {1.0, {0xf9, 0x3c, 0x00}},
+      {1.5, {0xf9, 0x3e, 0x00}},
+      {65504.0, {0xf9, 0x7b, 0xff}},
+      {5.960464477539063e-8, {0xf9, 0x00, 0x01}},
+      {0.00006103515625, {0xf9, 0x04, 0x00}},
+      {-4.0, {0xf9, 0xc4, 0x00}},
+      {std::numeric_limits<double>::infinity(), {0xf9, 0x7c, 0x00}},
+      {-std::numeric_limits<double>::infinity(), {0xf9, 0xfc, 0x00}},
+      {100000.0, {0xfa, 0x47, 0xc3, 0x50, 0x00}},
+      {3.4028234663852886e+38, {0xfa, 0x7f, 0x7f, 0xff, 0xff}},
+      {1.1, {0xfb, 0x3f, 0xf1, 0x99, 0x99, 0x99, 0x99, 0x99, 0x9a}},
+      {1.0e+300, {0xfb, 0x7e, 0x37, 0xe4, 0x3c, 0x88, 0x00, 0x75, 0x9c}},
+  };
+  for (const Example& example : examples) {
+    SCOPED_TRACE(std::string("example ") + std::to_string(example.value));
+    std::vector<uint8_t> encoded;
+    EncodeCompactDouble(example.value, &encoded);
+    EXPECT_THAT(encoded, ElementsAreArray(example.encoded));
+    CBORTokenizer tokenizer(SpanFrom(encoded));
+    EXPECT_EQ(CBORTokenTag::DOUBLE, tokenizer.TokenTag());
+    EXPECT_EQ(example.value, tokenizer.GetDouble());
+    EXPECT_EQ(std::signbit(example.value), std::signbit(tokenizer.GetDouble()));
+    tokenizer.Next();
+    EXPECT_EQ(CBORTokenTag::DONE, tokenizer.TokenTag());
+  }
+}
+
+TEST(EncodeDecodeCompactDoubleTest, RoundtripsAdditionalExamples) {
+  std::vector<double> examples = {3.1415,
+                                  0.5,
+                                  1.0 / 3,
+                                  1e-7,
+                                  65505.0,
+                                  16777217.0,
+                                  std::numeric_limits<float>::denorm_min(),
+                                  std::numeric_limits<double>::min(),
+                                  std::numeric_limits<double>::max(),
+                                  std::numeric_limits<double>::quiet_NaN()};
+  for (double example : examples) {
+    SCOPED_TRACE(std::string("example ") + std::to_string(example));
+    std::vector<uint8_t> encoded;
+    EncodeCompactDouble(example, &encoded);
+    CBORTokenizer tokenizer(SpanFrom(encoded));
+    EXPECT_EQ(CBORTokenTag::DOUBLE, tokenizer.TokenTag());
+    if (std::isnan(example))
+      EXPECT_TRUE(std::isnan(tokenizer.GetDouble()));
+    else
+      EXPECT_EQ(example, tokenizer.GetDouble());
+    tokenizer.Next();
+    EXPECT_EQ(CBORTokenTag::DONE, tokenizer.TokenTag());
+  }
+}
+
+TEST(EncodeDecodeCompactDoubleTest, HalfPrecisionNaN) {
+  // Other encoders emit NaN as half precision (RFC 7049 Section 3.9).
+  std::vector<uint8_t> encoded = {0xf9, 0x7e, 0x00};
+  CBORTokenizer tokenizer(SpanFrom(encoded));
+  EXPECT_EQ(CBORTokenTag::DOUBLE, tokenizer.TokenTag());
+  EXPECT_TRUE(std::isnan(tokenizer.GetDouble()));
+}
+
+TEST(EncodeDecodeCompactDoubleTest, TruncatedError) {
+  for (const std::vector<uint8_t>& encoded : std::vector<std::vector<uint8_t>>{
+           {0xf9, 0x3c}, {0xfa, 0x47, 0xc3, 0x50}}) {
+    CBORTokenizer tokenizer(SpanFrom(encoded));
+    EXPECT_EQ(CBORTokenTag::ERROR_VALUE, tokenizer.TokenTag());
+    EXPECT_EQ(Error::CBOR_INVALID_DOUBLE, tokenizer.Status().error);
+  }
+}
+
+TEST(EncodeDecodeCompactDoubleTest, EncodeWithCompactDoubles) {
+  // {"a": [1.5, 0.1, 1.0e+300, 7]}
+  std::vector<uint8_t> message;
+  EnvelopeEncoder envelope;
+  envelope.EncodeStart(&message);
+  message.push_back(EncodeIndefiniteLengthMapStart());
+  EncodeString8(SpanFrom("a"), &message);
+  EnvelopeEncoder array_envelope;
+  array_envelope.EncodeStart(&message);
+  message.push_back(EncodeIndefiniteLengthArrayStart());
+  for (double value : {1.5, 0.1, 1.0e+300})
+    EncodeDouble(value, &message);
+  EncodeInt32(7, &message);
+  message.push_back(EncodeStop());
+  array_envelope.EncodeStop(&message);
+  message.push_back(EncodeStop());
+  envelope.EncodeStop(&message);
+
+  std::vector<uint8_t> compact;
+  EXPECT_THAT(EncodeWithCompactDoubles(SpanFrom(message), &compact),
+              StatusIsOk());
+  // 1.5 takes 3 bytes rather than 9; 0.1 and 1.0e+300 need 64 bits.
+  EXPECT_EQ(message.size() - 6, compact.size());
+  std::string json;
+  EXPECT_THAT(json::ConvertCBORToJSON(SpanFrom(compact), &json),
+              StatusIsOk());
+  std::string expected_json;
+  EXPECT_THAT(json::ConvertCBORToJSON(SpanFrom(message), &expected_json),
+              StatusIsOk());
+  EXPECT_EQ(expected_json, json);
+
+  // Errors leave |out| empty.
+  message.pop_back();
+  EXPECT_FALSE(EncodeWithCompactDoubles(SpanFrom(message), &compact).ok());
+  EXPECT_TRUE(compact.empty());
+}
+
 TEST(EncodeDecodeEnvelopesTest, MessageWithNestingAndEnvelopeContentsAccess) {
   // This encodes and decodes the following message, which has some nesting
   // and therefore envelopes.
@@ -686,6 +888,138 @@ TEST(EncodeDecodeEnvelopesTest, MessageWithNestingAndEnvelopeContentsAccess) {
   ASSERT_EQ(CBORTokenTag::DONE, tokenizer.TokenTag());
 }
 
+TEST(CBORTokenizerTest, SkipValue) {
+  // Encodes [1, {"a": [2]}, {"b": 3}, 4], where the outer array and the
+  // first map aren't wrapped by an envelope, but the second map is.
+  std::vector<uint8_t> message;
+  message.push_back(EncodeIndefiniteLengthArrayStart());
+  EncodeInt32(1, &message);
+  message.push_back(EncodeIndefiniteLengthMapStart());
+  EncodeString8(SpanFrom("a"), &message);
+  message.push_back(EncodeIndefiniteLengthArrayStart());
+  EncodeInt32(2, &message);
+  message.push_back(EncodeStop());
+  message.push_back(EncodeStop());
+  EnvelopeEncoder envelope;
+  envelope.EncodeStart(&message);
+  message.push_back(EncodeIndefiniteLengthMapStart());
+  EncodeString8(SpanFrom("b"), &message);
+  EncodeInt32(3, &message);
+  message.push_back(EncodeStop());
+  envelope.EncodeStop(&message);
+  EncodeInt32(4, &message);
+  message.push_back(EncodeStop());
+
+  CBORTokenizer tokenizer(SpanFrom(message));
+  ASSERT_EQ(CBORTokenTag::ARRAY_START, tokenizer.TokenTag());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::INT32, tokenizer.TokenTag());
+  tokenizer.SkipValue();
+  ASSERT_EQ(CBORTokenTag::MAP_START, tokenizer.TokenTag());
+  tokenizer.SkipValue();
+  ASSERT_EQ(CBORTokenTag::ENVELOPE, tokenizer.TokenTag());
+  tokenizer.SkipValue();
+  ASSERT_EQ(CBORTokenTag::INT32, tokenizer.TokenTag());
+  EXPECT_EQ(4, tokenizer.GetInt32());
+  tokenizer.Next();
+  EXPECT_EQ(CBORTokenTag::STOP, tokenizer.TokenTag());
+  // There's no value to skip at STOP.
+  tokenizer.SkipValue();
+  EXPECT_THAT(tokenizer.Status(),
+              StatusIs(Error::CBOR_UNSUPPORTED_VALUE, message.size() - 1));
+
+  // Skipping the entire array lands at the end.
+  CBORTokenizer outer(SpanFrom(message));
+  outer.SkipValue();
+  EXPECT_EQ(CBORTokenTag::DONE, outer.TokenTag());
+
+  // If the array is truncated, skipping it is an error.
+  std::vector<uint8_t> truncated(message.begin(), message.end() - 1);
+  CBORTokenizer truncated_tokenizer(SpanFrom(truncated));
+  truncated_tokenizer.SkipValue();
+  EXPECT_EQ(CBORTokenTag::ERROR_VALUE, truncated_tokenizer.TokenTag());
+  EXPECT_THAT(truncated_tokenizer.Status(),
+              StatusIs(Error::CBOR_UNEXPECTED_EOF_IN_ARRAY, truncated.size()));
+}
+
+TEST(EncodeDecodeDefiniteLengthTest, TokenizesMapsAndArrays) {
+  // Encodes [{"a": 1}, [], [2]], where the last array has indefinite
+  // length and all other maps and arrays have definite length.
+  std::vector<uint8_t> message;
+  EncodeDefiniteLengthArrayStart(3, &message);
+  EncodeDefiniteLengthMapStart(1, &message);
+  EncodeString8(SpanFrom("a"), &message);
+  EncodeInt32(1, &message);
+  EncodeDefiniteLengthArrayStart(0, &message);
+  message.push_back(EncodeIndefiniteLengthArrayStart());
+  EncodeInt32(2, &message);
+  message.push_back(EncodeStop());
+  EXPECT_THAT(message, ElementsAreArray(std::array<uint8_t, 9>{
+                           {0x83, 0xa1, 0x61, 'a', 1, 0x80, 0x9f, 2, 0xff}}));
+
+  CBORTokenizer tokenizer(SpanFrom(message));
+  ASSERT_EQ(CBORTokenTag::ARRAY_START, tokenizer.TokenTag());
+  EXPECT_TRUE(tokenizer.HasDefiniteLength());
+  EXPECT_EQ(3u, tokenizer.GetDefiniteLength());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::MAP_START, tokenizer.TokenTag());
+  EXPECT_TRUE(tokenizer.HasDefiniteLength());
+  EXPECT_EQ(1u, tokenizer.GetDefiniteLength());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::STRING8, tokenizer.TokenTag());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::INT32, tokenizer.TokenTag());
+  tokenizer.Next();
+  // The STOP for definite length maps / arrays takes no bytes on the wire.
+  ASSERT_EQ(CBORTokenTag::STOP, tokenizer.TokenTag());
+  EXPECT_EQ(5u, tokenizer.Status().pos);
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::ARRAY_START, tokenizer.TokenTag());
+  EXPECT_EQ(0u, tokenizer.GetDefiniteLength());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::STOP, tokenizer.TokenTag());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::ARRAY_START, tokenizer.TokenTag());
+  EXPECT_FALSE(tokenizer.HasDefiniteLength());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::INT32, tokenizer.TokenTag());
+  tokenizer.Next();
+  ASSERT_EQ(CBORTokenTag::STOP, tokenizer.TokenTag());
+  tokenizer.Next();
+  // The STOP for the outer array.
+  ASSERT_EQ(CBORTokenTag::STOP, tokenizer.TokenTag());
+  EXPECT_EQ(message.size(), tokenizer.Status().pos);
+  tokenizer.Next();
+  EXPECT_EQ(CBORTokenTag::DONE, tokenizer.TokenTag());
+}
+
+TEST(EncodeDecodeDefiniteLengthTest, ErrorCases) {
+  struct TestCase {
+    std::vector<uint8_t> data;
+    std::string msg;
+  };
+  std::vector<TestCase> tests{
+      {TestCase{{0x82, 1}, "more elements than remaining bytes"},
+       TestCase{{0xa1, 1}, "more keys and values than remaining bytes"},
+       TestCase{{0x9b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
+                "length too large"},
+       TestCase{{0x99, 0}, "length truncated"}}};
+  for (const TestCase& test : tests) {
+    SCOPED_TRACE(test.msg);
+    CBORTokenizer tokenizer(SpanFrom(test.data));
+    EXPECT_EQ(CBORTokenTag::ERROR_VALUE, tokenizer.TokenTag());
+    EXPECT_THAT(tokenizer.Status(),
+                StatusIs(Error::CBOR_INVALID_DEFINITE_LENGTH, 0));
+  }
+  // A definite length array can't be stopped early.
+  std::vector<uint8_t> stopped = {0x82, 1, 0xff};
+  CBORTokenizer tokenizer(SpanFrom(stopped));
+  tokenizer.Next();
+  tokenizer.Next();
+  EXPECT_THAT(tokenizer.Status(),
+              StatusIs(Error::CBOR_INVALID_DEFINITE_LENGTH, 2));
+}
+
 // =============================================================================
 // cbor::NewCBOREncoder - for encoding from a streaming parser
 // =============================================================================
@@ -728,18 +1062,13 @@ TEST(JsonCborRoundtrip, EncodingDecoding) {
   std::vector<uint8_t> expected = {
       0xd8,            // envelope
       0x5a,            // byte string with 32 bit length
-      0,    0, 0, 94,  // length is 94 bytes
+      0,    0, 0, 86,  // length is 86 bytes
   };
   expected.push_back(0xbf);  // indef length map start
   EncodeString8(SpanFrom("string"), &expected);
-  // This is followed by the encoded string for "Hello, 🌎."
-  // So, it's the same bytes that we tested above in
-  // EncodeDecodeString16Test.RoundtripsHelloWorld.
-  expected.push_back(/*major type=*/2 << 5 | /*additional info=*/20);
-  for (uint8_t ch : std::array<uint8_t, 20>{
-           {'H', 0, 'e', 0, 'l',  0,    'l',  0,    'o', 0,
-            ',', 0, ' ', 0, 0x3c, 0xd8, 0x0e, 0xdf, '.', 0}})
-    expected.push_back(ch);
+  // This is followed by the encoded string for "Hello, 🌎.", which the
+  // JSON parser delivers as UTF16 and the encoder converts to UTF8.
+  EncodeString8(SpanFrom("Hello, \xf0\x9f\x8c\x8e."), &expected);
   EncodeString8(SpanFrom("double"), &expected);
   EncodeDouble(3.1415, &expected);
   EncodeString8(SpanFrom("int"), &expected);
@@ -827,6 +1156,42 @@ TEST(JSONToCBOREncoderTest, HelloWorldBinary_WithTripToJson) {
   EXPECT_EQ("{\"foo\":\"SGVsbG8sIHdvcmxkLg==\"}", decoded);
 }
 
+TEST(JSONToCBOREncoderTest, EncodesIntoByteSinks) {
+  // The encoder produces the same bytes, regardless of whether it's
+  // writing into a std::vector<uint8_t> or into a ByteSink.
+  std::string json =
+      "{\"msg\":\"Hello, \\ud83c\\udf0e.\",\"lst\":[1,2,3],\"d\":3.1415}";
+  std::vector<uint8_t> expected;
+  Status status;
+  std::unique_ptr<ParserHandler> encoder = NewCBOREncoder(&expected, &status);
+  json::ParseJSON(SpanFrom(json), encoder.get());
+  ASSERT_THAT(status, StatusIsOk());
+
+  ChunkedByteSink chunked(/*chunk_size=*/7);
+  encoder = NewCBOREncoder(&chunked, &status);
+  json::ParseJSON(SpanFrom(json), encoder.get());
+  EXPECT_THAT(status, StatusIsOk());
+  std::vector<uint8_t> joined;
+  for (const std::vector<uint8_t>& chunk : chunked.chunks())
+    joined.insert(joined.end(), chunk.begin(), chunk.end());
+  EXPECT_THAT(joined, ElementsAreArray(expected));
+
+  std::vector<uint8_t> buffer(expected.size());
+  FixedByteSink fixed(buffer.data(), buffer.size());
+  encoder = NewCBOREncoder(&fixed, &status);
+  json::ParseJSON(SpanFrom(json), encoder.get());
+  EXPECT_THAT(status, StatusIsOk());
+  EXPECT_TRUE(fixed.ok());
+  EXPECT_THAT(buffer, ElementsAreArray(expected));
+
+  // If the buffer is too small, the sink reports it.
+  FixedByteSink too_small(buffer.data(), buffer.size() - 1);
+  encoder = NewCBOREncoder(&too_small, &status);
+  json::ParseJSON(SpanFrom(json), encoder.get());
+  EXPECT_FALSE(too_small.ok());
+  EXPECT_EQ(expected.size(), too_small.size());
+}
+
 // =============================================================================
 // cbor::ParseCBOR - for receiving streaming parser events for CBOR messages
 // =============================================================================
@@ -869,6 +1234,31 @@ TEST(ParseCBORTest, ParseCBORHelloWorld) {
   EXPECT_EQ("{\"msg\":\"Hello, \\ud83c\\udf0e.\"}", out);
 }
 
+TEST(ParseCBORTest, UTF16AtAnyAlignment) {
+  // On little endian hosts, UTF16 strings which are suitably aligned in the
+  // input are passed to the handler without copying; the others go through
+  // a scratch buffer. Either way, the result must be the same.
+  std::vector<uint8_t> message;
+  message.push_back(EncodeIndefiniteLengthArrayStart());
+  std::array<uint16_t, 3> first = {{'a', 0x263e, 'b'}};
+  EncodeString16(span<uint16_t>(first.data(), first.size()), &message);
+  std::array<uint16_t, 2> second = {{0xd83c, 0xdf0e}};
+  EncodeString16(span<uint16_t>(second.data(), second.size()), &message);
+  message.push_back(EncodeStop());
+  for (size_t offset = 0; offset < 2; ++offset) {
+    std::vector<uint8_t> bytes(offset, 0);
+    bytes.insert(bytes.end(), message.begin(), message.end());
+    std::string out;
+    Status status;
+    std::unique_ptr<ParserHandler> json_writer =
+        json::NewJSONEncoder(&out, &status);
+    ParseCBOR(span<uint8_t>(bytes.data() + offset, message.size()),
+              json_writer.get());
+    EXPECT_THAT(status, StatusIsOk());
+    EXPECT_EQ("[\"a\\u263eb\",\"\\ud83c\\udf0e\"]", out);
+  }
+}
+
 TEST(ParseCBORTest, UTF8IsSupportedInKeys) {
   const uint8_t kPayloadLen = 11;
   std::vector<uint8_t> bytes = {cbor::InitialByteForEnvelope(),
@@ -1082,6 +1472,42 @@ TEST(ParseCBORTest, StackLimitExceededError) {
   }
 }
 
+TEST(ParseCBORTest, StackLimitExceededError_ConfiguredLimit) {
+  std::vector<uint8_t> small_example = MakeNestedCBOR(3);
+  size_t opening_segment_size = 1;  // Start after the first envelope start.
+  while (opening_segment_size < small_example.size() &&
+         small_example[opening_segment_size] != 0xd8)
+    opening_segment_size++;
+
+  std::vector<uint8_t> bytes = MakeNestedCBOR(11);
+  std::string out;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&out, &status);
+  ParseCBOR(SpanFrom(bytes), json_writer.get(), /*string_refs=*/nullptr,
+            /*stack_limit=*/10);
+  EXPECT_THAT(status, StatusIs(Error::CBOR_STACK_LIMIT_EXCEEDED,
+                               opening_segment_size * 11));
+}
+
+TEST(ParseCBORTest, DeepNestingWithinConfiguredLimit) {
+  // Since the parser doesn't recurse, this doesn't exhaust the call stack.
+  const int depth = 100000;
+  std::vector<uint8_t> bytes;
+  for (int ii = 0; ii < depth; ++ii)
+    bytes.push_back(EncodeIndefiniteLengthArrayStart());
+  for (int ii = 0; ii < depth; ++ii)
+    bytes.push_back(EncodeStop());
+  std::string out;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&out, &status);
+  ParseCBOR(SpanFrom(bytes), json_writer.get(), /*string_refs=*/nullptr,
+            /*stack_limit=*/depth);
+  EXPECT_THAT(status, StatusIsOk());
+  EXPECT_EQ(2u * depth, out.size());
+}
+
 TEST(ParseCBORTest, UnsupportedValueError) {
   constexpr uint8_t kPayloadLen = 6;
   std::vector<uint8_t> bytes = {0xd8, 0x5a, 0, 0, 0, kPayloadLen,  // envelope
@@ -1188,9 +1614,9 @@ TEST(ParseCBORTest, InvalidSignedError) {
                                 0xbf};                             // map start
   EncodeString8(SpanFrom("key"), &bytes);
   size_t error_pos = bytes.size();
-  // uint64_t max is a perfectly fine value to encode as CBOR unsigned,
-  // but we don't support this since we only cover the int32_t range.
-  internals::WriteTokenStart(MajorType::UNSIGNED,
+  // -2^64 is a perfectly fine value to encode as CBOR negative,
+  // but we don't support this since we only cover the int64_t range.
+  internals::WriteTokenStart(MajorType::NEGATIVE,
                              std::numeric_limits<uint64_t>::max(), &bytes);
   EXPECT_EQ(kPayloadLen, bytes.size() - 6);
   std::string out;
@@ -1198,7 +1624,7 @@ TEST(ParseCBORTest, InvalidSignedError) {
   std::unique_ptr<ParserHandler> json_writer =
       json::NewJSONEncoder(&out, &status);
   ParseCBOR(span<uint8_t>(bytes.data(), bytes.size()), json_writer.get());
-  EXPECT_THAT(status, StatusIs(Error::CBOR_INVALID_INT32, error_pos));
+  EXPECT_THAT(status, StatusIs(Error::CBOR_INVALID_INT64, error_pos));
   EXPECT_EQ("", out);
 }
 
@@ -1247,6 +1673,539 @@ TEST(ParseCBORTest, EnvelopeContentsLengthMismatch) {
   EXPECT_EQ("", out);
 }
 
+// =============================================================================
+// cbor::CBORIndex - structural index for random access into CBOR messages
+// =============================================================================
+
+std::vector<uint8_t> CBORFromJSON(const std::string& json) {
+  std::vector<uint8_t> bytes;
+  Status status;
+  std::unique_ptr<ParserHandler> encoder = NewCBOREncoder(&bytes, &status);
+  json::ParseJSON(SpanFrom(json), encoder.get());
+  EXPECT_THAT(status, StatusIsOk());
+  return bytes;
+}
+
+TEST(CBORIndexTest, NavigatesNestedMessage) {
+  std::vector<uint8_t> bytes = CBORFromJSON(
+      "{\"id\":1,\"params\":{\"big\":[1,2,{\"x\":3}],\"s\":\"hi\"},"
+      "\"method\":\"Foo.bar\"}");
+  CBORIndex index(SpanFrom(bytes));
+  ASSERT_THAT(index.Status(), StatusIsOk());
+
+  CBORIndex::Cursor root = index.Root();
+  EXPECT_EQ(CBORTokenTag::ENVELOPE, root.TokenTag());
+  EXPECT_EQ(0u, root.pos());
+  EXPECT_EQ(bytes.size(), root.Bytes().size());
+  EXPECT_EQ(CBORTokenTag::DONE, root.NextSibling().TokenTag());
+
+  CBORIndex::Cursor map = root.FirstChild();
+  EXPECT_EQ(CBORTokenTag::MAP_START, map.TokenTag());
+  CBORIndex::Cursor cursor = map.FirstChild();
+  EXPECT_EQ("id", std::string(cursor.Tokenize().GetString8().begin(),
+                              cursor.Tokenize().GetString8().end()));
+  cursor = cursor.NextSibling();
+  EXPECT_EQ(1, cursor.Tokenize().GetInt32());
+  cursor = cursor.NextSibling();  // "params"
+  cursor = cursor.NextSibling();  // The params envelope.
+  EXPECT_EQ(CBORTokenTag::ENVELOPE, cursor.TokenTag());
+  // Skipping the params envelope lands on the "method" key.
+  cursor = cursor.NextSibling();
+  EXPECT_EQ(CBORTokenTag::STRING8, cursor.TokenTag());
+  cursor = cursor.NextSibling().NextSibling();
+  EXPECT_EQ(CBORTokenTag::STOP, cursor.TokenTag());
+  EXPECT_EQ(bytes.size() - 1, cursor.pos());
+
+  // The same, via FindMapValue.
+  CBORIndex::Cursor method = root.FindMapValue(SpanFrom("method"));
+  span<uint8_t> method_str = method.Tokenize().GetString8();
+  EXPECT_EQ("Foo.bar", std::string(method_str.begin(), method_str.end()));
+  EXPECT_EQ(CBORTokenTag::STOP,
+            root.FindMapValue(SpanFrom("unknown")).TokenTag());
+
+  CBORIndex::Cursor params = root.FindMapValue(SpanFrom("params"));
+  CBORIndex::Cursor big = params.FindMapValue(SpanFrom("big"));
+  ASSERT_EQ(CBORTokenTag::ENVELOPE, big.TokenTag());
+  CBORIndex::Cursor element = big.FirstChild().FirstChild();
+  EXPECT_EQ(1, element.Tokenize().GetInt32());
+  element = element.NextSibling().NextSibling();
+  EXPECT_EQ(3, element.FindMapValue(SpanFrom("x")).Tokenize().GetInt32());
+  EXPECT_EQ(CBORTokenTag::STOP, element.NextSibling().TokenTag());
+
+  // The bytes for a nested value can be passed to ParseCBOR.
+  std::string json;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&json, &status);
+  ParseCBOR(params.Bytes(), json_writer.get());
+  EXPECT_THAT(status, StatusIsOk());
+  EXPECT_EQ("{\"big\":[1,2,{\"x\":3}],\"s\":\"hi\"}", json);
+}
+
+TEST(CBORIndexTest, ErrorCases) {
+  struct TestCase {
+    std::vector<uint8_t> data;
+    Error error;
+    size_t pos;
+  };
+  std::vector<uint8_t> valid = CBORFromJSON("{\"key\":\"value\"}");
+  std::vector<uint8_t> trailing_junk = valid;
+  trailing_junk.push_back(0xf6);  // null
+  std::vector<uint8_t> missing_stop(valid.begin(), valid.end() - 1);
+  // The envelope length is too small by one.
+  std::vector<uint8_t> length_mismatch = valid;
+  --length_mismatch[5];
+  std::vector<uint8_t> invalid_key = {0xd8, 0x5a, 0, 0, 0, 3, 0xbf, 0x01, 0xff};
+  std::vector<uint8_t> int_in_envelope = {0xd8, 0x5a, 0, 0, 0, 1, 0x01};
+  std::vector<TestCase> tests = {
+      {{}, Error::CBOR_NO_INPUT, 0},
+      {trailing_junk, Error::CBOR_TRAILING_JUNK, valid.size()},
+      {missing_stop, Error::CBOR_INVALID_ENVELOPE, 0},
+      {length_mismatch, Error::CBOR_ENVELOPE_CONTENTS_LENGTH_MISMATCH,
+       valid.size()},
+      {invalid_key, Error::CBOR_INVALID_MAP_KEY, 7},
+      {int_in_envelope, Error::CBOR_MAP_OR_ARRAY_EXPECTED_IN_ENVELOPE, 6},
+      {{0xbf, 0x01, 0x01}, Error::CBOR_INVALID_MAP_KEY, 1},
+      {{0x9f, 0x01}, Error::CBOR_UNEXPECTED_EOF_IN_ARRAY, 2},
+      {{0xbf, 0x61, 'a', 0xff}, Error::CBOR_UNSUPPORTED_VALUE, 3},
+  };
+  for (const TestCase& test : tests) {
+    SCOPED_TRACE(testing::PrintToString(test.data));
+    CBORIndex index(SpanFrom(test.data));
+    EXPECT_THAT(index.Status(), StatusIs(test.error, test.pos));
+    EXPECT_EQ(0u, index.size());
+    EXPECT_EQ(CBORTokenTag::DONE, index.Root().TokenTag());
+  }
+}
+
+TEST(ParseCBORTest, DefiniteLengthMapsAndArrays) {
+  std::vector<uint8_t> bytes;
+  EnvelopeEncoder envelope;
+  envelope.EncodeStart(&bytes);
+  bytes.push_back(EncodeIndefiniteLengthMapStart());
+  EncodeString8(SpanFrom("a"), &bytes);
+  EncodeDefiniteLengthArrayStart(2, &bytes);
+  EncodeInt32(1, &bytes);
+  EncodeDefiniteLengthMapStart(1, &bytes);
+  EncodeString8(SpanFrom("b"), &bytes);
+  EncodeDefiniteLengthArrayStart(0, &bytes);
+  EncodeString8(SpanFrom("c"), &bytes);
+  EncodeDefiniteLengthMapStart(0, &bytes);
+  bytes.push_back(EncodeStop());
+  envelope.EncodeStop(&bytes);
+
+  std::string out;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&out, &status);
+  ParseCBOR(SpanFrom(bytes), json_writer.get());
+  EXPECT_THAT(status, StatusIsOk());
+  EXPECT_EQ("{\"a\":[1,{\"b\":[]}],\"c\":{}}", out);
+}
+
+// =============================================================================
+// cbor::CBORPath - for extracting individual values from CBOR messages
+// =============================================================================
+
+TEST(CBORPathTest, FindsNestedValues) {
+  std::vector<uint8_t> bytes = CBORFromJSON(
+      "{\"id\":7,\"method\":\"Page.navigate\",\"params\":{\"frames\":"
+      "[{\"id\":\"a\"},{\"id\":\"b\",\"ok\":true,\"ratio\":1.5}]},"
+      "\"timestamp\":9007199254740993}");
+  int32_t id = 0;
+  EXPECT_TRUE(CBORPath(SpanFrom("id")).FindInt32(SpanFrom(bytes), &id));
+  EXPECT_EQ(7, id);
+  int64_t timestamp = 0;
+  EXPECT_TRUE(CBORPath(SpanFrom("timestamp"))
+                  .FindInt64(SpanFrom(bytes), &timestamp));
+  EXPECT_EQ(9007199254740993, timestamp);
+  EXPECT_TRUE(CBORPath(SpanFrom("id")).FindInt64(SpanFrom(bytes), &timestamp));
+  EXPECT_EQ(7, timestamp);
+  span<uint8_t> str;
+  EXPECT_TRUE(CBORPath(SpanFrom("params.frames[1].id"))
+                  .FindString8(SpanFrom(bytes), &str));
+  EXPECT_EQ("b", std::string(str.begin(), str.end()));
+  bool ok = false;
+  EXPECT_TRUE(CBORPath(SpanFrom("params.frames[1].ok"))
+                  .FindBool(SpanFrom(bytes), &ok));
+  EXPECT_TRUE(ok);
+  double ratio = 0;
+  EXPECT_TRUE(CBORPath(SpanFrom("params.frames[1].ratio"))
+                  .FindDouble(SpanFrom(bytes), &ratio));
+  EXPECT_EQ(1.5, ratio);
+  EXPECT_TRUE(CBORPath(SpanFrom("id")).FindDouble(SpanFrom(bytes), &ratio));
+  EXPECT_EQ(7, ratio);
+
+  // Type mismatches and absent values.
+  EXPECT_FALSE(CBORPath(SpanFrom("method")).FindInt32(SpanFrom(bytes), &id));
+  EXPECT_FALSE(
+      CBORPath(SpanFrom("timestamp")).FindInt32(SpanFrom(bytes), &id));
+  EXPECT_FALSE(
+      CBORPath(SpanFrom("method")).FindInt64(SpanFrom(bytes), &timestamp));
+  EXPECT_FALSE(CBORPath(SpanFrom("params.frames[2]")).FindBool(
+      SpanFrom(bytes), &ok));
+  EXPECT_TRUE(CBORPath(SpanFrom("params.frames[0].ok"))
+                  .Find(SpanFrom(bytes))
+                  .empty());
+  EXPECT_TRUE(CBORPath(SpanFrom("id.x")).Find(SpanFrom(bytes)).empty());
+  EXPECT_TRUE(CBORPath(SpanFrom("[0]")).Find(SpanFrom(bytes)).empty());
+
+  // The bytes for a container can be parsed or queried further.
+  span<uint8_t> frames =
+      CBORPath(SpanFrom("params.frames")).Find(SpanFrom(bytes));
+  std::string json;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&json, &status);
+  ParseCBOR(frames, json_writer.get());
+  EXPECT_THAT(status, StatusIsOk());
+  EXPECT_EQ("[{\"id\":\"a\"},{\"id\":\"b\",\"ok\":true,\"ratio\":1.5}]",
+            json);
+  EXPECT_TRUE(CBORPath(SpanFrom("[0].id")).FindString8(frames, &str));
+  EXPECT_EQ("a", std::string(str.begin(), str.end()));
+  // The empty path selects the entire message.
+  EXPECT_EQ(bytes.size(), CBORPath(SpanFrom("")).Find(SpanFrom(bytes)).size());
+}
+
+TEST(CBORPathTest, DefiniteLengthMapsAndArrays) {
+  std::vector<uint8_t> bytes;
+  EncodeDefiniteLengthMapStart(2, &bytes);
+  EncodeString8(SpanFrom("a"), &bytes);
+  EncodeDefiniteLengthArrayStart(2, &bytes);
+  EncodeDefiniteLengthArrayStart(0, &bytes);
+  EncodeInt32(42, &bytes);
+  EncodeString8(SpanFrom("b"), &bytes);
+  EncodeInt32(43, &bytes);
+  int32_t value = 0;
+  EXPECT_TRUE(CBORPath(SpanFrom("a[1]")).FindInt32(SpanFrom(bytes), &value));
+  EXPECT_EQ(42, value);
+  EXPECT_TRUE(CBORPath(SpanFrom("b")).FindInt32(SpanFrom(bytes), &value));
+  EXPECT_EQ(43, value);
+  EXPECT_EQ(1u, CBORPath(SpanFrom("a[0]")).Find(SpanFrom(bytes)).size());
+  EXPECT_FALSE(CBORPath(SpanFrom("a[2]")).FindInt32(SpanFrom(bytes), &value));
+}
+
+TEST(CBORPathTest, MalformedPathsAndMessages) {
+  for (const char* path : {"a.", ".a", "a..b", "a[", "a[]", "a[1", "a[x]",
+                           "a]", "a[1]b", "a[99999999999]"}) {
+    SCOPED_TRACE(path);
+    EXPECT_FALSE(CBORPath(SpanFrom(path)).ok());
+  }
+  EXPECT_TRUE(CBORPath(SpanFrom("[0][1].a.b[2]")).ok());
+
+  // {"a":[1,[2,3]],"b":4} without envelopes, truncated after the 2. The
+  // values before the truncation point can still be found.
+  std::vector<uint8_t> truncated = {
+      0xbf, 0x61, 'a', 0x9f, 0x01, 0x9f, 0x02,
+  };
+  int32_t value = 0;
+  EXPECT_TRUE(CBORPath(SpanFrom("a[0]")).FindInt32(SpanFrom(truncated),
+                                                    &value));
+  EXPECT_TRUE(CBORPath(SpanFrom("a[1]")).Find(SpanFrom(truncated)).empty());
+  EXPECT_FALSE(CBORPath(SpanFrom("b")).FindInt32(SpanFrom(truncated), &value));
+}
+
+// =============================================================================
+// cbor::StreamingCBORParser - for parsing messages as they arrive in chunks
+// =============================================================================
+
+// Feeds |bytes| to a StreamingCBORParser in chunks of |chunk_size|.
+std::string StreamCBORToJSON(span<uint8_t> bytes,
+                             size_t chunk_size,
+                             Status* status) {
+  std::string json;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&json, status);
+  StreamingCBORParser parser(json_writer.get());
+  for (size_t pos = 0; pos < bytes.size(); pos += chunk_size)
+    parser.Parse(bytes.subspan(pos, std::min(chunk_size, bytes.size() - pos)));
+  parser.Finish();
+  EXPECT_EQ(status->ok(), parser.Status().ok());
+  EXPECT_TRUE(!status->ok() || parser.done());
+  return json;
+}
+
+TEST(StreamingCBORParserTest, ParsesInChunks) {
+  std::vector<uint8_t> result = CBORFromJSON(
+      "{\"nodes\":[{\"name\":\"a long string which spans chunks\",\"size\":"
+      "3.5,\"big\":12345678901},[],{}],\"utf16\":\"\\u00e4\\u00f6\","
+      "\"flags\":[true,false,null]}");
+  // Also a definite length array and binary data, which JSON can't express.
+  std::vector<uint8_t> bytes;
+  EnvelopeEncoder envelope;
+  envelope.EncodeStart(&bytes);
+  bytes.push_back(EncodeIndefiniteLengthMapStart());
+  EncodeString8(SpanFrom("result"), &bytes);
+  bytes.insert(bytes.end(), result.begin(), result.end());
+  EncodeString8(SpanFrom("extra"), &bytes);
+  EnvelopeEncoder inner_envelope;
+  inner_envelope.EncodeStart(&bytes);
+  EncodeDefiniteLengthArrayStart(2, &bytes);
+  EncodeBinary(SpanFrom("bin"), &bytes);
+  EncodeInt32(-1, &bytes);
+  inner_envelope.EncodeStop(&bytes);
+  bytes.push_back(EncodeStop());
+  envelope.EncodeStop(&bytes);
+
+  std::string expected;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&expected, &status);
+  ParseCBOR(SpanFrom(bytes), json_writer.get());
+  ASSERT_THAT(status, StatusIsOk());
+
+  for (size_t chunk_size : {1, 2, 3, 5, 7, 16, 1000}) {
+    SCOPED_TRACE(chunk_size);
+    EXPECT_EQ(expected, StreamCBORToJSON(SpanFrom(bytes), chunk_size, &status));
+    EXPECT_THAT(status, StatusIsOk());
+  }
+}
+
+TEST(StreamingCBORParserTest, SplitsMultiByteTokens) {
+  // The last token of each message is a multi byte token whose size is
+  // only known after its second byte.
+  std::vector<uint8_t> array;  // {"a":[1,100]} with definite lengths.
+  EnvelopeEncoder envelope;
+  envelope.EncodeStart(&array);
+  EncodeDefiniteLengthMapStart(1, &array);
+  EncodeString8(SpanFrom("a"), &array);
+  EncodeDefiniteLengthArrayStart(2, &array);
+  EncodeInt32(1, &array);
+  EncodeInt32(100, &array);
+  envelope.EncodeStop(&array);
+  std::vector<uint8_t> scalar;
+  EncodeDouble(3.5, &scalar);
+  for (const std::vector<uint8_t>* bytes : {&array, &scalar}) {
+    std::string expected;
+    Status status;
+    std::unique_ptr<ParserHandler> json_writer =
+        json::NewJSONEncoder(&expected, &status);
+    ParseCBOR(SpanFrom(*bytes), json_writer.get());
+    ASSERT_THAT(status, StatusIsOk());
+    for (size_t chunk_size : {1, 2, 3}) {
+      SCOPED_TRACE(chunk_size);
+      EXPECT_EQ(expected,
+                StreamCBORToJSON(SpanFrom(*bytes), chunk_size, &status));
+      EXPECT_THAT(status, StatusIsOk());
+    }
+  }
+}
+
+TEST(StreamingCBORParserTest, ErrorCases) {
+  const std::vector<uint8_t> msg = CBORFromJSON("{\"a\":[1,{\"b\":2}]}");
+  Status status;
+  for (size_t chunk_size : {1, 3, 1000}) {
+    SCOPED_TRACE(chunk_size);
+    StreamCBORToJSON(span<uint8_t>(), chunk_size, &status);
+    EXPECT_THAT(status, StatusIs(Error::CBOR_NO_INPUT, 0));
+
+    // Truncated within the array.
+    std::vector<uint8_t> bytes(msg.begin(), msg.begin() + 17);
+    StreamCBORToJSON(SpanFrom(bytes), chunk_size, &status);
+    EXPECT_THAT(status, StatusIs(Error::CBOR_UNEXPECTED_EOF_IN_ARRAY, 17));
+
+    // Trailing junk.
+    bytes = msg;
+    bytes.push_back(1);
+    StreamCBORToJSON(SpanFrom(bytes), chunk_size, &status);
+    EXPECT_THAT(status,
+                StatusIs(Error::CBOR_TRAILING_JUNK, msg.size()));
+
+    // The outer envelope claims one byte less than its contents.
+    bytes = msg;
+    --bytes[5];
+    StreamCBORToJSON(SpanFrom(bytes), chunk_size, &status);
+    EXPECT_THAT(status, StatusIs(Error::CBOR_ENVELOPE_CONTENTS_LENGTH_MISMATCH,
+                                 msg.size() - 1));
+
+    // The envelope must wrap a map or array.
+    bytes = {0xd8, 0x5a, 0, 0, 0, 1, 0x01};
+    StreamCBORToJSON(SpanFrom(bytes), chunk_size, &status);
+    EXPECT_THAT(status,
+                StatusIs(Error::CBOR_MAP_OR_ARRAY_EXPECTED_IN_ENVELOPE, 6));
+  }
+}
+
+TEST(StreamingCBORParserTest, StackLimitMatchesParseCBOR) {
+  // 301 nested arrays, each wrapped in an envelope; the innermost one is
+  // empty, so no value is deeper than the limit.
+  std::vector<uint8_t> arrays;
+  std::vector<EnvelopeEncoder> envelopes(301);
+  for (EnvelopeEncoder& envelope : envelopes) {
+    envelope.EncodeStart(&arrays);
+    arrays.push_back(EncodeIndefiniteLengthArrayStart());
+  }
+  for (auto it = envelopes.rbegin(); it != envelopes.rend(); ++it) {
+    arrays.push_back(EncodeStop());
+    it->EncodeStop(&arrays);
+  }
+  for (const std::vector<uint8_t>& bytes :
+       {arrays, MakeNestedCBOR(300), MakeNestedCBOR(301)}) {
+    std::string expected;
+    Status expected_status;
+    std::unique_ptr<ParserHandler> json_writer =
+        json::NewJSONEncoder(&expected, &expected_status);
+    ParseCBOR(SpanFrom(bytes), json_writer.get());
+    for (size_t chunk_size : {1, 1000}) {
+      SCOPED_TRACE(chunk_size);
+      Status status;
+      EXPECT_EQ(expected, StreamCBORToJSON(SpanFrom(bytes), chunk_size,
+                                           &status));
+      EXPECT_EQ(expected_status.error, status.error);
+      EXPECT_EQ(expected_status.pos, status.pos);
+    }
+  }
+}
+
+// =============================================================================
+// cbor::StringRefTable - session scoped string references
+// =============================================================================
+
+TEST(StringRefTableTest, RoundtripsSessionWithReferences) {
+  const std::vector<std::string> messages = {
+      "{\"method\":\"Page.frameNavigated\",\"params\":{\"frameId\":\"F1\","
+      "\"url\":\"https://example.com/\"}}",
+      "{\"method\":\"Page.frameNavigated\",\"params\":{\"frameId\":\"F1\","
+      "\"url\":\"https://example.com/\"}}",
+      "{\"method\":\"Page.loadEventFired\",\"params\":{\"url\":"
+      "\"https://example.com/\",\"frameId\":\"F2\"}}"};
+  StringRefTable sender;
+  StringRefTable receiver;
+  for (size_t ii = 0; ii < messages.size(); ++ii) {
+    SCOPED_TRACE(messages[ii]);
+    std::vector<uint8_t> encoded;
+    Status status = EncodeWithStringRefs(
+        SpanFrom(CBORFromJSON(messages[ii])), &sender, &encoded);
+    ASSERT_THAT(status, StatusIsOk());
+    if (ii == 1) {
+      // All strings that are long enough were sent with the first message.
+      EXPECT_LT(encoded.size(), CBORFromJSON(messages[ii]).size() / 2);
+    }
+    std::string json;
+    std::unique_ptr<ParserHandler> json_writer =
+        json::NewJSONEncoder(&json, &status);
+    ParseCBOR(SpanFrom(encoded), json_writer.get(), &receiver);
+    ASSERT_THAT(status, StatusIsOk());
+    EXPECT_EQ(messages[ii], json);
+  }
+  // "method", "params", "frameId", the two method names and the URL;
+  // "url", "F1" and "F2" are too short to be referenced.
+  EXPECT_EQ(6u, sender.size());
+  EXPECT_EQ(6u, receiver.size());
+}
+
+TEST(StringRefTableTest, RespectsMaxEntries) {
+  StringRefTable sender(/*max_entries=*/1);
+  uint32_t index;
+  EXPECT_FALSE(sender.FindOrAdd(SpanFrom("first"), &index));
+  EXPECT_FALSE(sender.FindOrAdd(SpanFrom("second"), &index));
+  EXPECT_FALSE(sender.FindOrAdd(SpanFrom("second"), &index));
+  EXPECT_TRUE(sender.FindOrAdd(SpanFrom("first"), &index));
+  EXPECT_EQ(0u, index);
+
+  StringRefTable receiver(/*max_entries=*/1);
+  receiver.Add(SpanFrom("first"));
+  receiver.Add(SpanFrom("second"));
+  EXPECT_EQ(1u, receiver.size());
+  span<uint8_t> first = receiver.Get(0);
+  EXPECT_EQ("first", std::string(first.begin(), first.end()));
+}
+
+TEST(StringRefTableTest, InvalidStringRefError) {
+  // A map with a reference (tag 25) to index 0 as its key.
+  std::vector<uint8_t> bytes;
+  EnvelopeEncoder envelope;
+  envelope.EncodeStart(&bytes);
+  bytes.push_back(EncodeIndefiniteLengthMapStart());
+  size_t error_pos = bytes.size();
+  bytes.push_back(6 << 5 | 24);
+  bytes.push_back(25);
+  bytes.push_back(0);
+  EncodeInt32(1, &bytes);
+  bytes.push_back(EncodeStop());
+  envelope.EncodeStop(&bytes);
+
+  // Without a table, tag 25 is just a malformed envelope.
+  {
+    std::string out;
+    Status status;
+    std::unique_ptr<ParserHandler> json_writer =
+        json::NewJSONEncoder(&out, &status);
+    ParseCBOR(SpanFrom(bytes), json_writer.get());
+    EXPECT_THAT(status, StatusIs(Error::CBOR_INVALID_ENVELOPE, error_pos));
+    EXPECT_EQ("", out);
+  }
+
+  // With an empty table, the reference is invalid.
+  StringRefTable receiver;
+  {
+    std::string out;
+    Status status;
+    std::unique_ptr<ParserHandler> json_writer =
+        json::NewJSONEncoder(&out, &status);
+    ParseCBOR(SpanFrom(bytes), json_writer.get(), &receiver);
+    EXPECT_THAT(status, StatusIs(Error::CBOR_INVALID_STRING_REF, error_pos));
+    EXPECT_EQ("", out);
+  }
+
+  receiver.Add(SpanFrom("key1"));
+  std::string out;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&out, &status);
+  ParseCBOR(SpanFrom(bytes), json_writer.get(), &receiver);
+  EXPECT_THAT(status, StatusIsOk());
+  EXPECT_EQ("{\"key1\":1}", out);
+}
+
+TEST(StringRefTableTest, RollsBackFailedMessages) {
+  StringRefTable sender;
+  StringRefTable receiver;
+  std::vector<uint8_t> first = CBORFromJSON("{\"method\":\"Page.reload\"}");
+  std::vector<uint8_t> encoded;
+  ASSERT_THAT(EncodeWithStringRefs(SpanFrom(first), &sender, &encoded),
+              StatusIsOk());
+  std::string json;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&json, &status);
+  ParseCBOR(SpanFrom(encoded), json_writer.get(), &receiver);
+  ASSERT_THAT(status, StatusIsOk());
+  EXPECT_EQ(2u, sender.size());
+  EXPECT_EQ(2u, receiver.size());
+
+  // The sender fails at the end of a message, after its strings; 0x1c
+  // (reserved additional information) replaces the final stop byte.
+  std::vector<uint8_t> corrupted = CBORFromJSON(
+      "{\"params\":{\"frameId\":\"F1\"},\"method\":\"Page.stop\"}");
+  corrupted.back() = 0x1c;
+  status = EncodeWithStringRefs(SpanFrom(corrupted), &sender, &encoded);
+  EXPECT_FALSE(status.ok());
+  EXPECT_TRUE(encoded.empty());
+  EXPECT_EQ(2u, sender.size());
+
+  // The receiver fails at the end of a corrupted message.
+  const std::string second_json =
+      "{\"params\":{\"frameId\":\"F1\"},\"method\":\"Page.reload\"}";
+  std::vector<uint8_t> second = CBORFromJSON(second_json);
+  ASSERT_THAT(EncodeWithStringRefs(SpanFrom(second), &sender, &encoded),
+              StatusIsOk());
+  EXPECT_EQ(4u, sender.size());
+  corrupted = encoded;
+  corrupted.back() = 0x1c;
+  json_writer = json::NewJSONEncoder(&json, &status);
+  ParseCBOR(SpanFrom(corrupted), json_writer.get(), &receiver);
+  EXPECT_FALSE(status.ok());
+  EXPECT_EQ(2u, receiver.size());
+
+  // Once the message arrives intact, both tables are in sync again.
+  json_writer = json::NewJSONEncoder(&json, &status);
+  ParseCBOR(SpanFrom(encoded), json_writer.get(), &receiver);
+  ASSERT_THAT(status, StatusIsOk());
+  EXPECT_EQ(second_json, json);
+  EXPECT_EQ(4u, receiver.size());
+}
+
 // =============================================================================
 // cbor::AppendString8EntryToMap - for limited in-place editing of messages
 // =============================================================================
@@ -1350,5 +2309,132 @@ TEST(AppendString8EntryToMapTest, InvalidEnvelope_Error) {
     EXPECT_THAT(status, StatusIs(Error::CBOR_INVALID_ENVELOPE, 0u));
   }
 }
+
+// =============================================================================
+// cbor::SetEntryInCBORMap - for in-place editing of messages
+// =============================================================================
+
+std::string JSONFromCBOR(const std::vector<uint8_t>& bytes) {
+  std::string json;
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      json::NewJSONEncoder(&json, &status);
+  ParseCBOR(SpanFrom(bytes), json_writer.get());
+  EXPECT_THAT(status, StatusIsOk());
+  return json;
+}
+
+span<span<uint8_t>> PathFrom(const std::vector<span<uint8_t>>& keys) {
+  return span<span<uint8_t>>(keys.data(), keys.size());
+}
+
+TEST(SetEntryInCBORMapTest, RewritesIdAndSessionId) {
+  std::vector<uint8_t> msg = CBORFromJSON(
+      "{\"id\":1,\"method\":\"Page.enable\",\"params\":{}}");
+  std::vector<span<uint8_t>> id = {SpanFrom("id")};
+  std::vector<span<uint8_t>> session_id = {SpanFrom("sessionId")};
+
+  std::vector<uint8_t> value;
+  EncodeInt32(100000, &value);
+  EXPECT_THAT(SetEntryInCBORMap(PathFrom(id), SpanFrom(value), &msg),
+              StatusIsOk());
+  EXPECT_EQ("{\"id\":100000,\"method\":\"Page.enable\",\"params\":{}}",
+            JSONFromCBOR(msg));
+
+  value.clear();
+  EncodeString8(SpanFrom("AB12"), &value);
+  EXPECT_THAT(SetEntryInCBORMap(PathFrom(session_id), SpanFrom(value), &msg),
+              StatusIsOk());
+  EXPECT_EQ(
+      "{\"id\":100000,\"method\":\"Page.enable\",\"params\":{},"
+      "\"sessionId\":\"AB12\"}",
+      JSONFromCBOR(msg));
+
+  value.clear();
+  EncodeString8(SpanFrom("C3"), &value);
+  EXPECT_THAT(SetEntryInCBORMap(PathFrom(session_id), SpanFrom(value), &msg),
+              StatusIsOk());
+  EXPECT_EQ(
+      "{\"id\":100000,\"method\":\"Page.enable\",\"params\":{},"
+      "\"sessionId\":\"C3\"}",
+      JSONFromCBOR(msg));
+
+  EXPECT_THAT(RemoveEntryFromCBORMap(PathFrom(session_id), &msg),
+              StatusIsOk());
+  EXPECT_EQ("{\"id\":100000,\"method\":\"Page.enable\",\"params\":{}}",
+            JSONFromCBOR(msg));
+  // Removing an entry that's not present is fine.
+  EXPECT_THAT(RemoveEntryFromCBORMap(PathFrom(session_id), &msg),
+              StatusIsOk());
+  EXPECT_EQ(CBORFromJSON(
+                "{\"id\":100000,\"method\":\"Page.enable\",\"params\":{}}"),
+            msg);
+}
+
+TEST(SetEntryInCBORMapTest, RewritesNestedStrings) {
+  std::vector<uint8_t> msg = CBORFromJSON(
+      "{\"method\":\"Page.frameNavigated\",\"params\":{\"frame\":{\"id\":"
+      "\"F1\",\"url\":\"a\"},\"type\":\"Navigation\"}}");
+  std::vector<span<uint8_t>> url = {SpanFrom("params"), SpanFrom("frame"),
+                                    SpanFrom("url")};
+  std::vector<uint8_t> value;
+  EncodeString8(SpanFrom("https://example.com/"), &value);
+  EXPECT_THAT(SetEntryInCBORMap(PathFrom(url), SpanFrom(value), &msg),
+              StatusIsOk());
+  std::vector<span<uint8_t>> type = {SpanFrom("params"), SpanFrom("type")};
+  EXPECT_THAT(RemoveEntryFromCBORMap(PathFrom(type), &msg), StatusIsOk());
+  EXPECT_EQ(
+      "{\"method\":\"Page.frameNavigated\",\"params\":{\"frame\":{\"id\":"
+      "\"F1\",\"url\":\"https://example.com/\"}}}",
+      JSONFromCBOR(msg));
+}
+
+TEST(SetEntryInCBORMapTest, ErrorCases) {
+  const std::vector<uint8_t> original =
+      CBORFromJSON("{\"id\":1,\"params\":[1]}");
+  std::vector<uint8_t> msg = original;
+  std::vector<uint8_t> value;
+  EncodeInt32(2, &value);
+  {  // Can't descend into an array.
+    std::vector<span<uint8_t>> path = {SpanFrom("params"), SpanFrom("x")};
+    EXPECT_EQ(Error::CBOR_MAP_START_EXPECTED,
+              SetEntryInCBORMap(PathFrom(path), SpanFrom(value), &msg).error);
+  }
+  {  // Can't descend into a missing map.
+    std::vector<span<uint8_t>> path = {SpanFrom("missing"), SpanFrom("x")};
+    EXPECT_EQ(Error::CBOR_MAP_START_EXPECTED,
+              SetEntryInCBORMap(PathFrom(path), SpanFrom(value), &msg).error);
+  }
+  {  // The value must be exactly one CBOR value.
+    std::vector<span<uint8_t>> path = {SpanFrom("id")};
+    std::vector<uint8_t> two_values = value;
+    EncodeInt32(3, &two_values);
+    EXPECT_EQ(
+        Error::CBOR_TRAILING_JUNK,
+        SetEntryInCBORMap(PathFrom(path), SpanFrom(two_values), &msg).error);
+    EXPECT_EQ(Error::CBOR_UNEXPECTED_EOF_EXPECTED_VALUE,
+              SetEntryInCBORMap(PathFrom(path), span<uint8_t>(), &msg).error);
+  }
+  EXPECT_EQ(original, msg);
+
+  // Entries can't be inserted into definite length maps.
+  std::vector<uint8_t> definite;
+  EnvelopeEncoder envelope;
+  envelope.EncodeStart(&definite);
+  EncodeDefiniteLengthMapStart(1, &definite);
+  EncodeString8(SpanFrom("id"), &definite);
+  EncodeInt32(1, &definite);
+  envelope.EncodeStop(&definite);
+  std::vector<span<uint8_t>> session_id = {SpanFrom("sessionId")};
+  EXPECT_EQ(
+      Error::CBOR_INVALID_DEFINITE_LENGTH,
+      SetEntryInCBORMap(PathFrom(session_id), SpanFrom(value), &definite)
+          .error);
+  // But values can be replaced.
+  std::vector<span<uint8_t>> id = {SpanFrom("id")};
+  EXPECT_THAT(SetEntryInCBORMap(PathFrom(id), SpanFrom(value), &definite),
+              StatusIsOk());
+  EXPECT_EQ("{\"id\":2}", JSONFromCBOR(definite));
+}
 }  // namespace cbor
 }  // namespace crdtp
@@ -4,6 +4,7 @@
 
 #include "dispatch.h"
 
+#include <algorithm>
 #include <cassert>
 #include "cbor.h"
 #include "error_support.h"
@@ -262,12 +263,39 @@ bool Dispatchable::MaybeParseSessionId(cbor::CBORTokenizer* tokenizer) {
 }
 
 namespace {
+// The messages below encode either into a std::vector<uint8_t> or into a
+// ByteSink; these overloads forward to the matching Serializable method.
+void AppendSerializedParams(const Serializable& params,
+                            std::vector<uint8_t>* out) {
+  params.AppendSerialized(out);
+}
+
+void AppendSerializedParams(const Serializable& params, ByteSink* out) {
+  params.AppendSerializedToSink(out);
+}
+
 class ProtocolError : public Serializable {
  public:
   explicit ProtocolError(DispatchResponse dispatch_response)
       : dispatch_response_(std::move(dispatch_response)) {}
 
   void AppendSerialized(std::vector<uint8_t>* out) const override {
+    AppendSerializedTmpl(out);
+  }
+
+  void AppendSerializedToSink(ByteSink* out) const override {
+    AppendSerializedTmpl(out);
+  }
+
+  void SetCallId(int call_id) {
+    has_call_id_ = true;
+    call_id_ = call_id;
+  }
+  void SetData(std::string data) { data_ = std::move(data); }
+
+ private:
+  template <typename C>
+  void AppendSerializedTmpl(C* out) const {
     Status status;
     std::unique_ptr<ParserHandler> encoder = cbor::NewCBOREncoder(out, &status);
     encoder->HandleMapBegin();
@@ -290,13 +318,6 @@ class ProtocolError : public Serializable {
     assert(status.ok());
   }
 
-  void SetCallId(int call_id) {
-    has_call_id_ = true;
-    call_id_ = call_id;
-  }
-  void SetData(std::string data) { data_ = std::move(data); }
-
- private:
   const DispatchResponse dispatch_response_;
   std::string data_;
   int call_id_ = 0;
@@ -346,6 +367,16 @@ class Response : public Serializable {
       : call_id_(call_id), params_(std::move(params)) {}
 
   void AppendSerialized(std::vector<uint8_t>* out) const override {
+    AppendSerializedTmpl(out);
+  }
+
+  void AppendSerializedToSink(ByteSink* out) const override {
+    AppendSerializedTmpl(out);
+  }
+
+ private:
+  template <typename C>
+  void AppendSerializedTmpl(C* out) const {
     Status status;
     std::unique_ptr<ParserHandler> encoder = cbor::NewCBOREncoder(out, &status);
     encoder->HandleMapBegin();
@@ -353,7 +384,7 @@ class Response : public Serializable {
     encoder->HandleInt32(call_id_);
     encoder->HandleString8(SpanFrom("result"));
     if (params_) {
-      params_->AppendSerialized(out);
+      AppendSerializedParams(*params_, out);
     } else {
       encoder->HandleMapBegin();
       encoder->HandleMapEnd();
@@ -362,7 +393,6 @@ class Response : public Serializable {
     assert(status.ok());
   }
 
- private:
   const int call_id_;
   std::unique_ptr<Serializable> params_;
 };
@@ -373,6 +403,16 @@ class Notification : public Serializable {
       : method_(method), params_(std::move(params)) {}
 
   void AppendSerialized(std::vector<uint8_t>* out) const override {
+    AppendSerializedTmpl(out);
+  }
+
+  void AppendSerializedToSink(ByteSink* out) const override {
+    AppendSerializedTmpl(out);
+  }
+
+ private:
+  template <typename C>
+  void AppendSerializedTmpl(C* out) const {
     Status status;
     std::unique_ptr<ParserHandler> encoder = cbor::NewCBOREncoder(out, &status);
     encoder->HandleMapBegin();
@@ -380,7 +420,7 @@ class Notification : public Serializable {
     encoder->HandleString8(SpanFrom(method_));
     encoder->HandleString8(SpanFrom("params"));
     if (params_) {
-      params_->AppendSerialized(out);
+      AppendSerializedParams(*params_, out);
     } else {
       encoder->HandleMapBegin();
       encoder->HandleMapEnd();
@@ -389,7 +429,6 @@ class Notification : public Serializable {
     assert(status.ok());
   }
 
- private:
   const char* method_;
   std::unique_ptr<Serializable> params_;
 };
@@ -548,6 +587,13 @@ size_t DotIdx(span<uint8_t> method) {
 
 UberDispatcher::DispatchResult UberDispatcher::Dispatch(
     const Dispatchable& dispatchable) const {
+  const MethodEntry* entry = FindMethod(dispatchable.Method());
+  if (entry) {
+    return DispatchResult(
+        true, [dispatchable, dispatched = entry->dispatched]() {
+          dispatched(dispatchable);
+        });
+  }
   span<uint8_t> method = FindByFirst(redirects_, dispatchable.Method(),
                                      /*default_value=*/dispatchable.Method());
   size_t dot_idx = DotIdx(method);
@@ -599,6 +645,84 @@ void UberDispatcher::WireBackend(
                                 std::make_pair(domain, std::move(dispatcher)));
   std::inplace_merge(dispatchers_.begin(), jt, dispatchers_.end(),
                      FirstLessThan<std::unique_ptr<DomainDispatcher>>());
+  ResolveRedirects();
+}
+
+void UberDispatcher::WireBackend(
+    span<uint8_t> domain,
+    const std::vector<std::pair<span<uint8_t>, span<uint8_t>>>&
+        sorted_redirects,
+    const std::vector<span<uint8_t>>& commands,
+    std::unique_ptr<DomainDispatcher> dispatcher) {
+  for (span<uint8_t> method : commands) {
+    assert(DotIdx(method) == domain.size());
+    std::function<void(const Dispatchable&)> dispatched =
+        dispatcher->Dispatch(method.subspan(domain.size() + 1));
+    if (dispatched)
+      InsertMethod(method, std::move(dispatched));
+  }
+  WireBackend(domain, sorted_redirects, std::move(dispatcher));
+}
+
+namespace {
+// FNV-1a, which is fast for short keys such as method names.
+size_t HashMethod(span<uint8_t> method) {
+  uint32_t hash = 2166136261u;
+  for (uint8_t c : method)
+    hash = (hash ^ c) * 16777619u;
+  return hash;
+}
+}  // namespace
+
+const UberDispatcher::MethodEntry* UberDispatcher::FindMethod(
+    span<uint8_t> method) const {
+  if (methods_.empty())
+    return nullptr;
+  const size_t mask = methods_.size() - 1;
+  for (size_t ii = HashMethod(method) & mask;; ii = (ii + 1) & mask) {
+    const MethodEntry& entry = methods_[ii];
+    if (entry.method.empty())
+      return nullptr;
+    if (SpanEquals(entry.method, method))
+      return &entry;
+  }
+}
+
+void UberDispatcher::InsertMethod(
+    span<uint8_t> method,
+    std::function<void(const Dispatchable&)> dispatched) {
+  assert(!method.empty());
+  // Keep the table at most half full, so that probe sequences stay short
+  // and there's always an unused entry to terminate them.
+  if (2 * (num_methods_ + 1) > methods_.size()) {
+    std::vector<MethodEntry> methods(std::max<size_t>(16, 2 * methods_.size()));
+    methods.swap(methods_);
+    num_methods_ = 0;
+    for (MethodEntry& entry : methods) {
+      if (!entry.method.empty())
+        InsertMethod(entry.method, std::move(entry.dispatched));
+    }
+  }
+  const size_t mask = methods_.size() - 1;
+  size_t ii = HashMethod(method) & mask;
+  while (!methods_[ii].method.empty() &&
+         !SpanEquals(methods_[ii].method, method)) {
+    ii = (ii + 1) & mask;
+  }
+  if (methods_[ii].method.empty())
+    ++num_methods_;
+  methods_[ii].method = method;
+  methods_[ii].dispatched = std::move(dispatched);
+}
+
+void UberDispatcher::ResolveRedirects() {
+  // Redirects take precedence over commands, as in ::Dispatch. Their
+  // targets may be wired after them, so this runs after each domain.
+  for (const auto& redirect : redirects_) {
+    const MethodEntry* target = FindMethod(redirect.second);
+    if (target)
+      InsertMethod(redirect.first, target->dispatched);
+  }
 }
 
 }  // namespace crdtp
@@ -298,8 +298,29 @@ class CRDTP_EXPORT UberDispatcher {
                    const std::vector<std::pair<span<uint8_t>, span<uint8_t>>>&,
                    std::unique_ptr<DomainDispatcher> dispatcher);
 
+  // Like above, but |commands| lists the fully qualified names (e.g.
+  // "Domain.command") of all commands that |dispatcher| handles, which
+  // must point at static storage. For each of these, and for the redirects
+  // to them, the closure from DomainDispatcher::Dispatch is looked up once,
+  // here, and entered into a hash table, so that ::Dispatch finds it with a
+  // single probe rather than several binary searches.
+  void WireBackend(span<uint8_t> domain,
+                   const std::vector<std::pair<span<uint8_t>, span<uint8_t>>>&,
+                   const std::vector<span<uint8_t>>& commands,
+                   std::unique_ptr<DomainDispatcher> dispatcher);
+
  private:
-  DomainDispatcher* findDispatcher(span<uint8_t> method);
+  // An entry in |methods_|; |method| is empty for unused entries.
+  struct MethodEntry {
+    span<uint8_t> method;
+    std::function<void(const Dispatchable&)> dispatched;
+  };
+
+  const MethodEntry* FindMethod(span<uint8_t> method) const;
+  void InsertMethod(span<uint8_t> method,
+                    std::function<void(const Dispatchable&)> dispatched);
+  void ResolveRedirects();
+
   FrontendChannel* const frontend_channel_;
   // Pairs of ascii strings of the form ("Domain1.method1","Domain2.method2")
   // indicating that the first element of each pair redirects to the second.
@@ -308,6 +329,13 @@ class CRDTP_EXPORT UberDispatcher {
   // Domain dispatcher instances, sorted by their domain name.
   std::vector<std::pair<span<uint8_t>, std::unique_ptr<DomainDispatcher>>>
       dispatchers_;
+  // Open addressing hash table of the commands wired with their names, and
+  // of the redirects to them, keyed by fully qualified method name. Its
+  // size is zero or a power of two, and it's at most half full. Methods
+  // which aren't found here are looked up via |redirects_| and
+  // |dispatchers_|.
+  std::vector<MethodEntry> methods_;
+  size_t num_methods_ = 0;
 };
 }  // namespace crdtp
 
@@ -442,4 +442,79 @@ TEST(UberDispatcherTest, DispatchingToDomainWithRedirects) {
   EXPECT_THAT(bar->DispatchedCommands(), testing::ElementsAre("redirected"));
   EXPECT_THAT(bar->ExecutedCommands(), testing::ElementsAre(43));
 }
+
+TEST(UberDispatcherTest, DispatchingToDomainWithCommandTable) {
+  // Like above, but the commands are provided when wiring the domain
+  // dispatchers, so they're looked up once while wiring, rather than for
+  // each message. The redirect is resolved once its target is wired.
+  TestChannel channel;
+  UberDispatcher dispatcher(&channel);
+  auto foo_dispatcher = std::make_unique<TestDomain>(&channel);
+  TestDomain* foo = foo_dispatcher.get();
+  auto bar_dispatcher = std::make_unique<TestDomain>(&channel);
+  TestDomain* bar = bar_dispatcher.get();
+
+  dispatcher.WireBackend(
+      SpanFrom("Foo"), {{SpanFrom("Foo.redirect"), SpanFrom("Bar.redirected")}},
+      {SpanFrom("Foo.execute"), SpanFrom("Foo.other")},
+      std::move(foo_dispatcher));
+  dispatcher.WireBackend(SpanFrom("Bar"), {}, {SpanFrom("Bar.redirected")},
+                         std::move(bar_dispatcher));
+  EXPECT_THAT(foo->DispatchedCommands(),
+              testing::ElementsAre("execute", "other"));
+  EXPECT_THAT(bar->DispatchedCommands(), testing::ElementsAre("redirected"));
+
+  int call_id = 42;
+  for (const char* method :
+       {"Foo.execute", "Foo.redirect", "Foo.execute", "Foo.other"}) {
+    std::vector<uint8_t> message;
+    json::ConvertJSONToCBOR(SpanFrom("{\"id\":" + std::to_string(call_id++) +
+                                     ",\"method\":\"" + method + "\"}"),
+                            &message);
+    Dispatchable dispatchable(SpanFrom(message));
+    ASSERT_TRUE(dispatchable.ok());
+    UberDispatcher::DispatchResult dispatched =
+        dispatcher.Dispatch(dispatchable);
+    EXPECT_TRUE(dispatched.MethodFound());
+    dispatched.Run();
+  }
+  // No further lookups happened while dispatching.
+  EXPECT_THAT(foo->DispatchedCommands(),
+              testing::ElementsAre("execute", "other"));
+  EXPECT_THAT(bar->DispatchedCommands(), testing::ElementsAre("redirected"));
+  EXPECT_THAT(foo->ExecutedCommands(), testing::ElementsAre(42, 44, 45));
+  EXPECT_THAT(bar->ExecutedCommands(), testing::ElementsAre(43));
+}
+
+TEST(UberDispatcherTest, CommandTableGrows) {
+  TestChannel channel;
+  UberDispatcher dispatcher(&channel);
+  auto foo_dispatcher = std::make_unique<TestDomain>(&channel);
+  TestDomain* foo = foo_dispatcher.get();
+  // The spans must point at storage that outlives the dispatcher.
+  std::vector<std::string> names;
+  for (int ii = 0; ii < 100; ++ii)
+    names.push_back("Foo.command" + std::to_string(ii));
+  std::vector<span<uint8_t>> commands;
+  for (const std::string& name : names)
+    commands.push_back(SpanFrom(name));
+  dispatcher.WireBackend(SpanFrom("Foo"), {}, commands,
+                         std::move(foo_dispatcher));
+  for (int ii = 0; ii < 100; ++ii) {
+    std::vector<uint8_t> message;
+    json::ConvertJSONToCBOR(SpanFrom("{\"id\":" + std::to_string(ii) +
+                                     ",\"method\":\"" + names[ii] + "\"}"),
+                            &message);
+    Dispatchable dispatchable(SpanFrom(message));
+    ASSERT_TRUE(dispatchable.ok());
+    UberDispatcher::DispatchResult dispatched =
+        dispatcher.Dispatch(dispatchable);
+    EXPECT_TRUE(dispatched.MethodFound());
+    dispatched.Run();
+  }
+  EXPECT_EQ(100u, foo->DispatchedCommands().size());
+  ASSERT_EQ(100u, foo->ExecutedCommands().size());
+  for (int ii = 0; ii < 100; ++ii)
+    EXPECT_EQ(ii, foo->ExecutedCommands()[ii]);
+}
 }  // namespace crdtp
@@ -14,6 +14,12 @@
 #include "cbor.h"
 #include "json_platform.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CRDTP_JSON_USE_SSE2
+#endif
+
 namespace crdtp {
 namespace json {
 // =============================================================================
@@ -30,6 +36,61 @@ void PrintHex(uint16_t value, C* out) {
   }
 }
 
+// The output of the encoder created by NewJSONEncoder with a flush callback.
+// Holds at most |capacity| bytes, and passes them to |flush| when full.
+// Provides just the operations which JSONEncoder needs from its container.
+class FlushingBuffer {
+ public:
+  // Stands in for the end iterator, since we only ever insert at the end.
+  struct End {};
+
+  FlushingBuffer(size_t capacity, JSONFlushCallback flush)
+      : capacity_(std::max<size_t>(capacity, 1)), flush_(std::move(flush)) {
+    buffer_.reserve(capacity_);
+  }
+
+  void push_back(char c) {
+    if (buffer_.size() == capacity_)
+      Flush();
+    buffer_.push_back(c);
+  }
+
+  End end() const { return End(); }
+
+  template <typename It>
+  void insert(End, It first, It last) {
+    while (first != last) {
+      if (buffer_.size() == capacity_)
+        Flush();
+      const size_t chunk = std::min<size_t>(last - first,
+                                            capacity_ - buffer_.size());
+      buffer_.insert(buffer_.end(), first, first + chunk);
+      first += chunk;
+    }
+  }
+
+  void clear() { buffer_.clear(); }
+
+  void Flush() {
+    if (buffer_.empty())
+      return;
+    flush_(span<uint8_t>(buffer_.data(), buffer_.size()));
+    buffer_.clear();
+  }
+
+ private:
+  const size_t capacity_;
+  JSONFlushCallback flush_;
+  std::vector<uint8_t> buffer_;
+};
+
+// Passes the output of JSONEncoder on, if it's a FlushingBuffer.
+void FlushOutput(std::vector<uint8_t>*) {}
+void FlushOutput(std::string*) {}
+void FlushOutput(FlushingBuffer* out) {
+  out->Flush();
+}
+
 // In the writer below, we maintain a stack of State instances.
 // It is just enough to emit the appropriate delimiters and brackets
 // in JSON.
@@ -47,6 +108,7 @@ class State {
   explicit State(Container container) : container_(container) {}
   void StartElement(std::vector<uint8_t>* out) { StartElementTmpl(out); }
   void StartElement(std::string* out) { StartElementTmpl(out); }
+  void StartElement(FlushingBuffer* out) { StartElementTmpl(out); }
   Container container() const { return container_; }
 
  private:
@@ -68,47 +130,219 @@ constexpr char kBase64Table[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
     "abcdefghijklmnopqrstuvwxyz0123456789+/";
 
-template <typename C>
-void Base64Encode(const span<uint8_t>& in, C* out) {
+#if defined(CRDTP_JSON_USE_SSE2)
+// Encodes blocks of 12 bytes from |in| into 16 characters each, as long as
+// at least |12| bytes remain. Returns the number of bytes consumed.
+size_t Base64EncodeBlocks(const uint8_t* in, size_t size, uint8_t* out) {
+  size_t ii = 0;
+  for (; ii + 12 <= size; ii += 12, out += 16) {
+    // Each 32 bit lane holds 24 bits of input.
+    const __m128i twentyfour_bits = _mm_set_epi32(
+        (in[ii + 9] << 16) | (in[ii + 10] << 8) | in[ii + 11],
+        (in[ii + 6] << 16) | (in[ii + 7] << 8) | in[ii + 8],
+        (in[ii + 3] << 16) | (in[ii + 4] << 8) | in[ii + 5],
+        (in[ii] << 16) | (in[ii + 1] << 8) | in[ii + 2]);
+    // Spread the four 6 bit values of each lane across its bytes, with the
+    // most significant one in the lowest byte, so that it's written first.
+    const __m128i six_bits = _mm_set1_epi32(0x3f);
+    const __m128i values = _mm_or_si128(
+        _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(twentyfour_bits, 18), six_bits),
+            _mm_slli_epi32(
+                _mm_and_si128(_mm_srli_epi32(twentyfour_bits, 12), six_bits),
+                8)),
+        _mm_or_si128(
+            _mm_slli_epi32(
+                _mm_and_si128(_mm_srli_epi32(twentyfour_bits, 6), six_bits),
+                16),
+            _mm_slli_epi32(_mm_and_si128(twentyfour_bits, six_bits), 24)));
+    // Instead of looking up kBase64Table, we add the offset from each
+    // value to its character, which depends on the range of the value:
+    // 'A' for [0, 25], 'a' - 26 for [26, 51], '0' - 52 for [52, 61],
+    // '+' - 62 for 62 and '/' - 63 for 63.
+    __m128i offsets = _mm_set1_epi8('A');
+    offsets = _mm_add_epi8(
+        offsets, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(25)),
+                               _mm_set1_epi8('a' - 26 - 'A')));
+    offsets = _mm_add_epi8(
+        offsets, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(51)),
+                               _mm_set1_epi8(('0' - 52) - ('a' - 26))));
+    offsets = _mm_add_epi8(
+        offsets, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(61)),
+                               _mm_set1_epi8(('+' - 62) - ('0' - 52))));
+    offsets = _mm_add_epi8(
+        offsets, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(62)),
+                               _mm_set1_epi8(('/' - 63) - ('+' - 62))));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm_add_epi8(values, offsets));
+  }
+  return ii;
+}
+#else
+size_t Base64EncodeBlocks(const uint8_t*, size_t, uint8_t*) {
+  return 0;
+}
+#endif
+
+// Writes the base64 encoding of |in|, (in.size() + 2) / 3 * 4 characters
+// including padding, to |chars|.
+void Base64EncodeTo(const span<uint8_t>& in, uint8_t* chars) {
+  size_t ii = Base64EncodeBlocks(in.data(), in.size(), chars);
+  chars += ii / 3 * 4;
+
   // The following three cases are based on the tables in the example
   // section in https://en.wikipedia.org/wiki/Base64. We process three
   // input bytes at a time, emitting 4 output bytes at a time.
-  size_t ii = 0;
 
   // While possible, process three input bytes.
-  for (; ii + 3 <= in.size(); ii += 3) {
+  for (; ii + 3 <= in.size(); ii += 3, chars += 4) {
     uint32_t twentyfour_bits = (in[ii] << 16) | (in[ii + 1] << 8) | in[ii + 2];
-    out->push_back(kBase64Table[(twentyfour_bits >> 18)]);
-    out->push_back(kBase64Table[(twentyfour_bits >> 12) & 0x3f]);
-    out->push_back(kBase64Table[(twentyfour_bits >> 6) & 0x3f]);
-    out->push_back(kBase64Table[twentyfour_bits & 0x3f]);
+    chars[0] = kBase64Table[(twentyfour_bits >> 18)];
+    chars[1] = kBase64Table[(twentyfour_bits >> 12) & 0x3f];
+    chars[2] = kBase64Table[(twentyfour_bits >> 6) & 0x3f];
+    chars[3] = kBase64Table[twentyfour_bits & 0x3f];
   }
   if (ii + 2 <= in.size()) {  // Process two input bytes.
     uint32_t twentyfour_bits = (in[ii] << 16) | (in[ii + 1] << 8);
-    out->push_back(kBase64Table[(twentyfour_bits >> 18)]);
-    out->push_back(kBase64Table[(twentyfour_bits >> 12) & 0x3f]);
-    out->push_back(kBase64Table[(twentyfour_bits >> 6) & 0x3f]);
-    out->push_back('=');  // Emit padding.
+    chars[0] = kBase64Table[(twentyfour_bits >> 18)];
+    chars[1] = kBase64Table[(twentyfour_bits >> 12) & 0x3f];
+    chars[2] = kBase64Table[(twentyfour_bits >> 6) & 0x3f];
+    chars[3] = '=';  // Emit padding.
     return;
   }
   if (ii + 1 <= in.size()) {  // Process a single input byte.
     uint32_t twentyfour_bits = (in[ii] << 16);
-    out->push_back(kBase64Table[(twentyfour_bits >> 18)]);
-    out->push_back(kBase64Table[(twentyfour_bits >> 12) & 0x3f]);
-    out->push_back('=');  // Emit padding.
-    out->push_back('=');  // Emit padding.
+    chars[0] = kBase64Table[(twentyfour_bits >> 18)];
+    chars[1] = kBase64Table[(twentyfour_bits >> 12) & 0x3f];
+    chars[2] = '=';  // Emit padding.
+    chars[3] = '=';  // Emit padding.
+  }
+}
+
+template <typename C>
+void Base64Encode(const span<uint8_t>& in, C* out) {
+  // The output size is known upfront, so we write directly into |out|.
+  // For empty input, there's no element at |pos| to take the address of.
+  if (in.empty())
+    return;
+  const size_t pos = out->size();
+  out->resize(pos + (in.size() + 2) / 3 * 4);
+  Base64EncodeTo(in, reinterpret_cast<uint8_t*>(&(*out)[pos]));
+}
+
+void Base64Encode(const span<uint8_t>& in, FlushingBuffer* out) {
+  // The FlushingBuffer is bounded, so we encode in chunks; the chunk size
+  // is a multiple of 3, so that padding only occurs at the end.
+  uint8_t buffer[1024];
+  constexpr size_t kChunk = sizeof(buffer) / 4 * 3;
+  for (size_t ii = 0; ii < in.size(); ii += kChunk) {
+    const span<uint8_t> chunk =
+        in.subspan(ii, std::min(kChunk, in.size() - ii));
+    Base64EncodeTo(chunk, buffer);
+    out->insert(out->end(), buffer, buffer + (chunk.size() + 2) / 3 * 4);
+  }
+}
+
+// Yields true iff |ch| may appear within a JSON string as is, that is, it's
+// printable US-ASCII (we include DEL) other than '"' and '\\'.
+bool IsUnescaped(uint16_t ch) {
+  return ch >= 32 && ch <= 127 && ch != '"' && ch != '\\';
+}
+
+// Yields the number of leading characters in |in| for which IsUnescaped
+// is true. Since most strings are mostly plain US-ASCII, this processes
+// 16 bytes at a time if SSE2 is available.
+size_t CountUnescaped(const uint8_t* in, size_t size) {
+  size_t ii = 0;
+#if defined(CRDTP_JSON_USE_SSE2)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; ii + 16 <= size; ii += 16) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    // The comparison is signed, so bytes >= 0x80 are less than ' ' too.
+    const __m128i escaped = _mm_or_si128(
+        _mm_cmplt_epi8(chars, space),
+        _mm_or_si128(_mm_cmpeq_epi8(chars, quote),
+                     _mm_cmpeq_epi8(chars, backslash)));
+    if (_mm_movemask_epi8(escaped))
+      break;
+  }
+#endif
+  while (ii < size && IsUnescaped(in[ii]))
+    ++ii;
+  return ii;
+}
+
+size_t CountUnescaped(const uint16_t* in, size_t size) {
+  size_t ii = 0;
+#if defined(CRDTP_JSON_USE_SSE2)
+  const __m128i space = _mm_set1_epi16(' ');
+  const __m128i del = _mm_set1_epi16(127);
+  const __m128i quote = _mm_set1_epi16('"');
+  const __m128i backslash = _mm_set1_epi16('\\');
+  for (; ii + 8 <= size; ii += 8) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    // The comparisons are signed, so chars >= 0x8000 are less than ' '.
+    const __m128i escaped = _mm_or_si128(
+        _mm_or_si128(_mm_cmplt_epi16(chars, space),
+                     _mm_cmpgt_epi16(chars, del)),
+        _mm_or_si128(_mm_cmpeq_epi16(chars, quote),
+                     _mm_cmpeq_epi16(chars, backslash)));
+    if (_mm_movemask_epi8(escaped))
+      break;
+  }
+#endif
+  while (ii < size && IsUnescaped(in[ii]))
+    ++ii;
+  return ii;
+}
+
+// The number of bytes for encoding |codepoint| as UTF8.
+size_t UTF8Length(uint32_t codepoint) {
+  if (codepoint < 0x80)
+    return 1;
+  if (codepoint < 0x800)
+    return 2;
+  return codepoint < 0x10000 ? 3 : 4;
+}
+
+// Writes |codepoint|, which must be >= 0x80, as UTF8 into |buffer|, which
+// must have room for 4 bytes. Yields the number of bytes written.
+size_t EncodeUTF8(uint32_t codepoint, char* buffer) {
+  // Indexed by the length of the sequence, the bits of its leading byte
+  // which indicate that length.
+  static constexpr uint8_t kLeadingBits[] = {0, 0, 0xc0, 0xe0, 0xf0};
+  const size_t length = UTF8Length(codepoint);
+  buffer[0] = static_cast<char>(kLeadingBits[length] |
+                                (codepoint >> (6 * (length - 1))));
+  for (size_t ii = 1; ii < length; ++ii) {
+    buffer[ii] = static_cast<char>(
+        0x80 | ((codepoint >> (6 * (length - 1 - ii))) & 0x3f));
   }
+  return length;
 }
 
 // Implements a handler for JSON parser events to emit a JSON string.
 template <typename C>
 class JSONEncoder : public ParserHandler {
  public:
-  JSONEncoder(C* out, Status* status) : out_(out), status_(status) {
+  JSONEncoder(C* out, Status* status, JSONEncoding encoding)
+      : out_(out), status_(status), encoding_(encoding) {
     *status_ = Status();
     state_.emplace(Container::NONE);
   }
 
+  // Takes ownership of |out|, see NewJSONEncoder with a flush callback.
+  JSONEncoder(std::unique_ptr<C> out, Status* status, JSONEncoding encoding)
+      : JSONEncoder(out.get(), status, encoding) {
+    owned_out_ = std::move(out);
+  }
+
+  ~JSONEncoder() override { FlushOutput(out_); }
+
   void HandleMapBegin() override {
     if (!status_->ok())
       return;
@@ -124,6 +358,8 @@ class JSONEncoder : public ParserHandler {
     assert(state_.size() >= 2 && state_.top().container() == Container::MAP);
     state_.pop();
     Emit('}');
+    if (state_.size() == 1)
+      FlushOutput(out_);
   }
 
   void HandleArrayBegin() override {
@@ -140,6 +376,8 @@ class JSONEncoder : public ParserHandler {
     assert(state_.size() >= 2 && state_.top().container() == Container::ARRAY);
     state_.pop();
     Emit(']');
+    if (state_.size() == 1)
+      FlushOutput(out_);
   }
 
   void HandleString16(span<uint16_t> chars) override {
@@ -147,7 +385,15 @@ class JSONEncoder : public ParserHandler {
       return;
     state_.top().StartElement(out_);
     Emit('"');
-    for (const uint16_t ch : chars) {
+    for (size_t ii = 0; ii < chars.size(); ++ii) {
+      const size_t run = CountUnescaped(chars.data() + ii, chars.size() - ii);
+      if (run) {
+        EmitUnescaped(chars.data() + ii, run);
+        ii += run;
+        if (ii == chars.size())
+          break;
+      }
+      const uint16_t ch = chars[ii];
       if (ch == '"') {
         Emit("\\\"");
       } else if (ch == '\\') {
@@ -162,8 +408,15 @@ class JSONEncoder : public ParserHandler {
         Emit("\\r");
       } else if (ch == '\t') {
         Emit("\\t");
-      } else if (ch >= 32 && ch <= 127) {
-        Emit(ch);
+      } else if (encoding_ == JSONEncoding::UTF8 && ch >= 0x80 &&
+                 (ch < 0xd800 || ch > 0xdfff)) {
+        EmitUTF8(ch);
+      } else if (encoding_ == JSONEncoding::UTF8 && ch >= 0xd800 &&
+                 ch <= 0xdbff && ii + 1 < chars.size() &&
+                 chars[ii + 1] >= 0xdc00 && chars[ii + 1] <= 0xdfff) {
+        // A surrogate pair; unpaired surrogates are escaped below.
+        EmitUTF8(0x10000 + ((ch - 0xd800) << 10) + (chars[ii + 1] - 0xdc00));
+        ++ii;
       } else {
         Emit("\\u");
         PrintHex(ch, out_);
@@ -178,6 +431,13 @@ class JSONEncoder : public ParserHandler {
     state_.top().StartElement(out_);
     Emit('"');
     for (size_t ii = 0; ii < chars.size(); ++ii) {
+      const size_t run = CountUnescaped(chars.data() + ii, chars.size() - ii);
+      if (run) {
+        EmitUnescaped(chars.data() + ii, run);
+        ii += run;
+        if (ii == chars.size())
+          break;
+      }
       uint8_t c = chars[ii];
       if (c == '"') {
         Emit("\\\"");
@@ -193,8 +453,6 @@ class JSONEncoder : public ParserHandler {
         Emit("\\r");
       } else if (c == '\t') {
         Emit("\\t");
-      } else if (c >= 32 && c <= 127) {
-        Emit(c);
       } else if (c < 32) {
         Emit("\\u");
         PrintHex(static_cast<uint16_t>(c), out_);
@@ -225,6 +483,7 @@ class JSONEncoder : public ParserHandler {
         // belonging to this Unicode character into |codepoint|.
         if (ii + num_bytes_left >= chars.size())
           continue;
+        const size_t sequence_start = ii;
         bool invalid_byte_seen = false;
         while (num_bytes_left > 0) {
           c = chars[++ii];
@@ -246,6 +505,18 @@ class JSONEncoder : public ParserHandler {
         if (codepoint > 0x10ffff)
           continue;
 
+        // For UTF8 output, we pass on valid sequences as they are. Overlong
+        // encodings and surrogates are escaped below instead.
+        if (encoding_ == JSONEncoding::UTF8 &&
+            ii + 1 - sequence_start == UTF8Length(codepoint) &&
+            (codepoint < 0xd800 || codepoint > 0xdfff)) {
+          const char* sequence =
+              reinterpret_cast<const char*>(chars.data() + sequence_start);
+          out_->insert(out_->end(), sequence, sequence + ii + 1 -
+                                                  sequence_start);
+          continue;
+        }
+
         // So, now we transcode to UTF16,
         // using the math described at https://en.wikipedia.org/wiki/UTF-16,
         // for either one or two 16 bit characters.
@@ -290,7 +561,7 @@ class JSONEncoder : public ParserHandler {
     if (value < static_cast<double>(std::numeric_limits<int64_t>::max()) &&
         value >= std::numeric_limits<int64_t>::min() &&
         std::floor(value) == value) {
-      Emit(std::to_string(static_cast<int64_t>(value)));
+      EmitInteger(static_cast<int64_t>(value));
       return;
     }
     std::string str_value = json::platform::DToStr(value);
@@ -321,7 +592,14 @@ class JSONEncoder : public ParserHandler {
     if (!status_->ok())
       return;
     state_.top().StartElement(out_);
-    Emit(std::to_string(value));
+    EmitInteger(value);
+  }
+
+  void HandleInt64(int64_t value) override {
+    if (!status_->ok())
+      return;
+    state_.top().StartElement(out_);
+    EmitInteger(value);
   }
 
   void HandleBool(bool value) override {
@@ -352,23 +630,93 @@ class JSONEncoder : public ParserHandler {
   void Emit(const std::string& str) {
     out_->insert(out_->end(), str.begin(), str.end());
   }
+  // Emits |codepoint|, which must be >= 0x80, encoded as UTF8.
+  void EmitUTF8(uint32_t codepoint) {
+    char buffer[4];
+    out_->insert(out_->end(), buffer, buffer + EncodeUTF8(codepoint, buffer));
+  }
+
+  // Emits characters for which IsUnescaped is true.
+  void EmitUnescaped(const uint8_t* chars, size_t size) {
+    // Inserting chars (rather than uint8_t) avoids a temporary if C is
+    // a std::string.
+    const char* begin = reinterpret_cast<const char*>(chars);
+    out_->insert(out_->end(), begin, begin + size);
+  }
+  void EmitUnescaped(const uint16_t* chars, size_t size) {
+    char buffer[256];
+    while (size) {
+      const size_t chunk = std::min(size, sizeof(buffer));
+      for (size_t ii = 0; ii < chunk; ++ii)
+        buffer[ii] = static_cast<char>(chars[ii]);
+      out_->insert(out_->end(), buffer, buffer + chunk);
+      chars += chunk;
+      size -= chunk;
+    }
+  }
+  // Like Emit(std::to_string(value)), but without the temporary string.
+  void EmitInteger(int64_t value) {
+    char buffer[20];  // Enough for "-9223372036854775808".
+    char* const end = buffer + sizeof(buffer);
+    char* pos = end;
+    uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value)
+                                   : static_cast<uint64_t>(value);
+    do {
+      *--pos = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude);
+    if (value < 0)
+      *--pos = '-';
+    out_->insert(out_->end(), pos, end);
+  }
 
   C* out_;
+  std::unique_ptr<C> owned_out_;
   Status* status_;
+  const JSONEncoding encoding_;
   std::stack<State> state_;
 };
 }  // namespace
 
 std::unique_ptr<ParserHandler> NewJSONEncoder(std::vector<uint8_t>* out,
                                               Status* status) {
-  return std::unique_ptr<ParserHandler>(
-      new JSONEncoder<std::vector<uint8_t>>(out, status));
+  return NewJSONEncoder(out, status, JSONEncoding::ASCII);
 }
 
 std::unique_ptr<ParserHandler> NewJSONEncoder(std::string* out,
                                               Status* status) {
+  return NewJSONEncoder(out, status, JSONEncoding::ASCII);
+}
+
+std::unique_ptr<ParserHandler> NewJSONEncoder(std::vector<uint8_t>* out,
+                                              Status* status,
+                                              JSONEncoding encoding) {
   return std::unique_ptr<ParserHandler>(
-      new JSONEncoder<std::string>(out, status));
+      new JSONEncoder<std::vector<uint8_t>>(out, status, encoding));
+}
+
+std::unique_ptr<ParserHandler> NewJSONEncoder(std::string* out,
+                                              Status* status,
+                                              JSONEncoding encoding) {
+  return std::unique_ptr<ParserHandler>(
+      new JSONEncoder<std::string>(out, status, encoding));
+}
+
+std::unique_ptr<ParserHandler> NewJSONEncoder(size_t buffer_size,
+                                              JSONFlushCallback flush,
+                                              Status* status) {
+  return NewJSONEncoder(buffer_size, std::move(flush), status,
+                        JSONEncoding::ASCII);
+}
+
+std::unique_ptr<ParserHandler> NewJSONEncoder(size_t buffer_size,
+                                              JSONFlushCallback flush,
+                                              Status* status,
+                                              JSONEncoding encoding) {
+  return std::unique_ptr<ParserHandler>(new JSONEncoder<FlushingBuffer>(
+      std::unique_ptr<FlushingBuffer>(
+          new FlushingBuffer(buffer_size, std::move(flush))),
+      status, encoding));
 }
 
 // =============================================================================
@@ -376,8 +724,6 @@ std::unique_ptr<ParserHandler> NewJSONEncoder(std::string* out,
 // =============================================================================
 
 namespace {
-const int kStackLimit = 300;
-
 enum Token {
   ObjectBegin,
   ObjectEnd,
@@ -398,39 +744,385 @@ const char* const kNullString = "null";
 const char* const kTrueString = "true";
 const char* const kFalseString = "false";
 
+// The following routines find the end of runs of characters that the parser
+// would otherwise look at one at a time: the contents of string literals,
+// and whitespace. With SSE2, they examine 16 bytes at a time, which speeds
+// up parsing messages with long strings (e.g. script sources) and indented
+// messages substantially.
+
+// Yields the number of leading characters in |in| other than '"' and '\\'.
+size_t CountUntilQuoteOrBackslash(const uint8_t* in, size_t size) {
+  size_t ii = 0;
+#if defined(CRDTP_JSON_USE_SSE2)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; ii + 16 <= size; ii += 16) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chars, quote),
+                                       _mm_cmpeq_epi8(chars, backslash)))) {
+      break;
+    }
+  }
+#endif
+  while (ii < size && in[ii] != '"' && in[ii] != '\\')
+    ++ii;
+  return ii;
+}
+
+size_t CountUntilQuoteOrBackslash(const uint16_t* in, size_t size) {
+  size_t ii = 0;
+#if defined(CRDTP_JSON_USE_SSE2)
+  const __m128i quote = _mm_set1_epi16('"');
+  const __m128i backslash = _mm_set1_epi16('\\');
+  for (; ii + 8 <= size; ii += 8) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(chars, quote),
+                                       _mm_cmpeq_epi16(chars, backslash)))) {
+      break;
+    }
+  }
+#endif
+  while (ii < size && in[ii] != '"' && in[ii] != '\\')
+    ++ii;
+  return ii;
+}
+
+// Yields true iff |in| contains no backslash and is well-formed UTF8, that
+// is, it has no overlong encodings and no surrogates. Since this is the
+// case for most string literals, the parser passes them on as they are.
+bool IsPlainUTF8(const uint8_t* in, size_t size) {
+  size_t ii = 0;
+  for (;;) {
+#if defined(CRDTP_JSON_USE_SSE2)
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; ii + 16 <= size; ii += 16) {
+      const __m128i chars =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+      // Non-ASCII bytes have the high bit set.
+      if (_mm_movemask_epi8(
+              _mm_or_si128(chars, _mm_cmpeq_epi8(chars, backslash)))) {
+        break;
+      }
+    }
+#endif
+    while (ii < size && in[ii] < 0x80 && in[ii] != '\\')
+      ++ii;
+    if (ii == size)
+      return true;
+    const uint8_t c = in[ii];
+    size_t length;
+    uint32_t codepoint;
+    if ((c & 0xe0) == 0xc0) {
+      length = 2;
+      codepoint = c & 0x1f;
+    } else if ((c & 0xf0) == 0xe0) {
+      length = 3;
+      codepoint = c & 0x0f;
+    } else if ((c & 0xf8) == 0xf0) {
+      length = 4;
+      codepoint = c & 0x07;
+    } else {
+      return false;  // A backslash, or an invalid leading byte.
+    }
+    if (size - ii < length)
+      return false;
+    for (size_t jj = 1; jj < length; ++jj) {
+      if ((in[ii + jj] & 0xc0) != 0x80)
+        return false;
+      codepoint = (codepoint << 6) | (in[ii + jj] & 0x3f);
+    }
+    if (UTF8Length(codepoint) != length || codepoint > 0x10ffff ||
+        (codepoint >= 0xd800 && codepoint <= 0xdfff)) {
+      return false;
+    }
+    ii += length;
+  }
+}
+
+bool IsSpaceOrNewLine(uint16_t c) {
+  // \v = vertial tab; \f = form feed page break.
+  return c == ' ' || c == '\n' || c == '\v' || c == '\f' || c == '\r' ||
+         c == '\t';
+}
+
+// Yields the number of leading characters in |in| for which
+// IsSpaceOrNewLine is true.
+size_t CountWhitespace(const uint8_t* in, size_t size) {
+  size_t ii = 0;
+#if defined(CRDTP_JSON_USE_SSE2)
+  // '\t', '\n', '\v', '\f', '\r' are 9 through 13.
+  const __m128i tab_minus_one = _mm_set1_epi8('\t' - 1);
+  const __m128i cr_plus_one = _mm_set1_epi8('\r' + 1);
+  const __m128i space = _mm_set1_epi8(' ');
+  for (; ii + 16 <= size; ii += 16) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    const __m128i whitespace =
+        _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(chars, tab_minus_one),
+                                   _mm_cmplt_epi8(chars, cr_plus_one)),
+                     _mm_cmpeq_epi8(chars, space));
+    if (_mm_movemask_epi8(whitespace) != 0xffff)
+      break;
+  }
+#endif
+  while (ii < size && IsSpaceOrNewLine(in[ii]))
+    ++ii;
+  return ii;
+}
+
+size_t CountWhitespace(const uint16_t* in, size_t size) {
+  size_t ii = 0;
+  while (ii < size && IsSpaceOrNewLine(in[ii]))
+    ++ii;
+  return ii;
+}
+
 template <typename Char>
 class JsonParser {
  public:
-  explicit JsonParser(ParserHandler* handler) : handler_(handler) {}
+  JsonParser(ParserHandler* handler, int stack_limit)
+      : handler_(handler), stack_limit_(stack_limit) {}
 
   void Parse(const Char* start, size_t length) {
+    ParseTokens(start, start + length, /*offset=*/0, /*final=*/true);
+  }
+
+  // Parses the tokens in [start, end), which continue those from previous
+  // calls, see StreamingJSONParser; |offset| is the position of |start|
+  // within the message. Unless |final|, stops before a token which may
+  // continue past |end|. Returns the end of the consumed input. Rather
+  // than recursing, this tracks the open maps and arrays in |stack_|, so
+  // the depth of the message doesn't affect the call stack.
+  const Char* ParseTokens(const Char* start,
+                          const Char* end,
+                          size_t offset,
+                          bool final) {
     start_pos_ = start;
-    const Char* end = start + length;
-    const Char* tokenEnd = nullptr;
-    ParseValue(start, end, &tokenEnd, 0);
-    if (error_)
-      return;
-    if (tokenEnd != end) {
-      HandleError(Error::JSON_PARSER_UNPROCESSED_INPUT_REMAINS, tokenEnd);
+    offset_ = offset;
+    while (status_.ok()) {
+      const Char* token_start = nullptr;
+      const Char* token_end = nullptr;
+      Token token = ParseToken(start, end, &token_start, &token_end);
+      // Whitespace may be followed by a comment, and invalid tokens or
+      // numbers may be incomplete, so we wait for more input.
+      if (!final && (token == NoInput || token == InvalidToken ||
+                     (token == Number && token_end == end))) {
+        break;
+      }
+      if (done_) {
+        if (token == NoInput)
+          return end;
+        HandleError(Error::JSON_PARSER_UNPROCESSED_INPUT_REMAINS, token_start);
+        break;
+      }
+      if (!ConsumeToken(token, start, token_start, token_end))
+        break;
+      start = token_end;
     }
+    return start;
   }
 
+  // True once the top-level value is complete.
+  bool done() const { return done_; }
+
+  const Status& status() const { return status_; }
+
  private:
-  bool CharsToDouble(const uint16_t* chars, size_t length, double* result) {
-    std::string buffer;
-    buffer.reserve(length + 1);
+  // For the open maps and arrays in ParseTokens, what's expected next.
+  enum class Expect : uint8_t {
+    ARRAY_VALUE_OR_END,  // After '['.
+    ARRAY_VALUE,         // After ',' within an array.
+    ARRAY_COMMA_OR_END,  // After a value within an array.
+    MAP_KEY_OR_END,      // After '{'.
+    MAP_KEY,             // After ',' within a map.
+    MAP_COLON,           // After a key.
+    MAP_VALUE,           // After ':'.
+    MAP_COMMA_OR_END,    // After a value within a map.
+  };
+
+  // Handles |token| according to the innermost open map or array; reports
+  // the same errors as ParseValue. Returns false after reporting an error.
+  bool ConsumeToken(Token token,
+                    const Char* value_start,
+                    const Char* token_start,
+                    const Char* token_end) {
+    if (stack_.empty())
+      return ConsumeValue(token, value_start, token_start, token_end);
+    switch (stack_.back()) {
+      case Expect::ARRAY_VALUE_OR_END:
+        if (token == ArrayEnd)
+          return CloseContainer();
+        return ConsumeValue(token, value_start, token_start, token_end);
+      case Expect::ARRAY_VALUE:
+        if (token == ArrayEnd) {
+          HandleError(Error::JSON_PARSER_UNEXPECTED_ARRAY_END, token_start);
+          return false;
+        }
+        return ConsumeValue(token, value_start, token_start, token_end);
+      case Expect::ARRAY_COMMA_OR_END:
+        if (token == ListSeparator) {
+          stack_.back() = Expect::ARRAY_VALUE;
+          return true;
+        }
+        if (token == ArrayEnd)
+          return CloseContainer();
+        HandleError(Error::JSON_PARSER_COMMA_OR_ARRAY_END_EXPECTED,
+                    token_start);
+        return false;
+      case Expect::MAP_KEY_OR_END:
+        if (token == ObjectEnd)
+          return CloseContainer();
+        return ConsumeKey(token, token_start, token_end);
+      case Expect::MAP_KEY:
+        if (token == ObjectEnd) {
+          HandleError(Error::JSON_PARSER_UNEXPECTED_MAP_END, token_start);
+          return false;
+        }
+        return ConsumeKey(token, token_start, token_end);
+      case Expect::MAP_COLON:
+        if (token != ObjectPairSeparator) {
+          HandleError(Error::JSON_PARSER_COLON_EXPECTED, token_start);
+          return false;
+        }
+        stack_.back() = Expect::MAP_VALUE;
+        return true;
+      case Expect::MAP_VALUE:
+        return ConsumeValue(token, value_start, token_start, token_end);
+      case Expect::MAP_COMMA_OR_END:
+        if (token == ListSeparator) {
+          stack_.back() = Expect::MAP_KEY;
+          return true;
+        }
+        if (token == ObjectEnd)
+          return CloseContainer();
+        HandleError(Error::JSON_PARSER_COMMA_OR_MAP_END_EXPECTED, token_start);
+        return false;
+    }
+    return false;
+  }
+
+  bool ConsumeKey(Token token, const Char* token_start, const Char* token_end) {
+    if (token != StringLiteral) {
+      HandleError(Error::JSON_PARSER_STRING_LITERAL_EXPECTED, token_start);
+      return false;
+    }
+    if (!HandleStringLiteral(token_start + 1, token_end - 1)) {
+      HandleError(Error::JSON_PARSER_INVALID_STRING, token_start);
+      return false;
+    }
+    stack_.back() = Expect::MAP_COLON;
+    return true;
+  }
+
+  bool ConsumeValue(Token token,
+                    const Char* value_start,
+                    const Char* token_start,
+                    const Char* token_end) {
+    if (stack_.size() > static_cast<size_t>(stack_limit_)) {
+      HandleError(Error::JSON_PARSER_STACK_LIMIT_EXCEEDED, value_start);
+      return false;
+    }
+    switch (token) {
+      case ArrayBegin:
+        handler_->HandleArrayBegin();
+        stack_.push_back(Expect::ARRAY_VALUE_OR_END);
+        return true;
+      case ObjectBegin:
+        handler_->HandleMapBegin();
+        stack_.push_back(Expect::MAP_KEY_OR_END);
+        return true;
+      case NullToken:
+      case BoolTrue:
+      case BoolFalse:
+      case Number:
+      case StringLiteral:
+        if (!HandleScalar(token, token_start, token_end))
+          return false;
+        CompleteValue();
+        return true;
+      case NoInput:
+        HandleError(Error::JSON_PARSER_NO_INPUT, token_start);
+        return false;
+      case InvalidToken:
+        HandleError(Error::JSON_PARSER_INVALID_TOKEN, token_start);
+        return false;
+      default:
+        HandleError(Error::JSON_PARSER_VALUE_EXPECTED, token_start);
+        return false;
+    }
+  }
+
+  bool CloseContainer() {
+    if (stack_.back() <= Expect::ARRAY_COMMA_OR_END)
+      handler_->HandleArrayEnd();
+    else
+      handler_->HandleMapEnd();
+    stack_.pop_back();
+    CompleteValue();
+    return true;
+  }
+
+  void CompleteValue() {
+    if (stack_.empty()) {
+      done_ = true;
+      return;
+    }
+    stack_.back() = stack_.back() <= Expect::ARRAY_COMMA_OR_END
+                        ? Expect::ARRAY_COMMA_OR_END
+                        : Expect::MAP_COMMA_OR_END;
+  }
+
+  // Converts a number token with fraction or exponent into |result|.
+  static bool CharsToDouble(const Char* chars, size_t length, double* result) {
+    // StrToD expects a \0 terminated string; all but absurdly long number
+    // tokens fit into the stack buffer.
+    char stack_buffer[64];
+    std::string heap_buffer;
+    char* buffer = stack_buffer;
+    if (length >= sizeof(stack_buffer)) {
+      heap_buffer.resize(length + 1);
+      buffer = &heap_buffer[0];
+    }
     for (size_t ii = 0; ii < length; ++ii) {
       bool is_ascii = !(chars[ii] & ~0x7F);
       if (!is_ascii)
         return false;
-      buffer.push_back(static_cast<char>(chars[ii]));
+      buffer[ii] = static_cast<char>(chars[ii]);
     }
-    return platform::StrToD(buffer.c_str(), result);
+    buffer[length] = '\0';
+    return platform::StrToD(buffer, result);
   }
 
-  bool CharsToDouble(const uint8_t* chars, size_t length, double* result) {
-    std::string buffer(reinterpret_cast<const char*>(chars), length);
-    return platform::StrToD(buffer.c_str(), result);
+  // Converts a number token without fraction or exponent into |result|.
+  // Returns false if the token has a fraction or exponent, or if it's
+  // outside of the int64_t range.
+  static bool CharsToInt64(const Char* start,
+                           const Char* end,
+                           int64_t* result) {
+    bool negative = start < end && *start == '-';
+    if (negative)
+      ++start;
+    // The magnitude of the int64_t min is one larger than the max.
+    const uint64_t limit =
+        static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) + negative;
+    uint64_t magnitude = 0;
+    for (; start < end; ++start) {
+      if (*start < '0' || *start > '9')
+        return false;
+      const uint64_t digit = *start - '0';
+      if (magnitude > (limit - digit) / 10)
+        return false;
+      magnitude = magnitude * 10 + digit;
+    }
+    if (!negative)
+      *result = static_cast<int64_t>(magnitude);
+    else if (magnitude == limit)
+      *result = std::numeric_limits<int64_t>::min();
+    else
+      *result = -static_cast<int64_t>(magnitude);
+    return true;
   }
 
   static bool ParseConstToken(const Char* start,
@@ -536,6 +1228,9 @@ class JsonParser {
                                const Char* end,
                                const Char** token_end) {
     while (start < end) {
+      start += CountUntilQuoteOrBackslash(start, end - start);
+      if (start == end)
+        break;
       Char c = *start++;
       if ('\\' == c) {
         if (start == end)
@@ -611,18 +1306,12 @@ class JsonParser {
     return false;
   }
 
-  static bool IsSpaceOrNewLine(Char c) {
-    // \v = vertial tab; \f = form feed page break.
-    return c == ' ' || c == '\n' || c == '\v' || c == '\f' || c == '\r' ||
-           c == '\t';
-  }
-
   static void SkipWhitespaceAndComments(const Char* start,
                                         const Char* end,
                                         const Char** whitespace_end) {
     while (start < end) {
       if (IsSpaceOrNewLine(*start)) {
-        ++start;
+        start += CountWhitespace(start, end - start);
       } else if (*start == '/') {
         const Char* comment_end = nullptr;
         if (!SkipComment(start, end, &comment_end))
@@ -712,6 +1401,7 @@ class JsonParser {
   static bool DecodeString(const Char* start,
                            const Char* end,
                            std::vector<uint16_t>* output) {
+    output->clear();
     if (start == end)
       return true;
     if (start > end)
@@ -828,24 +1518,66 @@ class JsonParser {
     return true;
   }
 
-  void ParseValue(const Char* start,
-                  const Char* end,
-                  const Char** value_token_end,
-                  int depth) {
-    if (depth > kStackLimit) {
-      HandleError(Error::JSON_PARSER_STACK_LIMIT_EXCEEDED, start);
-      return;
+  // Sends the contents of a string literal, between |start| and |end|, to
+  // the handler. Returns false if the literal is invalid. For UTF8 input,
+  // this sends HandleString8 unless the literal has unpaired surrogates.
+  // Spans into the input are used for literals without escapes; other
+  // literals are decoded into buffers that are reused for the entire
+  // message.
+  bool HandleStringLiteral(const uint8_t* start, const uint8_t* end) {
+    if (IsPlainUTF8(start, end - start)) {
+      handler_->HandleString8(span<uint8_t>(start, end - start));
+      return true;
     }
-    const Char* token_start = nullptr;
-    const Char* token_end = nullptr;
-    Token token = ParseToken(start, end, &token_start, &token_end);
+    if (!DecodeString(start, end, &string16_buffer_))
+      return false;
+    string8_buffer_.clear();
+    for (size_t ii = 0; ii < string16_buffer_.size(); ++ii) {
+      uint32_t ch = string16_buffer_[ii];
+      if (ch < 0x80) {
+        string8_buffer_.push_back(static_cast<uint8_t>(ch));
+        continue;
+      }
+      if (ch >= 0xd800 && ch <= 0xdfff) {
+        if (ch >= 0xdc00 || ii + 1 == string16_buffer_.size() ||
+            string16_buffer_[ii + 1] < 0xdc00 ||
+            string16_buffer_[ii + 1] > 0xdfff) {
+          // An unpaired surrogate can't be represented in UTF8.
+          handler_->HandleString16(span<uint16_t>(string16_buffer_.data(),
+                                                  string16_buffer_.size()));
+          return true;
+        }
+        ch = 0x10000 + ((ch - 0xd800) << 10) +
+             (string16_buffer_[++ii] - 0xdc00);
+      }
+      char buffer[4];
+      string8_buffer_.insert(string8_buffer_.end(), buffer,
+                             buffer + EncodeUTF8(ch, buffer));
+    }
+    handler_->HandleString8(
+        span<uint8_t>(string8_buffer_.data(), string8_buffer_.size()));
+    return true;
+  }
+
+  bool HandleStringLiteral(const uint16_t* start, const uint16_t* end) {
+    const size_t size = end - start;
+    if (CountUntilQuoteOrBackslash(start, size) == size) {
+      handler_->HandleString16(span<uint16_t>(start, size));
+      return true;
+    }
+    if (!DecodeString(start, end, &string16_buffer_))
+      return false;
+    handler_->HandleString16(
+        span<uint16_t>(string16_buffer_.data(), string16_buffer_.size()));
+    return true;
+  }
+
+  // Sends the value for a token other than a map or array to the handler.
+  // Returns false after reporting an error.
+  bool HandleScalar(Token token,
+                    const Char* token_start,
+                    const Char* token_end) {
     switch (token) {
-      case NoInput:
-        HandleError(Error::JSON_PARSER_NO_INPUT, token_start);
-        return;
-      case InvalidToken:
-        HandleError(Error::JSON_PARSER_INVALID_TOKEN, token_start);
-        return;
       case NullToken:
         handler_->HandleNull();
         break;
@@ -856,10 +1588,24 @@ class JsonParser {
         handler_->HandleBool(false);
         break;
       case Number: {
+        // Numbers written as integers (the common case, e.g. for message
+        // ids) are converted directly; those outside of the int32_t range,
+        // but within the int64_t range, are passed on exactly. Numbers with
+        // fraction or exponent, e.g. 1e10, go through StrToD.
+        int64_t int64_value;
+        if (CharsToInt64(token_start, token_end, &int64_value)) {
+          if (int64_value >= std::numeric_limits<int32_t>::min() &&
+              int64_value <= std::numeric_limits<int32_t>::max()) {
+            handler_->HandleInt32(static_cast<int32_t>(int64_value));
+          } else {
+            handler_->HandleInt64(int64_value);
+          }
+          break;
+        }
         double value;
         if (!CharsToDouble(token_start, token_end - token_start, &value)) {
           HandleError(Error::JSON_PARSER_INVALID_NUMBER, token_start);
-          return;
+          return false;
         }
         if (value >= std::numeric_limits<int32_t>::min() &&
             value <= std::numeric_limits<int32_t>::max() &&
@@ -869,138 +1615,564 @@ class JsonParser {
           handler_->HandleDouble(value);
         break;
       }
-      case StringLiteral: {
-        std::vector<uint16_t> value;
-        bool ok = DecodeString(token_start + 1, token_end - 1, &value);
-        if (!ok) {
+      case StringLiteral:
+        if (!HandleStringLiteral(token_start + 1, token_end - 1)) {
           HandleError(Error::JSON_PARSER_INVALID_STRING, token_start);
-          return;
-        }
-        handler_->HandleString16(span<uint16_t>(value.data(), value.size()));
-        break;
-      }
-      case ArrayBegin: {
-        handler_->HandleArrayBegin();
-        start = token_end;
-        token = ParseToken(start, end, &token_start, &token_end);
-        while (token != ArrayEnd) {
-          ParseValue(start, end, &token_end, depth + 1);
-          if (error_)
-            return;
-
-          // After a list value, we expect a comma or the end of the list.
-          start = token_end;
-          token = ParseToken(start, end, &token_start, &token_end);
-          if (token == ListSeparator) {
-            start = token_end;
-            token = ParseToken(start, end, &token_start, &token_end);
-            if (token == ArrayEnd) {
-              HandleError(Error::JSON_PARSER_UNEXPECTED_ARRAY_END, token_start);
-              return;
-            }
-          } else if (token != ArrayEnd) {
-            // Unexpected value after list value. Bail out.
-            HandleError(Error::JSON_PARSER_COMMA_OR_ARRAY_END_EXPECTED,
-                        token_start);
-            return;
-          }
-        }
-        handler_->HandleArrayEnd();
-        break;
-      }
-      case ObjectBegin: {
-        handler_->HandleMapBegin();
-        start = token_end;
-        token = ParseToken(start, end, &token_start, &token_end);
-        while (token != ObjectEnd) {
-          if (token != StringLiteral) {
-            HandleError(Error::JSON_PARSER_STRING_LITERAL_EXPECTED,
-                        token_start);
-            return;
-          }
-          std::vector<uint16_t> key;
-          if (!DecodeString(token_start + 1, token_end - 1, &key)) {
-            HandleError(Error::JSON_PARSER_INVALID_STRING, token_start);
-            return;
-          }
-          handler_->HandleString16(span<uint16_t>(key.data(), key.size()));
-          start = token_end;
-
-          token = ParseToken(start, end, &token_start, &token_end);
-          if (token != ObjectPairSeparator) {
-            HandleError(Error::JSON_PARSER_COLON_EXPECTED, token_start);
-            return;
-          }
-          start = token_end;
-
-          ParseValue(start, end, &token_end, depth + 1);
-          if (error_)
-            return;
-          start = token_end;
-
-          // After a key/value pair, we expect a comma or the end of the
-          // object.
-          token = ParseToken(start, end, &token_start, &token_end);
-          if (token == ListSeparator) {
-            start = token_end;
-            token = ParseToken(start, end, &token_start, &token_end);
-            if (token == ObjectEnd) {
-              HandleError(Error::JSON_PARSER_UNEXPECTED_MAP_END, token_start);
-              return;
-            }
-          } else if (token != ObjectEnd) {
-            // Unexpected value after last object value. Bail out.
-            HandleError(Error::JSON_PARSER_COMMA_OR_MAP_END_EXPECTED,
-                        token_start);
-            return;
-          }
+          return false;
         }
-        handler_->HandleMapEnd();
         break;
-      }
-
       default:
-        // We got a token that's not a value.
-        HandleError(Error::JSON_PARSER_VALUE_EXPECTED, token_start);
-        return;
+        assert(false);  // Unreachable.
+        return false;
     }
-
-    SkipWhitespaceAndComments(token_end, end, value_token_end);
+    return true;
   }
 
   void HandleError(Error error, const Char* pos) {
     assert(error != Error::OK);
-    if (!error_) {
-      handler_->HandleError(
-          Status{error, static_cast<size_t>(pos - start_pos_)});
-      error_ = true;
+    if (status_.ok()) {
+      status_ = Status{error, offset_ + static_cast<size_t>(pos - start_pos_)};
+      handler_->HandleError(status_);
     }
   }
 
-  const Char* start_pos_ = nullptr;
-  bool error_ = false;
   ParserHandler* handler_;
+  const int stack_limit_;
+  const Char* start_pos_ = nullptr;
+  // The position of |start_pos_| within the message.
+  size_t offset_ = 0;
+  Status status_;
+  // The open maps and arrays for ParseTokens.
+  std::vector<Expect> stack_;
+  bool done_ = false;
+  std::vector<uint16_t> string16_buffer_;
+  std::vector<uint8_t> string8_buffer_;
 };
 }  // namespace
 
 void ParseJSON(span<uint8_t> chars, ParserHandler* handler) {
-  JsonParser<uint8_t> parser(handler);
-  parser.Parse(chars.data(), chars.size());
+  ParseJSON(chars, handler, kDefaultStackLimit);
 }
 
 void ParseJSON(span<uint16_t> chars, ParserHandler* handler) {
-  JsonParser<uint16_t> parser(handler);
+  ParseJSON(chars, handler, kDefaultStackLimit);
+}
+
+void ParseJSON(span<uint8_t> chars, ParserHandler* handler, int stack_limit) {
+  JsonParser<uint8_t> parser(handler, stack_limit);
   parser.Parse(chars.data(), chars.size());
 }
 
+void ParseJSON(span<uint16_t> chars, ParserHandler* handler, int stack_limit) {
+  JsonParser<uint16_t> parser(handler, stack_limit);
+  parser.Parse(chars.data(), chars.size());
+}
+
+// =============================================================================
+// json::StreamingJSONParser - for parsing messages as they arrive in chunks
+// =============================================================================
+
+class StreamingJSONParser::Parser : public JsonParser<uint8_t> {
+ public:
+  Parser(ParserHandler* out, int stack_limit)
+      : JsonParser<uint8_t>(out, stack_limit) {}
+};
+
+StreamingJSONParser::StreamingJSONParser(ParserHandler* out, int stack_limit)
+    : parser_(new Parser(out, stack_limit)) {}
+
+StreamingJSONParser::~StreamingJSONParser() {}
+
+void StreamingJSONParser::Parse(span<uint8_t> chunk) {
+  // First, complete the tokens that were split across chunks. We append
+  // at least as many bytes as are pending, so that a long token (e.g. a
+  // string) is rescanned only a logarithmic number of times.
+  while (!pending_.empty() && !chunk.empty() && parser_->status().ok()) {
+    const size_t n =
+        std::min(chunk.size(), std::max(pending_.size(), size_t{64}));
+    pending_.insert(pending_.end(), chunk.begin(), chunk.begin() + n);
+    chunk = chunk.subspan(n);
+    const uint8_t* consumed_end = parser_->ParseTokens(
+        pending_.data(), pending_.data() + pending_.size(), pos_,
+        /*final=*/false);
+    const size_t consumed = consumed_end - pending_.data();
+    pos_ += consumed;
+    const size_t remaining = pending_.size() - consumed;
+    if (remaining <= n) {
+      // The remaining bytes were taken from |chunk|, so we can go back to
+      // parsing from there.
+      chunk = span<uint8_t>(chunk.data() - remaining, chunk.size() + remaining);
+      pending_.clear();
+    } else {
+      pending_.erase(pending_.begin(), pending_.begin() + consumed);
+    }
+  }
+  if (!pending_.empty() || !parser_->status().ok())
+    return;
+  // Then, parse directly from |chunk|.
+  const uint8_t* consumed_end = parser_->ParseTokens(
+      chunk.data(), chunk.data() + chunk.size(), pos_, /*final=*/false);
+  pos_ += consumed_end - chunk.data();
+  pending_.assign(consumed_end, chunk.data() + chunk.size());
+}
+
+void StreamingJSONParser::Finish() {
+  if (!parser_->status().ok())
+    return;
+  parser_->ParseTokens(pending_.data(), pending_.data() + pending_.size(),
+                       pos_, /*final=*/true);
+  pos_ += pending_.size();
+  pending_.clear();
+}
+
+struct Status StreamingJSONParser::Status() const {
+  return parser_->status();
+}
+
+bool StreamingJSONParser::done() const {
+  return parser_->done();
+}
+
+// =============================================================================
+// json::BinaryFieldTable - for decoding base64 when converting JSON to CBOR
+// =============================================================================
+
+namespace {
+bool FieldLessThan(const std::pair<span<uint8_t>, span<uint8_t>>& x,
+                   const std::pair<span<uint8_t>, span<uint8_t>>& y) {
+  if (SpanLessThan(x.first, y.first))
+    return true;
+  if (SpanLessThan(y.first, x.first))
+    return false;
+  return SpanLessThan(x.second, y.second);
+}
+}  // namespace
+
+void BinaryFieldTable::Add(span<uint8_t> method, span<uint8_t> path) {
+  const std::pair<span<uint8_t>, span<uint8_t>> field(method, path);
+  fields_.insert(
+      std::upper_bound(fields_.begin(), fields_.end(), field, FieldLessThan),
+      field);
+}
+
+bool BinaryFieldTable::HasMethod(span<uint8_t> method) const {
+  auto it = std::lower_bound(
+      fields_.begin(), fields_.end(), method,
+      [](const std::pair<span<uint8_t>, span<uint8_t>>& field,
+         span<uint8_t> method) { return SpanLessThan(field.first, method); });
+  return it != fields_.end() && SpanEquals(it->first, method);
+}
+
+bool BinaryFieldTable::Contains(span<uint8_t> method,
+                                span<uint8_t> path) const {
+  return std::binary_search(fields_.begin(), fields_.end(),
+                            std::make_pair(method, path), FieldLessThan);
+}
+
+namespace {
+// Yields the 6 bit value of the base64 character |ch|, or 0xff if |ch| is
+// not in the base64 alphabet.
+uint8_t Base64Value(uint16_t ch) {
+  if (ch >= 'A' && ch <= 'Z')
+    return ch - 'A';
+  if (ch >= 'a' && ch <= 'z')
+    return ch - 'a' + 26;
+  if (ch >= '0' && ch <= '9')
+    return ch - '0' + 52;
+  if (ch == '+')
+    return 62;
+  if (ch == '/')
+    return 63;
+  return 0xff;
+}
+
+// Decodes blocks of 16 characters from |in| into 12 bytes each, stopping
+// before the first block that has a character outside of the base64
+// alphabet (e.g., padding). Returns the number of characters consumed.
+#if defined(CRDTP_JSON_USE_SSE2)
+size_t Base64DecodeBlocks(const uint8_t* in, size_t size, uint8_t* out) {
+  size_t ii = 0;
+  for (; ii + 16 <= size; ii += 16, out += 12) {
+    const __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+    // Non-ASCII bytes are negative, so they fall outside of all ranges.
+    const __m128i upper =
+        _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('A' - 1)),
+                      _mm_cmplt_epi8(chars, _mm_set1_epi8('Z' + 1)));
+    const __m128i lower =
+        _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(chars, _mm_set1_epi8('z' + 1)));
+    const __m128i digit =
+        _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)),
+                      _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+    const __m128i plus = _mm_cmpeq_epi8(chars, _mm_set1_epi8('+'));
+    const __m128i slash = _mm_cmpeq_epi8(chars, _mm_set1_epi8('/'));
+    const __m128i valid = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+        slash);
+    if (_mm_movemask_epi8(valid) != 0xffff)
+      break;
+    // The masks are disjoint, so we can combine the offsets which map each
+    // character to its 6 bit value, as in Base64Value.
+    const __m128i offsets = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                     _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+        _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                         _mm_and_si128(plus, _mm_set1_epi8(62 - '+'))),
+            _mm_and_si128(slash, _mm_set1_epi8(63 - '/'))));
+    const __m128i values = _mm_add_epi8(chars, offsets);
+    // Merge pairs of 6 bit values into 12 bits, then pairs of those into
+    // 24 bits, each within a 32 bit lane. The first character is in the
+    // lower byte of each 16 bit lane, but provides the upper bits.
+    const __m128i twelve_bits = _mm_or_si128(
+        _mm_slli_epi16(_mm_and_si128(values, _mm_set1_epi16(0xff)), 6),
+        _mm_srli_epi16(values, 8));
+    const __m128i twentyfour_bits = _mm_or_si128(
+        _mm_slli_epi32(_mm_and_si128(twelve_bits, _mm_set1_epi32(0xffff)), 12),
+        _mm_srli_epi32(twelve_bits, 16));
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), twentyfour_bits);
+    for (int jj = 0; jj < 4; ++jj) {
+      out[3 * jj] = lanes[jj] >> 16;
+      out[3 * jj + 1] = lanes[jj] >> 8;
+      out[3 * jj + 2] = lanes[jj];
+    }
+  }
+  return ii;
+}
+#endif
+
+// Without SSE2, and for UTF16 input, Base64Decode decodes all characters
+// with its scalar loop.
+template <typename Char>
+size_t Base64DecodeBlocks(const Char*, size_t, uint8_t*) {
+  return 0;
+}
+
+// Decodes |in| (with padding, as emitted by Base64Encode) into |out|.
+// Returns false if |in| is not valid base64.
+template <typename Char>
+bool Base64Decode(span<Char> in, std::vector<uint8_t>* out) {
+  out->clear();
+  const size_t size = in.size();
+  if (size % 4 != 0)
+    return false;
+  if (size == 0)
+    return true;
+  size_t padding = 0;
+  if (in[size - 1] == '=')
+    padding = in[size - 2] == '=' ? 2 : 1;
+  out->resize(size / 4 * 3);
+  uint8_t* bytes = out->data();
+  // The last four characters are decoded separately since they may
+  // contain padding.
+  const size_t body = size - 4;
+  size_t ii = Base64DecodeBlocks(in.data(), body, bytes);
+  bytes += ii / 4 * 3;
+  for (; ii < body; ii += 4, bytes += 3) {
+    const uint32_t a = Base64Value(in[ii]);
+    const uint32_t b = Base64Value(in[ii + 1]);
+    const uint32_t c = Base64Value(in[ii + 2]);
+    const uint32_t d = Base64Value(in[ii + 3]);
+    if ((a | b | c | d) > 63)
+      return false;
+    const uint32_t twentyfour_bits = (a << 18) | (b << 12) | (c << 6) | d;
+    bytes[0] = twentyfour_bits >> 16;
+    bytes[1] = twentyfour_bits >> 8;
+    bytes[2] = twentyfour_bits;
+  }
+  const uint32_t a = Base64Value(in[body]);
+  const uint32_t b = Base64Value(in[body + 1]);
+  const uint32_t c = padding < 2 ? Base64Value(in[body + 2]) : 0;
+  const uint32_t d = padding < 1 ? Base64Value(in[body + 3]) : 0;
+  if ((a | b | c | d) > 63)
+    return false;
+  const uint32_t twentyfour_bits = (a << 18) | (b << 12) | (c << 6) | d;
+  bytes[0] = twentyfour_bits >> 16;
+  if (padding < 2)
+    bytes[1] = twentyfour_bits >> 8;
+  if (padding < 1)
+    bytes[2] = twentyfour_bits;
+  out->resize(out->size() - padding);
+  return true;
+}
+
+// Passes the parser events on to |out|, except that strings at the fields
+// in |binary_fields| are passed on via HandleBinary if they're valid
+// base64. To this end, we keep track of the keys leading to the current
+// value and of the "method" of the message.
+class BinaryFieldDecoder : public ParserHandler {
+ public:
+  BinaryFieldDecoder(const BinaryFieldTable* binary_fields, ParserHandler* out)
+      : binary_fields_(binary_fields), out_(out) {}
+
+  void HandleMapBegin() override {
+    BeginValue();
+    stack_.push_back(Container{/*is_map=*/true, path_.size()});
+    out_->HandleMapBegin();
+  }
+
+  void HandleMapEnd() override {
+    stack_.pop_back();
+    out_->HandleMapEnd();
+  }
+
+  void HandleArrayBegin() override {
+    BeginValue();
+    stack_.push_back(Container{/*is_map=*/false, path_.size()});
+    out_->HandleArrayBegin();
+  }
+
+  void HandleArrayEnd() override {
+    stack_.pop_back();
+    out_->HandleArrayEnd();
+  }
+
+  void HandleString8(span<uint8_t> chars) override {
+    if (!HandleKeyOrBinary(chars))
+      out_->HandleString8(chars);
+  }
+
+  void HandleString16(span<uint16_t> chars) override {
+    if (!HandleKeyOrBinary(chars))
+      out_->HandleString16(chars);
+  }
+
+  void HandleBinary(span<uint8_t> bytes) override {
+    BeginValue();
+    out_->HandleBinary(bytes);
+  }
+
+  void HandleDouble(double value) override {
+    BeginValue();
+    out_->HandleDouble(value);
+  }
+
+  void HandleInt32(int32_t value) override {
+    BeginValue();
+    out_->HandleInt32(value);
+  }
+
+  void HandleInt64(int64_t value) override {
+    BeginValue();
+    out_->HandleInt64(value);
+  }
+
+  void HandleBool(bool value) override {
+    BeginValue();
+    out_->HandleBool(value);
+  }
+
+  void HandleNull() override {
+    BeginValue();
+    out_->HandleNull();
+  }
+
+  void HandleError(Status error) override { out_->HandleError(error); }
+
+ private:
+  struct Container {
+    bool is_map;
+    // The size of |path_| for the values in this container.
+    size_t path_size;
+    bool expect_key = true;
+  };
+
+  // Called for each value; afterwards, |path_| identifies the value.
+  void BeginValue() {
+    if (stack_.empty())
+      return;
+    Container& top = stack_.back();
+    if (top.is_map)
+      top.expect_key = true;
+    else
+      path_.resize(top.path_size);
+  }
+
+  // Records map keys in |path_|, and base64 decodes the string values of
+  // binary fields. Returns false if the string must be passed on as is.
+  template <typename Char>
+  bool HandleKeyOrBinary(span<Char> chars) {
+    if (!stack_.empty() && stack_.back().is_map && stack_.back().expect_key) {
+      Container& top = stack_.back();
+      top.expect_key = false;
+      path_.resize(top.path_size);
+      if (stack_.size() > 1)
+        path_.push_back('.');
+      // Keys with non-ASCII characters don't occur in the protocol, so
+      // we make sure that they don't match.
+      for (const Char ch : chars)
+        path_.push_back(ch < 0x80 ? static_cast<char>(ch) : '\xff');
+      return false;
+    }
+    BeginValue();
+    if (stack_.size() == 1 && path_ == "method") {
+      method_.assign(chars.begin(), chars.end());
+      method_has_fields_ = binary_fields_->HasMethod(SpanFrom(method_));
+      return false;
+    }
+    static constexpr char kParamsPrefix[] = "params.";
+    static constexpr size_t kParamsPrefixSize = sizeof(kParamsPrefix) - 1;
+    if (!method_has_fields_ ||
+        path_.compare(0, kParamsPrefixSize, kParamsPrefix) != 0) {
+      return false;
+    }
+    span<uint8_t> path = SpanFrom(path_).subspan(kParamsPrefixSize);
+    if (!binary_fields_->Contains(SpanFrom(method_), path) ||
+        !Base64Decode(chars, &bytes_)) {
+      return false;
+    }
+    out_->HandleBinary(SpanFrom(bytes_));
+    return true;
+  }
+
+  const BinaryFieldTable* binary_fields_;
+  ParserHandler* out_;
+  std::vector<Container> stack_;
+  // The keys leading to the current value, separated by '.'.
+  std::string path_;
+  std::string method_;
+  bool method_has_fields_ = false;
+  std::vector<uint8_t> bytes_;
+};
+}  // namespace
+
 // =============================================================================
 // json::ConvertCBORToJSON, json::ConvertJSONToCBOR - for transcoding
 // =============================================================================
+namespace {
+// The number of decimal digits of |value|.
+size_t DecimalLength(uint64_t value) {
+  size_t length = 1;
+  for (; value >= 10; value /= 10)
+    ++length;
+  return length;
+}
+
+size_t IntegerLength(int64_t value) {
+  return value < 0 ? 1 + DecimalLength(0 - static_cast<uint64_t>(value))
+                   : DecimalLength(static_cast<uint64_t>(value));
+}
+
+// An upper bound for the characters which JSONEncoder emits for a double:
+// DToStr yields at most 17 significant digits, e.g. "-0.00000" followed by
+// these digits; integral values are emitted like int64_t values.
+constexpr size_t kMaxDoubleLength = 25;
+
+// An upper bound for the characters which JSONEncoder (with
+// JSONEncoding::STANDARD) emits for |chars| within a JSON string.
+size_t EscapedLength(span<uint8_t> chars) {
+  size_t length = 0;
+  for (size_t ii = 0; ii < chars.size(); ++ii) {
+    const size_t run = CountUnescaped(chars.data() + ii, chars.size() - ii);
+    length += run;
+    ii += run;
+    if (ii == chars.size())
+      break;
+    const uint8_t c = chars[ii];
+    if (c >= 0x80) {
+      // A UTF8 sequence of 2, 3 or 4 bytes becomes one or two \uXXXX
+      // escapes, that is, at most 3 characters per byte.
+      length += 3;
+    } else if (c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' ||
+               c == '\r' || c == '\t') {
+      length += 2;
+    } else {
+      length += 6;  // \u00XX
+    }
+  }
+  return length;
+}
+
+// Computes an upper bound for the size of the JSON that ConvertCBORToJSON
+// emits for |cbor|, in a single pass over its tokens which doesn't invoke
+// any handlers. It's exact unless |cbor| has doubles or strings which need
+// escaping. If |cbor| is invalid, it yields the size up to the error,
+// since the output is discarded anyway.
+size_t JSONSizeUpperBound(span<uint8_t> cbor) {
+  size_t size = 0;
+  // Whether the next item is the first within its map or array (or the
+  // top-level value), so that it's not preceded by a ',' or ':'.
+  bool first_item = true;
+  cbor::CBORTokenizer tokenizer(cbor);
+  for (;; tokenizer.Next()) {
+    switch (tokenizer.TokenTag()) {
+      case cbor::CBORTokenTag::DONE:
+      case cbor::CBORTokenTag::ERROR_VALUE:
+        return size;
+      case cbor::CBORTokenTag::ENVELOPE:
+        tokenizer.EnterEnvelope();
+        break;
+      default:
+        break;
+    }
+    if (tokenizer.TokenTag() == cbor::CBORTokenTag::STOP) {
+      size += 1;
+      first_item = false;
+      continue;
+    }
+    if (!first_item)
+      size += 1;
+    first_item = false;
+    switch (tokenizer.TokenTag()) {
+      case cbor::CBORTokenTag::MAP_START:
+      case cbor::CBORTokenTag::ARRAY_START:
+        size += 1;
+        first_item = true;
+        break;
+      case cbor::CBORTokenTag::TRUE_VALUE:
+        size += 4;
+        break;
+      case cbor::CBORTokenTag::FALSE_VALUE:
+        size += 5;
+        break;
+      case cbor::CBORTokenTag::NULL_VALUE:
+        size += 4;
+        break;
+      case cbor::CBORTokenTag::INT32:
+        size += IntegerLength(tokenizer.GetInt32());
+        break;
+      case cbor::CBORTokenTag::INT64:
+        size += IntegerLength(tokenizer.GetInt64());
+        break;
+      case cbor::CBORTokenTag::UINT64:
+      case cbor::CBORTokenTag::DOUBLE:
+        size += kMaxDoubleLength;
+        break;
+      case cbor::CBORTokenTag::STRING8:
+        size += 2 + EscapedLength(tokenizer.GetString8());
+        break;
+      case cbor::CBORTokenTag::STRING16: {
+        span<uint8_t> rep = tokenizer.GetString16WireRep();
+        size += 2;
+        for (size_t ii = 0; ii + 1 < rep.size(); ii += 2)
+          size += IsUnescaped((rep[ii + 1] << 8) | rep[ii]) ? 1 : 6;
+        break;
+      }
+      case cbor::CBORTokenTag::BINARY:
+        size += 2 + (tokenizer.GetBinary().size() + 2) / 3 * 4;
+        break;
+      default:
+        // ParseCBOR reports an error for these, e.g. for an envelope
+        // which doesn't wrap a map or array.
+        return size;
+    }
+  }
+}
+}  // namespace
+
 template <typename C>
 Status ConvertCBORToJSONTmpl(span<uint8_t> cbor, C* json) {
+  // Reserving the space upfront avoids reallocating and copying |json|
+  // while it grows, which for large messages costs as much as the encoding.
+  const size_t start = json->size();
+  const size_t size_bound = JSONSizeUpperBound(cbor);
+  json->reserve(start + size_bound);
   Status status;
   std::unique_ptr<ParserHandler> json_writer = NewJSONEncoder(json, &status);
   cbor::ParseCBOR(cbor, json_writer.get());
+  assert(!status.ok() || json->size() - start <= size_bound);
   return status;
 }
 
@@ -1012,20 +2184,49 @@ Status ConvertCBORToJSON(span<uint8_t> cbor, std::string* json) {
   return ConvertCBORToJSONTmpl(cbor, json);
 }
 
+Status ConvertCBORToJSON(span<uint8_t> cbor,
+                         size_t buffer_size,
+                         JSONFlushCallback flush) {
+  Status status;
+  std::unique_ptr<ParserHandler> json_writer =
+      NewJSONEncoder(buffer_size, std::move(flush), &status);
+  cbor::ParseCBOR(cbor, json_writer.get());
+  return status;
+}
+
 template <typename T>
-Status ConvertJSONToCBORTmpl(span<T> json, std::vector<uint8_t>* cbor) {
+Status ConvertJSONToCBORTmpl(span<T> json,
+                             const BinaryFieldTable* binary_fields,
+                             std::vector<uint8_t>* cbor) {
   Status status;
   std::unique_ptr<ParserHandler> encoder = cbor::NewCBOREncoder(cbor, &status);
-  ParseJSON(json, encoder.get());
+  if (!binary_fields) {
+    ParseJSON(json, encoder.get());
+    return status;
+  }
+  BinaryFieldDecoder decoder(binary_fields, encoder.get());
+  ParseJSON(json, &decoder);
   return status;
 }
 
 Status ConvertJSONToCBOR(span<uint8_t> json, std::vector<uint8_t>* cbor) {
-  return ConvertJSONToCBORTmpl(json, cbor);
+  return ConvertJSONToCBORTmpl(json, nullptr, cbor);
 }
 
 Status ConvertJSONToCBOR(span<uint16_t> json, std::vector<uint8_t>* cbor) {
-  return ConvertJSONToCBORTmpl(json, cbor);
+  return ConvertJSONToCBORTmpl(json, nullptr, cbor);
+}
+
+Status ConvertJSONToCBOR(span<uint8_t> json,
+                         const BinaryFieldTable& binary_fields,
+                         std::vector<uint8_t>* cbor) {
+  return ConvertJSONToCBORTmpl(json, &binary_fields, cbor);
+}
+
+Status ConvertJSONToCBOR(span<uint16_t> json,
+                         const BinaryFieldTable& binary_fields,
+                         std::vector<uint8_t>* cbor) {
+  return ConvertJSONToCBORTmpl(json, &binary_fields, cbor);
 }
 }  // namespace json
 }  // namespace crdtp
@@ -5,7 +5,9 @@
 #ifndef CRDTP_JSON_H_
 #define CRDTP_JSON_H_
 
+#include <functional>
 #include <memory>
+#include <utility>
 #include <vector>
 #include "export.h"
 #include "parser_handler.h"
@@ -16,7 +18,8 @@ namespace json {
 // json::NewJSONEncoder - for encoding streaming parser events as JSON
 // =============================================================================
 
-// Returns a handler object which will write ascii characters to |out|.
+// Returns a handler object which will write ascii characters to |out|
+// (see also JSONEncoding below).
 // |status->ok()| will be false iff the handler routine HandleError() is called.
 // In that case, we'll stop emitting output.
 // Except for calling the HandleError routine at any time, the client
@@ -29,14 +32,108 @@ CRDTP_EXPORT std::unique_ptr<ParserHandler> NewJSONEncoder(
 CRDTP_EXPORT std::unique_ptr<ParserHandler> NewJSONEncoder(std::string* out,
                                                            Status* status);
 
+// Determines how the JSON encoder emits non-ASCII characters.
+enum class JSONEncoding {
+  // As \uXXXX escapes, so that the output is US-ASCII. This is the default.
+  ASCII,
+  // As UTF8, which is more compact, in particular for non-Latin scripts.
+  // Control characters, quotes and backslashes are still escaped, and so
+  // are unpaired surrogates, overlong encodings and surrogates that were
+  // encoded as UTF8. Invalid UTF8 sequences are dropped, as for ASCII.
+  UTF8,
+};
+
+CRDTP_EXPORT std::unique_ptr<ParserHandler> NewJSONEncoder(
+    std::vector<uint8_t>* out,
+    Status* status,
+    JSONEncoding encoding);
+
+CRDTP_EXPORT std::unique_ptr<ParserHandler> NewJSONEncoder(
+    std::string* out,
+    Status* status,
+    JSONEncoding encoding);
+
+// Receives the output of the streaming JSON encoder below in chunks. The
+// bytes are only valid for the duration of the call.
+using JSONFlushCallback = std::function<void(span<uint8_t> chunk)>;
+
+// Returns a handler object which writes JSON into a buffer of |buffer_size|
+// bytes, and passes its contents to |flush| whenever it's full, when the
+// top-level map or array is complete, and when the handler is destroyed.
+// This bounds the memory used for large messages, and allows sending the
+// output before the encoding is complete. Since chunks can't be taken back,
+// the client must discard what it received if |status->ok()| is false.
+CRDTP_EXPORT std::unique_ptr<ParserHandler>
+NewJSONEncoder(size_t buffer_size, JSONFlushCallback flush, Status* status);
+
+CRDTP_EXPORT std::unique_ptr<ParserHandler> NewJSONEncoder(
+    size_t buffer_size,
+    JSONFlushCallback flush,
+    Status* status,
+    JSONEncoding encoding);
+
 // =============================================================================
 // json::ParseJSON - for receiving streaming parser events for JSON
 // =============================================================================
 
+// The nesting depth of maps and arrays beyond which the parsers report
+// Error::JSON_PARSER_STACK_LIMIT_EXCEEDED, unless another limit is provided.
+constexpr int kDefaultStackLimit = 300;
+
 CRDTP_EXPORT void ParseJSON(span<uint8_t> chars, ParserHandler* handler);
 
 CRDTP_EXPORT void ParseJSON(span<uint16_t> chars, ParserHandler* handler);
 
+// Like above, but limits the nesting depth to |stack_limit| rather than
+// kDefaultStackLimit. The parser keeps track of open maps and arrays on the
+// heap, so deeply nested messages don't use up the call stack.
+CRDTP_EXPORT void ParseJSON(span<uint8_t> chars,
+                            ParserHandler* handler,
+                            int stack_limit);
+
+CRDTP_EXPORT void ParseJSON(span<uint16_t> chars,
+                            ParserHandler* handler,
+                            int stack_limit);
+
+// =============================================================================
+// json::StreamingJSONParser - for parsing messages as they arrive in chunks
+// =============================================================================
+
+// Like ParseJSON, but the message is provided in chunks of arbitrary size
+// via ::Parse, e.g. as they're received from a socket, and the events for
+// each complete token are sent to |out| right away. Only the characters of
+// a token which is split across chunks are buffered. Errors and their
+// positions are the same as for ParseJSON, with positions counting from the
+// start of the first chunk.
+class CRDTP_EXPORT StreamingJSONParser {
+ public:
+  explicit StreamingJSONParser(ParserHandler* out,
+                               int stack_limit = kDefaultStackLimit);
+  ~StreamingJSONParser();
+
+  // Parses |chunk|, which continues the bytes from previous calls.
+  void Parse(span<uint8_t> chunk);
+
+  // Indicates that there are no more chunks. Sends an error to |out| if
+  // the message is incomplete.
+  void Finish();
+
+  // Error::OK unless an error was sent to |out|.
+  struct Status Status() const;
+
+  // True once the top-level value was parsed completely.
+  bool done() const;
+
+ private:
+  class Parser;
+  std::unique_ptr<Parser> parser_;
+  // Position of the next byte to be parsed, counting from the first chunk.
+  size_t pos_ = 0;
+  // The start of a token which is split across chunks, along with the
+  // bytes after it.
+  std::vector<uint8_t> pending_;
+};
+
 // =============================================================================
 // json::ConvertCBORToJSON, json::ConvertJSONToCBOR - for transcoding
 // =============================================================================
@@ -46,10 +143,57 @@ CRDTP_EXPORT Status ConvertCBORToJSON(span<uint8_t> cbor, std::string* json);
 CRDTP_EXPORT Status ConvertCBORToJSON(span<uint8_t> cbor,
                                       std::vector<uint8_t>* json);
 
+// Emits the JSON in chunks of at most |buffer_size| bytes via |flush|; see
+// NewJSONEncoder with a flush callback above.
+CRDTP_EXPORT Status ConvertCBORToJSON(span<uint8_t> cbor,
+                                      size_t buffer_size,
+                                      JSONFlushCallback flush);
+
+CRDTP_EXPORT Status ConvertJSONToCBOR(span<uint8_t> json,
+                                      std::vector<uint8_t>* cbor);
+
+CRDTP_EXPORT Status ConvertJSONToCBOR(span<uint16_t> json,
+                                      std::vector<uint8_t>* cbor);
+
+// =============================================================================
+// json::BinaryFieldTable - for decoding base64 when converting JSON to CBOR
+// =============================================================================
+
+// In JSON, values of the protocol type "binary" are base64 encoded strings.
+// This table identifies such fields in the params of commands, so that
+// ConvertJSONToCBOR (below) can decode them and emit CBOR byte strings,
+// which the bindings accept as well. The generated code populates it, see
+// Dispatcher::addBinaryFields in templates/TypeBuilder_cpp.template.
+class CRDTP_EXPORT BinaryFieldTable {
+ public:
+  // Registers a field within the "params" of the command named |method|,
+  // e.g. "Domain.command". |path| is the '.' separated sequence of keys
+  // from "params" to the field; arrays along the way are transparent.
+  // The spans must outlive the table; usually they're string literals.
+  void Add(span<uint8_t> method, span<uint8_t> path);
+
+  // Yields true iff fields were registered for |method|.
+  bool HasMethod(span<uint8_t> method) const;
+
+  // Yields true iff the field at |path| was registered for |method|.
+  bool Contains(span<uint8_t> method, span<uint8_t> path) const;
+
+ private:
+  // Sorted by method, then path.
+  std::vector<std::pair<span<uint8_t>, span<uint8_t>>> fields_;
+};
+
+// Like ConvertJSONToCBOR above, but strings at the fields in
+// |binary_fields| are base64 decoded and emitted as CBOR byte strings.
+// Since the conversion is streaming, this requires that "method" precedes
+// "params" in the message; otherwise, and for strings that aren't valid
+// base64, the strings are passed through as they are.
 CRDTP_EXPORT Status ConvertJSONToCBOR(span<uint8_t> json,
+                                      const BinaryFieldTable& binary_fields,
                                       std::vector<uint8_t>* cbor);
 
 CRDTP_EXPORT Status ConvertJSONToCBOR(span<uint16_t> json,
+                                      const BinaryFieldTable& binary_fields,
                                       std::vector<uint8_t>* cbor);
 }  // namespace json
 }  // namespace crdtp
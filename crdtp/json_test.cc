@@ -4,6 +4,7 @@
 
 #include "json.h"
 
+#include <algorithm>
 #include <array>
 #include <clocale>
 #include <cmath>
@@ -11,6 +12,7 @@
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <string>
 
@@ -142,6 +144,93 @@ TEST(JsonEncoder, Passes0x7FString16) {
       out);
 }
 
+TEST(JsonEncoder, EscapesWithinLongStrings) {
+  // Strings are scanned in blocks for characters that need escaping, so
+  // we place such characters at every position of a longer string.
+  struct TestCase {
+    std::vector<uint8_t> utf8;
+    uint16_t utf16;
+    std::string escaped;
+  };
+  std::vector<TestCase> tests = {
+      {{'"'}, '"', "\\\""},         {{'\\'}, '\\', "\\\\"},
+      {{'\n'}, '\n', "\\n"},        {{0x01}, 0x01, "\\u0001"},
+      {{0x7f}, 0x7f, "\x7f"},       {{0xc3, 0xa9}, 0xe9, "\\u00e9"},
+      {{0xe2, 0x98, 0xbe}, 0x263e, "\\u263e"},
+  };
+  for (const TestCase& test : tests) {
+    for (size_t pos = 0; pos < 40; ++pos) {
+      SCOPED_TRACE(testing::Message() << test.escaped << " at " << pos);
+      const std::string prefix(pos, 'a');
+      const std::string suffix(40 - pos, 'b');
+      const std::string expected = "\"" + prefix + test.escaped + suffix + "\"";
+
+      std::vector<uint8_t> utf8(prefix.begin(), prefix.end());
+      utf8.insert(utf8.end(), test.utf8.begin(), test.utf8.end());
+      utf8.insert(utf8.end(), suffix.begin(), suffix.end());
+      std::string out;
+      Status status;
+      NewJSONEncoder(&out, &status)->HandleString8(SpanFrom(utf8));
+      EXPECT_EQ(expected, out);
+
+      std::vector<uint16_t> utf16(prefix.begin(), prefix.end());
+      utf16.push_back(test.utf16);
+      utf16.insert(utf16.end(), suffix.begin(), suffix.end());
+      out.clear();
+      NewJSONEncoder(&out, &status)
+          ->HandleString16(span<uint16_t>(utf16.data(), utf16.size()));
+      EXPECT_EQ(expected, out);
+    }
+  }
+}
+
+TEST(JsonEncoder, UTF8OutputString8) {
+  std::string out;
+  Status status;
+  std::unique_ptr<ParserHandler> writer =
+      NewJSONEncoder(&out, &status, JSONEncoding::UTF8);
+  writer->HandleArrayBegin();
+  // Valid UTF8 is passed through, but quotes etc. are still escaped.
+  writer->HandleString8(SpanFrom("\"é ☾ 🌎 日本語\"\n"));
+  // Surrogates encoded as UTF8 and overlong encodings are escaped.
+  std::vector<uint8_t> odd = {0xed, 0xa0, 0xbd, ' ', 0xe0, 0x83, 0xa9};
+  writer->HandleString8(SpanFrom(odd));
+  // Invalid and incomplete sequences are dropped.
+  std::vector<uint8_t> invalid = {'a', 0xff, 'b', 0xc3, 'c', 0xe2, 0x98};
+  writer->HandleString8(SpanFrom(invalid));
+  writer->HandleArrayEnd();
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(
+      "[\"\\\"é ☾ 🌎 日本語\\\"\\n\",\"\\ud83d \\u00e9\",\"ab\"]", out);
+}
+
+TEST(JsonEncoder, UTF8OutputString16) {
+  std::string out;
+  Status status;
+  std::unique_ptr<ParserHandler> writer =
+      NewJSONEncoder(&out, &status, JSONEncoding::UTF8);
+  writer->HandleArrayBegin();
+  std::vector<uint16_t> chars = {'"',    0xe9,   ' ',    0x263e, ' ', 0xd83c,
+                                 0xdf0e, ' ',    0x65e5, '\t',   ' '};
+  writer->HandleString16(span<uint16_t>(chars.data(), chars.size()));
+  // Unpaired surrogates are escaped, since they can't be encoded as UTF8.
+  std::vector<uint16_t> unpaired = {0xdf0e, 'a', 0xd83c, 'b', 0xd83c};
+  writer->HandleString16(span<uint16_t>(unpaired.data(), unpaired.size()));
+  writer->HandleArrayEnd();
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ("[\"\\\"é ☾ 🌎 日\\t \",\"\\udf0ea\\ud83cb\\ud83c\"]", out);
+
+  // The output parses back to the same characters.
+  std::vector<uint8_t> cbor;
+  ASSERT_TRUE(ConvertJSONToCBOR(SpanFrom(out), &cbor).ok());
+  std::string roundtrip;
+  ASSERT_TRUE(ConvertCBORToJSON(SpanFrom(cbor), &roundtrip).ok());
+  EXPECT_EQ(
+      "[\"\\\"\\u00e9 \\u263e \\ud83c\\udf0e \\u65e5\\t \","
+      "\"\\udf0ea\\ud83cb\\ud83c\"]",
+      roundtrip);
+}
+
 TEST(JsonEncoder, IncompleteUtf8Sequence) {
   std::string out;
   Status status;
@@ -291,6 +380,36 @@ TEST(JsonStdStringWriterTest, BinaryEncodedAsJsonString) {
   }
 }
 
+TEST(JsonStdStringWriterTest, LongBinaryEncodedAsJsonString) {
+  // Long binaries are encoded in blocks, so we compare with a bit by bit
+  // encoding, for all byte values and various lengths.
+  const std::string alphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::vector<uint8_t> bytes;
+  for (int ii = 0; ii < 300; ++ii)
+    bytes.push_back(static_cast<uint8_t>(ii * 7));
+  for (size_t size : {0, 12, 13, 14, 24, 35, 255, 256, 300}) {
+    SCOPED_TRACE(size);
+    std::string expected = "\"";
+    for (size_t bit = 0; bit < size * 8; bit += 6) {
+      int value = 0;
+      for (size_t jj = bit; jj < bit + 6; ++jj) {
+        value <<= 1;
+        if (jj < size * 8)
+          value |= (bytes[jj / 8] >> (7 - jj % 8)) & 1;
+      }
+      expected += alphabet[value];
+    }
+    expected += std::string((3 - size % 3) % 3, '=') + "\"";
+    std::vector<uint8_t> out;
+    Status status;
+    std::unique_ptr<ParserHandler> writer = NewJSONEncoder(&out, &status);
+    writer->HandleBinary(span<uint8_t>(bytes.data(), size));
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(expected, std::string(out.begin(), out.end()));
+  }
+}
+
 TEST(JsonStdStringWriterTest, HandlesErrors) {
   // When an error is sent via HandleError, it saves it in the provided
   // status and clears the output.
@@ -316,6 +435,120 @@ TEST(JsonStdStringWriterTest, DoubleToString_LeadingZero) {
   EXPECT_EQ("[0.1,-0.7]", out);
 }
 
+TEST(JsonStdStringWriterTest, DoubleToString_ShortestRoundTrip) {
+  // Doubles are rendered with the fewest digits that parse back to the
+  // same value; like in JavaScript, very large and very small magnitudes
+  // use exponential notation.
+  std::string out;
+  Status status;
+  std::unique_ptr<ParserHandler> writer = NewJSONEncoder(&out, &status);
+  writer->HandleArrayBegin();
+  writer->HandleDouble(0.1 + 0.2);
+  writer->HandleDouble(2.0 / 3);
+  writer->HandleDouble(123456789.125);
+  writer->HandleDouble(1e-6);
+  writer->HandleDouble(-1e-7);
+  writer->HandleDouble(1.5e300);
+  writer->HandleDouble(5e-324);
+  writer->HandleDouble(std::numeric_limits<double>::max());
+  writer->HandleArrayEnd();
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(
+      "[0.30000000000000004,0.6666666666666666,123456789.125,0.000001,"
+      "-1e-7,1.5e+300,5e-324,1.7976931348623157e+308]",
+      out);
+
+  // Each of these parses back to the exact same double.
+  std::vector<uint8_t> cbor;
+  std::unique_ptr<ParserHandler> encoder =
+      cbor::NewCBOREncoder(&cbor, &status);
+  ParseJSON(SpanFrom(out), encoder.get());
+  EXPECT_TRUE(status.ok());
+  cbor::CBORTokenizer tokenizer(SpanFrom(cbor));
+  tokenizer.EnterEnvelope();
+  tokenizer.Next();
+  for (double expected : {0.1 + 0.2, 2.0 / 3, 123456789.125, 1e-6, -1e-7,
+                          1.5e300, 5e-324,
+                          std::numeric_limits<double>::max()}) {
+    ASSERT_EQ(cbor::CBORTokenTag::DOUBLE, tokenizer.TokenTag());
+    EXPECT_EQ(expected, tokenizer.GetDouble());
+    tokenizer.Next();
+  }
+}
+
+// =============================================================================
+// json::NewJSONEncoder with a flush callback - for streaming JSON output
+// =============================================================================
+
+TEST(JsonFlushingEncoderTest, FlushesFullBuffers) {
+  std::vector<std::string> chunks;
+  Status status;
+  std::unique_ptr<ParserHandler> writer = NewJSONEncoder(
+      7,
+      [&chunks](span<uint8_t> chunk) {
+        chunks.emplace_back(chunk.begin(), chunk.end());
+      },
+      &status);
+  writer->HandleMapBegin();
+  writer->HandleString8(SpanFrom("message"));
+  writer->HandleString8(SpanFrom("Hello, \"world\".\n"));
+  writer->HandleString8(SpanFrom("data"));
+  writer->HandleBinary(SpanFrom(std::vector<uint8_t>(1000, 'x')));
+  writer->HandleString8(SpanFrom("id"));
+  writer->HandleInt32(42);
+  EXPECT_FALSE(chunks.empty());
+  writer->HandleMapEnd();
+  // The remainder is flushed once the map is complete.
+  std::string json;
+  for (const std::string& chunk : chunks) {
+    EXPECT_LE(chunk.size(), 7u);
+    json += chunk;
+  }
+  EXPECT_TRUE(status.ok());
+  std::string expected;
+  std::unique_ptr<ParserHandler> expected_writer =
+      NewJSONEncoder(&expected, &status);
+  expected_writer->HandleMapBegin();
+  expected_writer->HandleString8(SpanFrom("message"));
+  expected_writer->HandleString8(SpanFrom("Hello, \"world\".\n"));
+  expected_writer->HandleString8(SpanFrom("data"));
+  expected_writer->HandleBinary(SpanFrom(std::vector<uint8_t>(1000, 'x')));
+  expected_writer->HandleString8(SpanFrom("id"));
+  expected_writer->HandleInt32(42);
+  expected_writer->HandleMapEnd();
+  EXPECT_EQ(expected, json);
+}
+
+TEST(JsonFlushingEncoderTest, ConvertCBORToJSON) {
+  std::string json_in =
+      "{\"msg\":\"Hello, world.\",\"lst\":[1,2,3],\"pi\":3.1415}";
+  std::vector<uint8_t> cbor;
+  ASSERT_THAT(ConvertJSONToCBOR(SpanFrom(json_in), &cbor), StatusIsOk());
+  for (size_t buffer_size : {1, 5, 1000}) {
+    SCOPED_TRACE(buffer_size);
+    std::string json;
+    int flushes = 0;
+    Status status = ConvertCBORToJSON(SpanFrom(cbor), buffer_size,
+                                      [&](span<uint8_t> chunk) {
+                                        ++flushes;
+                                        json.append(chunk.begin(),
+                                                    chunk.end());
+                                      });
+    EXPECT_THAT(status, StatusIsOk());
+    EXPECT_EQ(json_in, json);
+    EXPECT_EQ((json_in.size() + buffer_size - 1) / buffer_size,
+              static_cast<size_t>(flushes));
+  }
+  // Upon errors, the buffered output is discarded; the status tells the
+  // client to discard what was flushed already.
+  std::string json;
+  Status status = ConvertCBORToJSON(
+      span<uint8_t>(cbor.data(), cbor.size() - 1), 4,
+      [&](span<uint8_t> chunk) { json.append(chunk.begin(), chunk.end()); });
+  EXPECT_FALSE(status.ok());
+  EXPECT_LT(json.size(), json_in.size());
+}
+
 // =============================================================================
 // json::ParseJSON - for receiving streaming parser events for JSON
 // =============================================================================
@@ -351,6 +584,10 @@ class Log : public ParserHandler {
 
   void HandleInt32(int32_t value) override { log_ << "int: " << value << "\n"; }
 
+  void HandleInt64(int64_t value) override {
+    log_ << "int64: " << value << "\n";
+  }
+
   void HandleBool(bool value) override { log_ << "bool: " << value << "\n"; }
 
   void HandleNull() override { log_ << "null\n"; }
@@ -382,7 +619,7 @@ TEST_F(JsonParserTest, SimpleDictionary) {
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: foo\n"
+      "string8: foo\n"
       "int: 42\n"
       "map end\n",
       log_.str());
@@ -398,8 +635,8 @@ TEST_F(JsonParserTest, UsAsciiDelCornerCase) {
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: foo\n"
-      "string16: a\x7f\n"
+      "string8: foo\n"
+      "string8: a\x7f\n"
       "map end\n",
       log_.str());
 
@@ -417,26 +654,56 @@ TEST_F(JsonParserTest, Whitespace) {
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: msg\n"
-      "string16: Hello, world.\n"
+      "string8: msg\n"
+      "string8: Hello, world.\n"
       "map end\n",
       log_.str());
 }
 
+TEST_F(JsonParserTest, LongStringsAndWhitespace) {
+  // Runs of string contents and whitespace are scanned in blocks, so we
+  // place escapes and the closing quote at various positions.
+  for (size_t pos = 0; pos < 40; ++pos) {
+    SCOPED_TRACE(pos);
+    const std::string text(pos, 'x');
+    const std::string indent(pos, ' ');
+    std::string json = indent + "[\n" + indent + "\t\"" + text + "\\\"" +
+                       text + "\"\r\n" + indent + ",\"" + text + "\"" +
+                       indent + "]" + indent;
+    Log log;
+    ParseJSON(SpanFrom(json), &log);
+    EXPECT_TRUE(log.status().ok());
+    EXPECT_EQ("array begin\nstring8: " + text + "\"" + text +
+                  "\nstring8: " + text + "\narray end\n",
+              log.str());
+
+    std::vector<uint16_t> json16(json.begin(), json.end());
+    Log log16;
+    ParseJSON(span<uint16_t>(json16.data(), json16.size()), &log16);
+    EXPECT_EQ("array begin\nstring16: " + text + "\"" + text +
+                  "\nstring16: " + text + "\narray end\n",
+              log16.str());
+  }
+  // An unterminated string, with the backslash in the last block.
+  std::string json = "\"" + std::string(31, 'x') + "\\";
+  ParseJSON(SpanFrom(json), &log_);
+  EXPECT_THAT(log_.status(), StatusIs(Error::JSON_PARSER_INVALID_TOKEN, 0u));
+}
+
 TEST_F(JsonParserTest, NestedDictionary) {
   std::string json = "{\"foo\": {\"bar\": {\"baz\": 1}, \"bar2\": 2}}";
   ParseJSON(SpanFrom(json), &log_);
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: foo\n"
+      "string8: foo\n"
       "map begin\n"
-      "string16: bar\n"
+      "string8: bar\n"
       "map begin\n"
-      "string16: baz\n"
+      "string8: baz\n"
       "int: 1\n"
       "map end\n"
-      "string16: bar2\n"
+      "string8: bar2\n"
       "int: 2\n"
       "map end\n"
       "map end\n",
@@ -449,14 +716,80 @@ TEST_F(JsonParserTest, Doubles) {
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: foo\n"
+      "string8: foo\n"
       "double: 3.1415\n"
-      "string16: bar\n"
+      "string8: bar\n"
       "double: 3.1415\n"
       "map end\n",
       log_.str());
 }
 
+TEST_F(JsonParserTest, DoublesAreRoundedCorrectly) {
+  // Inputs which are close to halfway between two doubles, subnormals,
+  // and more significant digits than fit into 64 bits. The expected
+  // values are converted by the compiler.
+  std::string json =
+      "[1e23, 8.98846567431158e307, 2.2250738585072011e-308, 4.9e-324, "
+      "0.1000000000000000055511151231257827021181583404541015625, "
+      "1.7976931348623157e308, 7.2057594037927933e16, 3.0e-22, -5.5e-5]";
+  std::vector<uint8_t> cbor;
+  Status status;
+  std::unique_ptr<ParserHandler> encoder =
+      cbor::NewCBOREncoder(&cbor, &status);
+  ParseJSON(SpanFrom(json), encoder.get());
+  EXPECT_TRUE(status.ok());
+  cbor::CBORTokenizer tokenizer(SpanFrom(cbor));
+  tokenizer.EnterEnvelope();
+  tokenizer.Next();
+  for (double expected :
+       {1e23, 8.98846567431158e307, 2.2250738585072011e-308, 4.9e-324,
+        0.1000000000000000055511151231257827021181583404541015625,
+        1.7976931348623157e308, 7.2057594037927933e16, 3.0e-22, -5.5e-5}) {
+    ASSERT_EQ(cbor::CBORTokenTag::DOUBLE, tokenizer.TokenTag());
+    EXPECT_EQ(expected, tokenizer.GetDouble());
+    tokenizer.Next();
+  }
+}
+
+TEST_F(JsonParserTest, Int64) {
+  // Integers outside of the int32 range are delivered via HandleInt64,
+  // so that they don't lose precision; beyond the int64 range, we fall
+  // back to doubles.
+  std::string json =
+      "[2147483647, 2147483648, -9223372036854775808, 9223372036854775807, "
+      "9223372036854775808]";
+  ParseJSON(SpanFrom(json), &log_);
+  EXPECT_TRUE(log_.status().ok());
+  EXPECT_EQ(
+      "array begin\n"
+      "int: 2147483647\n"
+      "int64: 2147483648\n"
+      "int64: -9223372036854775808\n"
+      "int64: 9223372036854775807\n"
+      "double: 9.22337e+18\n"
+      "array end\n",
+      log_.str());
+}
+
+TEST_F(JsonParserTest, IntegersAndLongNumbers) {
+  // Integers are converted without going through StrToD, other numbers
+  // which happen to be integral still arrive via HandleInt32.
+  std::string json = "[0, -0, -2147483648, 1.0, 1e2, 0." +
+                     std::string(80, '0') + "5e81]";
+  ParseJSON(SpanFrom(json), &log_);
+  EXPECT_TRUE(log_.status().ok());
+  EXPECT_EQ(
+      "array begin\n"
+      "int: 0\n"
+      "int: 0\n"
+      "int: -2147483648\n"
+      "int: 1\n"
+      "int: 100\n"
+      "int: 5\n"
+      "array end\n",
+      log_.str());
+}
+
 TEST_F(JsonParserTest, Unicode) {
   // Globe character. 0xF0 0x9F 0x8C 0x8E in utf8, 0xD83C 0xDF0E in utf16.
   std::string json = "{\"msg\": \"Hello, \\uD83C\\uDF0E.\"}";
@@ -464,8 +797,8 @@ TEST_F(JsonParserTest, Unicode) {
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: msg\n"
-      "string16: Hello, 🌎.\n"
+      "string8: msg\n"
+      "string8: Hello, 🌎.\n"
       "map end\n",
       log_.str());
 }
@@ -501,16 +834,19 @@ TEST_F(JsonParserTest, Unicode_ParseUtf16_SingleEscapeUpToFFFF) {
   // Shows both inputs result in equivalent output once converted to UTF-8.
   EXPECT_EQ(
       "map begin\n"
-      "string16: escape\n"
-      "string16: \xEF\xBF\xBF or \xEF\xBF\xBF\n"
+      "string8: escape\n"
+      "string8: \xEF\xBF\xBF or \xEF\xBF\xBF\n"
       "map end\n",
       log_.str());
 
-  // Make an even stronger assertion: The parser represents \xffff as a single
-  // UTF-16 char.
-  ASSERT_EQ(2u, log_.raw_log_string16().size());
+  // Make an even stronger assertion: For UTF-16 input, the parser
+  // represents \xffff as a single UTF-16 char.
+  std::vector<uint16_t> json16 = UTF8ToUTF16(SpanFrom(json));
+  Log log16;
+  ParseJSON(span<uint16_t>(json16.data(), json16.size()), &log16);
+  ASSERT_EQ(2u, log16.raw_log_string16().size());
   std::vector<uint16_t> expected = {0xffff, ' ', 'o', 'r', ' ', 0xffff};
-  EXPECT_EQ(expected, log_.raw_log_string16()[1]);
+  EXPECT_EQ(expected, log16.raw_log_string16()[1]);
 }
 
 TEST_F(JsonParserTest, Unicode_ParseUtf8) {
@@ -533,18 +869,51 @@ TEST_F(JsonParserTest, Unicode_ParseUtf8) {
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: escapes\n"
-      "string16: 🌙\n"
-      "string16: 2 byte\n"
-      "string16: гласность\n"
-      "string16: 3 byte\n"
-      "string16: 屋\n"
-      "string16: 4 byte\n"
-      "string16: 🌎\n"
+      "string8: escapes\n"
+      "string8: 🌙\n"
+      "string8: 2 byte\n"
+      "string8: гласность\n"
+      "string8: 3 byte\n"
+      "string8: 屋\n"
+      "string8: 4 byte\n"
+      "string8: 🌎\n"
       "map end\n",
       log_.str());
 }
 
+TEST_F(JsonParserTest, StringsWithoutEscapesAreNotCopied) {
+  // For UTF8 input, string literals without escapes are passed to the
+  // handler as spans into the input. Escapes are decoded, and unless
+  // there's an unpaired surrogate, the result is delivered as UTF8, too.
+  struct Handler : public Log {
+    void HandleString8(span<uint8_t> chars) override {
+      spans.push_back(chars);
+      Log::HandleString8(chars);
+    }
+    std::vector<span<uint8_t>> spans;
+  } handler;
+  std::string json = "{\"plain\": \"\xd0\xb3\", \"esc\\naped\": \"\\ud800\"}";
+  ParseJSON(SpanFrom(json), &handler);
+  EXPECT_TRUE(handler.status().ok());
+  EXPECT_EQ(
+      "map begin\n"
+      "string8: plain\n"
+      "string8: \xd0\xb3\n"
+      "string8: esc\naped\n"
+      "string16: \n"  // UTF16ToUTF8 drops the unpaired surrogate.
+      "map end\n",
+      handler.str());
+  ASSERT_EQ(3u, handler.spans.size());
+  EXPECT_EQ(json.data() + 2,
+            reinterpret_cast<const char*>(handler.spans[0].data()));
+  EXPECT_EQ(json.data() + 11,
+            reinterpret_cast<const char*>(handler.spans[1].data()));
+  EXPECT_NE(json.data() + 17,
+            reinterpret_cast<const char*>(handler.spans[2].data()));
+  std::vector<std::vector<uint16_t>> expected = {{0xd800}};
+  EXPECT_EQ(expected, handler.raw_log_string16());
+}
+
 TEST_F(JsonParserTest, UnprocessedInputRemainsError) {
   // Trailing junk after the valid JSON.
   std::string json = "{\"foo\": 3.1415} junk";
@@ -567,18 +936,18 @@ std::string MakeNestedJson(int depth) {
 }
 
 TEST_F(JsonParserTest, StackLimitExceededError_BelowLimit) {
-  // kStackLimit is 300 (see json_parser.cc). First let's
+  // kDefaultStackLimit is 300 (see json.h). First let's
   // try with a small nested example.
   std::string json_3 = MakeNestedJson(3);
   ParseJSON(SpanFrom(json_3), &log_);
   EXPECT_TRUE(log_.status().ok());
   EXPECT_EQ(
       "map begin\n"
-      "string16: foo\n"
+      "string8: foo\n"
       "map begin\n"
-      "string16: foo\n"
+      "string8: foo\n"
       "map begin\n"
-      "string16: foo\n"
+      "string8: foo\n"
       "int: 42\n"
       "map end\n"
       "map end\n"
@@ -587,7 +956,7 @@ TEST_F(JsonParserTest, StackLimitExceededError_BelowLimit) {
 }
 
 TEST_F(JsonParserTest, StackLimitExceededError_AtLimit) {
-  // Now with kStackLimit (300).
+  // Now with kDefaultStackLimit (300).
   std::string json_limit = MakeNestedJson(300);
   ParseJSON(span<uint8_t>(reinterpret_cast<const uint8_t*>(json_limit.data()),
                           json_limit.size()),
@@ -596,7 +965,8 @@ TEST_F(JsonParserTest, StackLimitExceededError_AtLimit) {
 }
 
 TEST_F(JsonParserTest, StackLimitExceededError_AboveLimit) {
-  // Now with kStackLimit + 1 (301) - it exceeds in the innermost instance.
+  // Now with kDefaultStackLimit + 1 (301) - it exceeds in the innermost
+  // instance.
   std::string exceeded = MakeNestedJson(301);
   ParseJSON(SpanFrom(exceeded), &log_);
   EXPECT_THAT(log_.status(), StatusIs(Error::JSON_PARSER_STACK_LIMIT_EXCEEDED,
@@ -611,6 +981,21 @@ TEST_F(JsonParserTest, StackLimitExceededError_WayAboveLimit) {
                                       strlen("{\"foo\":") * 301));
 }
 
+TEST_F(JsonParserTest, StackLimitExceededError_ConfiguredLimit) {
+  std::string json = MakeNestedJson(11);
+  ParseJSON(SpanFrom(json), &log_, /*stack_limit=*/10);
+  EXPECT_THAT(log_.status(), StatusIs(Error::JSON_PARSER_STACK_LIMIT_EXCEEDED,
+                                      strlen("{\"foo\":") * 11));
+}
+
+TEST_F(JsonParserTest, DeepNestingWithinConfiguredLimit) {
+  // Since the parser doesn't recurse, this doesn't exhaust the call stack.
+  const int depth = 100000;
+  std::string json = std::string(depth, '[') + std::string(depth, ']');
+  ParseJSON(SpanFrom(json), &log_, /*stack_limit=*/depth);
+  EXPECT_THAT(log_.status(), StatusIsOk());
+}
+
 TEST_F(JsonParserTest, NoInputError) {
   std::string json = "";
   ParseJSON(SpanFrom(json), &log_);
@@ -697,6 +1082,115 @@ TEST_F(JsonParserTest, ValueExpectedError) {
   EXPECT_EQ("", log_.str());
 }
 
+// =============================================================================
+// json::StreamingJSONParser - for parsing messages as they arrive in chunks
+// =============================================================================
+
+// Parses |json| in three chunks, split at |first| and |second|.
+void ParseInChunks(const std::string& json,
+                   size_t first,
+                   size_t second,
+                   Log* log) {
+  StreamingJSONParser parser(log);
+  parser.Parse(SpanFrom(json).subspan(0, first));
+  parser.Parse(SpanFrom(json).subspan(first, second - first));
+  parser.Parse(SpanFrom(json).subspan(second));
+  parser.Finish();
+  EXPECT_EQ(log->status().ok(), parser.Status().ok());
+}
+
+TEST(StreamingJSONParserTest, SplitsAtAnyPosition) {
+  std::string json =
+      "  /* c */ {\"foo\" : [1, -23.5e2, 12345678901 , true,false,null],\n"
+      "\"b\\u00e9ar\": {\"\": \"x\\ny\"}, // comment\n"
+      "\"\xc3\xa9\":[[],{}]}  ";
+  Log expected;
+  ParseJSON(SpanFrom(json), &expected);
+  ASSERT_THAT(expected.status(), StatusIsOk());
+  for (size_t first = 0; first <= json.size(); ++first) {
+    for (size_t second = first; second <= json.size(); ++second) {
+      SCOPED_TRACE(first);
+      SCOPED_TRACE(second);
+      Log log;
+      ParseInChunks(json, first, second, &log);
+      EXPECT_THAT(log.status(), StatusIsOk());
+      EXPECT_EQ(expected.str(), log.str());
+    }
+  }
+}
+
+TEST(StreamingJSONParserTest, ErrorsMatchParseJSON) {
+  for (const char* input : {
+           "",
+           "  ",
+           "[1, 2",
+           "{\"foo\": 42, }",
+           "{\"foo\" 42}",
+           "{\"foo\": 3.1415: \"bar\": 0}",
+           "[1, 2 3]",
+           "[1, ]",
+           "{1: 2}",
+           "\"unterminated",
+           "tru",
+           "1.",
+           "01",
+           "@",
+           "{} {}",
+           "{} /* unterminated",
+           "{} /* terminated */",
+           "[1] 2",
+           "1 2",
+       }) {
+    const std::string json = input;
+    SCOPED_TRACE(json);
+    Log expected;
+    ParseJSON(SpanFrom(json), &expected);
+    for (size_t first = 0; first <= json.size(); ++first) {
+      SCOPED_TRACE(first);
+      Log log;
+      ParseInChunks(json, first, json.size(), &log);
+      EXPECT_EQ(expected.status().error, log.status().error);
+      EXPECT_EQ(expected.status().pos, log.status().pos);
+      EXPECT_EQ(expected.str(), log.str());
+    }
+  }
+}
+
+TEST(StreamingJSONParserTest, ByteAtATime) {
+  std::string json = "{\"msg\": \"" + std::string(1000, 'x') + "\"}";
+  Log log;
+  StreamingJSONParser parser(&log);
+  for (size_t ii = 0; ii < json.size(); ++ii) {
+    EXPECT_FALSE(parser.done());
+    parser.Parse(SpanFrom(json).subspan(ii, 1));
+  }
+  // The map is complete as soon as its end arrives.
+  EXPECT_TRUE(parser.done());
+  parser.Finish();
+  EXPECT_THAT(parser.Status(), StatusIsOk());
+  EXPECT_EQ("map begin\nstring8: msg\nstring8: " + std::string(1000, 'x') +
+                "\nmap end\n",
+            log.str());
+}
+
+TEST(StreamingJSONParserTest, StackLimitExceeded) {
+  std::string json = std::string(1000, '[') + std::string(1000, ']');
+  Log expected;
+  ParseJSON(SpanFrom(json), &expected);
+  Log log;
+  StreamingJSONParser parser(&log);
+  parser.Parse(SpanFrom(json).subspan(0, 150));
+  parser.Parse(SpanFrom(json).subspan(150));
+  parser.Finish();
+  EXPECT_THAT(log.status(),
+              StatusIs(Error::JSON_PARSER_STACK_LIMIT_EXCEEDED,
+                       expected.status().pos));
+}
+
+// =============================================================================
+// json::ConvertCBORToJSON, json::ConvertJSONToCBOR - for transcoding
+// =============================================================================
+
 template <typename T>
 class ConvertJSONToCBORTest : public ::testing::Test {};
 
@@ -712,6 +1206,7 @@ TYPED_TEST(ConvertJSONToCBORTest, RoundTripValidJson) {
            "\"Hello, world.\"",
            "[1,2,3]",
            "[]",
+           "[12345678901,-9007199254740993]",
        }) {
     SCOPED_TRACE(json_in);
     TypeParam json(json_in.begin(), json_in.end());
@@ -749,5 +1244,188 @@ TYPED_TEST(ConvertJSONToCBORTest, RoundTripValidJson16) {
   TypeParam expected_json(json.begin(), json.end());
   EXPECT_EQ(expected_json, roundtrip_json);
 }
+
+TYPED_TEST(ConvertJSONToCBORTest, ReservesOutputUpfront) {
+  // ConvertCBORToJSON reserves an upper bound for the output size, which
+  // it asserts in debug builds; these values exercise the bound for each
+  // kind of token, including those for which it isn't exact.
+  std::vector<uint8_t> cbor;
+  Status status;
+  std::unique_ptr<ParserHandler> encoder =
+      cbor::NewCBOREncoder(&cbor, &status);
+  encoder->HandleMapBegin();
+  encoder->HandleString8(SpanFrom("strings"));
+  encoder->HandleArrayBegin();
+  encoder->HandleString8(SpanFrom("plain"));
+  encoder->HandleString8(SpanFrom("\"\\\b\f\n\r\t\x01\x1f"));
+  // Non-ASCII characters, including an invalid byte.
+  encoder->HandleString8(
+      SpanFrom("\xc3\xa9\xe2\x82\xac\xf0\x9f\x8c\x8e\xff"));
+  std::vector<uint16_t> string16 = {'a', 0xe9, 0xd83c, 0xdf0e, 0xd800, 1};
+  encoder->HandleString16(span<uint16_t>(string16.data(), string16.size()));
+  encoder->HandleBinary(SpanFrom("binary"));
+  encoder->HandleArrayEnd();
+  encoder->HandleString8(SpanFrom("numbers"));
+  encoder->HandleArrayBegin();
+  encoder->HandleInt32(std::numeric_limits<int32_t>::min());
+  encoder->HandleInt64(std::numeric_limits<int64_t>::min());
+  encoder->HandleInt64(std::numeric_limits<int64_t>::max());
+  for (double value : {-0.0000012345678901234567, -1.7976931348623157e308,
+                       -5e-324, -123456789012345678901.0, 1e300, 0.5,
+                       -9007199254740993.0, std::nan("")}) {
+    encoder->HandleDouble(value);
+  }
+  encoder->HandleBool(true);
+  encoder->HandleBool(false);
+  encoder->HandleNull();
+  encoder->HandleArrayEnd();
+  encoder->HandleString8(SpanFrom("empty"));
+  encoder->HandleArrayBegin();
+  encoder->HandleMapBegin();
+  encoder->HandleMapEnd();
+  encoder->HandleArrayBegin();
+  encoder->HandleArrayEnd();
+  encoder->HandleArrayEnd();
+  encoder->HandleMapEnd();
+  ASSERT_THAT(status, StatusIsOk());
+
+  TypeParam json;
+  EXPECT_THAT(ConvertCBORToJSON(SpanFrom(cbor), &json), StatusIsOk());
+  std::string expected;
+  std::unique_ptr<ParserHandler> writer = NewJSONEncoder(&expected, &status);
+  cbor::ParseCBOR(SpanFrom(cbor), writer.get());
+  EXPECT_EQ(TypeParam(expected.begin(), expected.end()), json);
+}
+
+// =============================================================================
+// json::BinaryFieldTable - for decoding base64 when converting JSON to CBOR
+// =============================================================================
+
+TEST(BinaryFieldTableTest, Lookup) {
+  BinaryFieldTable table;
+  table.Add(SpanFrom("Page.upload"), SpanFrom("files.content"));
+  table.Add(SpanFrom("IO.write"), SpanFrom("data"));
+  table.Add(SpanFrom("Page.upload"), SpanFrom("data"));
+  EXPECT_TRUE(table.HasMethod(SpanFrom("IO.write")));
+  EXPECT_TRUE(table.HasMethod(SpanFrom("Page.upload")));
+  EXPECT_FALSE(table.HasMethod(SpanFrom("Page.uploa")));
+  EXPECT_FALSE(table.HasMethod(SpanFrom("Page.uploads")));
+  EXPECT_TRUE(table.Contains(SpanFrom("Page.upload"), SpanFrom("data")));
+  EXPECT_TRUE(
+      table.Contains(SpanFrom("Page.upload"), SpanFrom("files.content")));
+  EXPECT_FALSE(table.Contains(SpanFrom("Page.upload"), SpanFrom("files")));
+  EXPECT_FALSE(table.Contains(SpanFrom("IO.write"), SpanFrom("content")));
+}
+
+// Yields the JSON string for |bytes|, as the JSON encoder emits it.
+std::string Base64String(const std::vector<uint8_t>& bytes) {
+  std::string json;
+  Status status;
+  NewJSONEncoder(&json, &status)->HandleBinary(SpanFrom(bytes));
+  return json;
+}
+
+bool ContainsBinary(const std::vector<uint8_t>& cbor,
+                    const std::vector<uint8_t>& bytes) {
+  std::vector<uint8_t> encoded;
+  cbor::EncodeBinary(SpanFrom(bytes), &encoded);
+  return std::search(cbor.begin(), cbor.end(), encoded.begin(),
+                     encoded.end()) != cbor.end();
+}
+
+TEST(ConvertJSONToCBORWithBinaryFieldsTest, DecodesBase64AtAllLengths) {
+  BinaryFieldTable table;
+  table.Add(SpanFrom("IO.write"), SpanFrom("data"));
+  std::vector<uint8_t> bytes;
+  for (size_t size = 0; size < 80; ++size) {
+    SCOPED_TRACE(size);
+    std::string json =
+        "{\"id\":1,\"method\":\"IO.write\",\"params\":{\"data\":" +
+        Base64String(bytes) + "}}";
+    std::vector<uint8_t> cbor;
+    EXPECT_THAT(ConvertJSONToCBOR(SpanFrom(json), table, &cbor),
+                StatusIsOk());
+    EXPECT_TRUE(ContainsBinary(cbor, bytes));
+    // Converting back yields the same JSON, since the JSON encoder emits
+    // binaries as base64.
+    std::string roundtrip_json;
+    EXPECT_THAT(ConvertCBORToJSON(SpanFrom(cbor), &roundtrip_json),
+                StatusIsOk());
+    EXPECT_EQ(json, roundtrip_json);
+
+    std::vector<uint16_t> json16(json.begin(), json.end());
+    std::vector<uint8_t> cbor16;
+    EXPECT_THAT(ConvertJSONToCBOR(span<uint16_t>(json16.data(), json16.size()),
+                                  table, &cbor16),
+                StatusIsOk());
+    EXPECT_EQ(cbor, cbor16);
+    bytes.push_back(static_cast<uint8_t>(size * 37 + 11));
+  }
+}
+
+TEST(ConvertJSONToCBORWithBinaryFieldsTest, LeavesInvalidBase64) {
+  BinaryFieldTable table;
+  table.Add(SpanFrom("IO.write"), SpanFrom("data"));
+  for (const char* base64 : {
+           "eHl", "eHl6=", "eH=6", "=Hl6", "eHl6eHl6eHl6eHl6eHl6eH*6",
+           "eHl6eHl6eHl6eHl\xc3\xa9" "eHl6eHl6", "eHl6eHl6eHl6eHl6eHl6eHl6====",
+       }) {
+    SCOPED_TRACE(base64);
+    std::string json = "{\"method\":\"IO.write\",\"params\":{\"data\":\"";
+    json += base64;
+    json += "\"}}";
+    std::vector<uint8_t> cbor;
+    EXPECT_THAT(ConvertJSONToCBOR(SpanFrom(json), table, &cbor),
+                StatusIsOk());
+    std::string cbor_str(cbor.begin(), cbor.end());
+    EXPECT_NE(std::string::npos, cbor_str.find(base64));
+  }
+  // Escapes are decoded before the base64.
+  std::string json =
+      "{\"method\":\"IO.write\",\"params\":{\"data\":\"e\\u0048l6\"}}";
+  std::vector<uint8_t> cbor;
+  EXPECT_THAT(ConvertJSONToCBOR(SpanFrom(json), table, &cbor), StatusIsOk());
+  EXPECT_TRUE(ContainsBinary(cbor, {'x', 'y', 'z'}));
+}
+
+TEST(ConvertJSONToCBORWithBinaryFieldsTest, OnlyDecodesRegisteredFields) {
+  BinaryFieldTable table;
+  table.Add(SpanFrom("Page.upload"), SpanFrom("data"));
+  table.Add(SpanFrom("Page.upload"), SpanFrom("files.content"));
+  const std::vector<uint8_t> abc = {'a', 'b', 'c'};
+  const std::vector<uint8_t> xyz = {'x', 'y', 'z'};
+  std::string json =
+      "{\"method\":\"Page.upload\",\"params\":{"
+      "\"name\":\"YWJj\",\"data\":\"eHl6\","
+      "\"files\":[{\"name\":\"YWJj\",\"content\":\"YWJj\"},"
+      "{\"content\":\"not base64\"}]}}";
+  std::vector<uint8_t> cbor;
+  EXPECT_THAT(ConvertJSONToCBOR(SpanFrom(json), table, &cbor), StatusIsOk());
+  EXPECT_TRUE(ContainsBinary(cbor, xyz));
+  EXPECT_TRUE(ContainsBinary(cbor, abc));
+  // "name" is passed through as a string, twice, and so is the invalid
+  // "content".
+  std::string cbor_str(cbor.begin(), cbor.end());
+  EXPECT_NE(std::string::npos, cbor_str.find("YWJj"));
+  EXPECT_NE(std::string::npos,
+            cbor_str.find("YWJj", cbor_str.find("YWJj") + 1));
+  EXPECT_NE(std::string::npos, cbor_str.find("not base64"));
+  EXPECT_EQ(std::string::npos,
+            cbor_str.find("YWJj", cbor_str.find("content")));
+
+  // Without a method, or if the method follows the params, nothing is
+  // decoded.
+  for (const char* json : {
+           "{\"params\":{\"data\":\"eHl6\"}}",
+           "{\"params\":{\"data\":\"eHl6\"},\"method\":\"Page.upload\"}",
+           "{\"method\":\"Page.reload\",\"params\":{\"data\":\"eHl6\"}}",
+       }) {
+    SCOPED_TRACE(json);
+    std::vector<uint8_t> cbor;
+    EXPECT_THAT(ConvertJSONToCBOR(SpanFrom(json), table, &cbor),
+                StatusIsOk());
+    EXPECT_FALSE(ContainsBinary(cbor, xyz));
+  }
+}
 }  // namespace json
 }  // namespace crdtp
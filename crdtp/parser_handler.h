@@ -20,11 +20,21 @@ class ParserHandler {
   virtual void HandleMapEnd() = 0;
   virtual void HandleArrayBegin() = 0;
   virtual void HandleArrayEnd() = 0;
+  // The spans passed to the string and binary handlers may point into the
+  // parser's input or into scratch memory; they're only valid for the
+  // duration of the call.
   virtual void HandleString8(span<uint8_t> chars) = 0;
   virtual void HandleString16(span<uint16_t> chars) = 0;
   virtual void HandleBinary(span<uint8_t> bytes) = 0;
   virtual void HandleDouble(double value) = 0;
   virtual void HandleInt32(int32_t value) = 0;
+  // Integers outside of the int32_t range. The parsers send HandleInt32
+  // for values which fit. For handlers that don't distinguish, this falls
+  // back to HandleDouble, which is what the parsers used to send for such
+  // values.
+  virtual void HandleInt64(int64_t value) {
+    HandleDouble(static_cast<double>(value));
+  }
   virtual void HandleBool(bool value) = 0;
   virtual void HandleNull() = 0;
 
@@ -6,6 +6,8 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <limits>
 #include <string>
 
 namespace crdtp {
@@ -84,7 +86,7 @@ bool DeserializerDescriptor::Deserialize(DeserializerState* state,
   }
   tokenizer->Next();
   int32_t seen_mandatory_fields = 0;
-  for (; tokenizer->TokenTag() != cbor::CBORTokenTag::STOP; tokenizer->Next()) {
+  while (tokenizer->TokenTag() != cbor::CBORTokenTag::STOP) {
     if (tokenizer->TokenTag() != cbor::CBORTokenTag::STRING8) {
       state->RegisterError(Error::CBOR_INVALID_MAP_KEY);
       return false;
@@ -124,13 +126,16 @@ bool DeserializerDescriptor::DeserializeField(DeserializerState* state,
       });
   // Unknown field is not an error -- we may be working against an
   // implementation of a later version of the protocol.
-  // TODO(caseq): support unknown arrays and maps not enclosed by an envelope.
-  if (entry == end || !SpanEquals(entry->name, name))
-    return true;
+  if (entry == end || !SpanEquals(entry->name, name)) {
+    state->tokenizer()->SkipValue();
+    return state->tokenizer()->TokenTag() != cbor::CBORTokenTag::ERROR_VALUE;
+  }
   if (!entry->deserializer(state, obj)) {
     state->RegisterFieldPath(name);
     return false;
   }
+  // The deserializers leave the tokenizer at the last token of the value.
+  state->tokenizer()->Next();
   if (!entry->is_optional)
     *seen_mandatory_fields |= 1 << (entry - begin);
   return true;
@@ -156,6 +161,10 @@ void ProtocolTypeTraits<bool>::Serialize(bool value,
   bytes->push_back(value ? cbor::EncodeTrue() : cbor::EncodeFalse());
 }
 
+void ProtocolTypeTraits<bool>::Serialize(bool value, ByteSink* bytes) {
+  bytes->Append(value ? cbor::EncodeTrue() : cbor::EncodeFalse());
+}
+
 bool ProtocolTypeTraits<int32_t>::Deserialize(DeserializerState* state,
                                               int32_t* value) {
   if (state->tokenizer()->TokenTag() != cbor::CBORTokenTag::INT32) {
@@ -171,16 +180,90 @@ void ProtocolTypeTraits<int32_t>::Serialize(int32_t value,
   cbor::EncodeInt32(value, bytes);
 }
 
+void ProtocolTypeTraits<int32_t>::Serialize(int32_t value, ByteSink* bytes) {
+  cbor::EncodeInt32(value, bytes);
+}
+
+bool ProtocolTypeTraits<int64_t>::Deserialize(DeserializerState* state,
+                                              int64_t* value) {
+  cbor::CBORTokenizer* tokenizer = state->tokenizer();
+  if (tokenizer->TokenTag() == cbor::CBORTokenTag::INT32 ||
+      tokenizer->TokenTag() == cbor::CBORTokenTag::INT64) {
+    *value = tokenizer->GetInt64();
+    return true;
+  }
+  // Peers which predate int64 support send such values as doubles.
+  // We accept them if they're integers within the int64_t range.
+  if (tokenizer->TokenTag() == cbor::CBORTokenTag::DOUBLE) {
+    // 2^63, which is exactly representable as a double, unlike 2^63 - 1.
+    const double kTwoToThe63 =
+        -static_cast<double>(std::numeric_limits<int64_t>::min());
+    double d = tokenizer->GetDouble();
+    if (d >= -kTwoToThe63 && d < kTwoToThe63 && std::floor(d) == d) {
+      *value = static_cast<int64_t>(d);
+      return true;
+    }
+  }
+  state->RegisterError(Error::BINDINGS_INT64_VALUE_EXPECTED);
+  return false;
+}
+
+void ProtocolTypeTraits<int64_t>::Serialize(int64_t value,
+                                            std::vector<uint8_t>* bytes) {
+  cbor::EncodeInt64(value, bytes);
+}
+
+void ProtocolTypeTraits<int64_t>::Serialize(int64_t value, ByteSink* bytes) {
+  cbor::EncodeInt64(value, bytes);
+}
+
 ContainerSerializer::ContainerSerializer(std::vector<uint8_t>* bytes,
                                          uint8_t tag)
-    : bytes_(bytes) {
+    : bytes_(bytes), sink_(nullptr), definite_length_(false) {
   envelope_.EncodeStart(bytes_);
   bytes_->push_back(tag);
 }
 
+ContainerSerializer::ContainerSerializer(ByteSink* sink, uint8_t tag)
+    : bytes_(nullptr), sink_(sink), definite_length_(false) {
+  envelope_.EncodeStart(sink_);
+  sink_->Append(tag);
+}
+
+ContainerSerializer::ContainerSerializer(std::vector<uint8_t>* bytes,
+                                         cbor::MajorType type,
+                                         uint64_t length)
+    : bytes_(bytes), sink_(nullptr), definite_length_(true) {
+  assert(type == cbor::MajorType::ARRAY || type == cbor::MajorType::MAP);
+  envelope_.EncodeStart(bytes_);
+  if (type == cbor::MajorType::ARRAY)
+    cbor::EncodeDefiniteLengthArrayStart(length, bytes_);
+  else
+    cbor::EncodeDefiniteLengthMapStart(length, bytes_);
+}
+
+ContainerSerializer::ContainerSerializer(ByteSink* sink,
+                                         cbor::MajorType type,
+                                         uint64_t length)
+    : bytes_(nullptr), sink_(sink), definite_length_(true) {
+  assert(type == cbor::MajorType::ARRAY || type == cbor::MajorType::MAP);
+  envelope_.EncodeStart(sink_);
+  if (type == cbor::MajorType::ARRAY)
+    cbor::EncodeDefiniteLengthArrayStart(length, sink_);
+  else
+    cbor::EncodeDefiniteLengthMapStart(length, sink_);
+}
+
 void ContainerSerializer::EncodeStop() {
-  bytes_->push_back(cbor::EncodeStop());
-  envelope_.EncodeStop(bytes_);
+  if (bytes_) {
+    if (!definite_length_)
+      bytes_->push_back(cbor::EncodeStop());
+    envelope_.EncodeStop(bytes_);
+  } else {
+    if (!definite_length_)
+      sink_->Append(cbor::EncodeStop());
+    envelope_.EncodeStop(sink_);
+  }
 }
 
 ObjectSerializer::ObjectSerializer()
@@ -196,12 +279,20 @@ std::unique_ptr<Serializable> ObjectSerializer::Finish() {
 bool ProtocolTypeTraits<double>::Deserialize(DeserializerState* state,
                                              double* value) {
   // Double values that round-trip through JSON may end up getting represented
-  // as an int32 (SIGNED, UNSIGNED) on the wire in CBOR. Therefore, we also
-  // accept an INT32 here.
+  // as an integer (SIGNED, UNSIGNED) on the wire in CBOR. Therefore, we also
+  // accept INT32, INT64 and UINT64 here.
   if (state->tokenizer()->TokenTag() == cbor::CBORTokenTag::INT32) {
     *value = state->tokenizer()->GetInt32();
     return true;
   }
+  if (state->tokenizer()->TokenTag() == cbor::CBORTokenTag::INT64) {
+    *value = static_cast<double>(state->tokenizer()->GetInt64());
+    return true;
+  }
+  if (state->tokenizer()->TokenTag() == cbor::CBORTokenTag::UINT64) {
+    *value = static_cast<double>(state->tokenizer()->GetUint64());
+    return true;
+  }
   if (state->tokenizer()->TokenTag() != cbor::CBORTokenTag::DOUBLE) {
     state->RegisterError(Error::BINDINGS_DOUBLE_VALUE_EXPECTED);
     return false;
@@ -215,6 +306,10 @@ void ProtocolTypeTraits<double>::Serialize(double value,
   cbor::EncodeDouble(value, bytes);
 }
 
+void ProtocolTypeTraits<double>::Serialize(double value, ByteSink* bytes) {
+  cbor::EncodeDouble(value, bytes);
+}
+
 class IncomingDeferredMessage : public DeferredMessage {
  public:
   // Creates the state from the part of another message.
@@ -232,6 +327,9 @@ class IncomingDeferredMessage : public DeferredMessage {
   void AppendSerialized(std::vector<uint8_t>* out) const override {
     out->insert(out->end(), span_.begin(), span_.end());
   }
+  void AppendSerializedToSink(ByteSink* out) const override {
+    out->Append(span_);
+  }
 
   DeserializerState::Storage storage_;
   span<uint8_t> span_;
@@ -252,6 +350,9 @@ class OutgoingDeferredMessage : public DeferredMessage {
   void AppendSerialized(std::vector<uint8_t>* out) const override {
     serializable_->AppendSerialized(out);
   }
+  void AppendSerializedToSink(ByteSink* out) const override {
+    serializable_->AppendSerializedToSink(out);
+  }
 
   std::unique_ptr<Serializable> serializable_;
 };
@@ -286,4 +387,10 @@ void ProtocolTypeTraits<std::unique_ptr<DeferredMessage>>::Serialize(
   value->AppendSerialized(bytes);
 }
 
+void ProtocolTypeTraits<std::unique_ptr<DeferredMessage>>::Serialize(
+    const std::unique_ptr<DeferredMessage>& value,
+    ByteSink* bytes) {
+  value->AppendSerializedToSink(bytes);
+}
+
 }  // namespace crdtp
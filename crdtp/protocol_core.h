@@ -9,8 +9,11 @@
 
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "byte_sink.h"
 #include "cbor.h"
 #include "maybe.h"
 #include "serializable.h"
@@ -56,31 +59,89 @@ template <>
 struct CRDTP_EXPORT ProtocolTypeTraits<bool> {
   static bool Deserialize(DeserializerState* state, bool* value);
   static void Serialize(bool value, std::vector<uint8_t>* bytes);
+  static void Serialize(bool value, ByteSink* bytes);
 };
 
 template <>
 struct CRDTP_EXPORT ProtocolTypeTraits<int32_t> {
   static bool Deserialize(DeserializerState* state, int* value);
   static void Serialize(int value, std::vector<uint8_t>* bytes);
+  static void Serialize(int value, ByteSink* bytes);
+};
+
+template <>
+struct CRDTP_EXPORT ProtocolTypeTraits<int64_t> {
+  static bool Deserialize(DeserializerState* state, int64_t* value);
+  static void Serialize(int64_t value, std::vector<uint8_t>* bytes);
+  static void Serialize(int64_t value, ByteSink* bytes);
 };
 
 template <>
 struct CRDTP_EXPORT ProtocolTypeTraits<double> {
   static bool Deserialize(DeserializerState* state, double* value);
   static void Serialize(double value, std::vector<uint8_t>* bytes);
+  static void Serialize(double value, ByteSink* bytes);
 };
 
+namespace detail {
+// Yields std::true_type iff ProtocolTypeTraits<T> can serialize into a
+// ByteSink. Traits that are defined outside of crdtp (e.g. for the string
+// types of the embedder) may only support std::vector<uint8_t>.
+template <typename T, typename = void>
+struct HasByteSinkSerializer : std::false_type {};
+
+template <typename T>
+struct HasByteSinkSerializer<
+    T,
+    decltype(ProtocolTypeTraits<T>::Serialize(std::declval<const T&>(),
+                                              std::declval<ByteSink*>()))>
+    : std::true_type {};
+
+template <typename T>
+void SerializeToSink(const T& value, ByteSink* bytes, std::true_type) {
+  ProtocolTypeTraits<T>::Serialize(value, bytes);
+}
+
+template <typename T>
+void SerializeToSink(const T& value, ByteSink* bytes, std::false_type) {
+  std::vector<uint8_t> tmp;
+  ProtocolTypeTraits<T>::Serialize(value, &tmp);
+  bytes->Append(SpanFrom(tmp));
+}
+}  // namespace detail
+
+// Serializes |value| into |bytes| using ProtocolTypeTraits<T>; falls back to
+// serializing into a temporary vector if the traits don't support ByteSink.
+template <typename T>
+void SerializeToSink(const T& value, ByteSink* bytes) {
+  detail::SerializeToSink(value, bytes, detail::HasByteSinkSerializer<T>());
+}
+
 class CRDTP_EXPORT ContainerSerializer {
  public:
   ContainerSerializer(std::vector<uint8_t>* bytes, uint8_t tag);
+  ContainerSerializer(ByteSink* sink, uint8_t tag);
+  // Starts a definite length array or map (|type| is cbor::MajorType::ARRAY
+  // or cbor::MajorType::MAP) with |length| elements or key / value pairs,
+  // which lets decoders pre-size their containers. ::EncodeStop then emits
+  // no stop byte. Only for peers which accept definite length maps / arrays,
+  // see cbor.h.
+  ContainerSerializer(std::vector<uint8_t>* bytes,
+                      cbor::MajorType type,
+                      uint64_t length);
+  ContainerSerializer(ByteSink* sink, cbor::MajorType type, uint64_t length);
 
   template <typename T>
   void AddField(span<char> field_name, const T& value) {
-    cbor::EncodeString8(
-        span<uint8_t>(reinterpret_cast<const uint8_t*>(field_name.data()),
-                      field_name.size()),
-        bytes_);
-    ProtocolTypeTraits<T>::Serialize(value, bytes_);
+    span<uint8_t> name(reinterpret_cast<const uint8_t*>(field_name.data()),
+                       field_name.size());
+    if (bytes_) {
+      cbor::EncodeString8(name, bytes_);
+      ProtocolTypeTraits<T>::Serialize(value, bytes_);
+    } else {
+      cbor::EncodeString8(name, sink_);
+      SerializeToSink(value, sink_);
+    }
   }
   template <typename T>
   void AddField(span<char> field_name, const detail::ValueMaybe<T>& value) {
@@ -98,7 +159,10 @@ class CRDTP_EXPORT ContainerSerializer {
   void EncodeStop();
 
  private:
+  // Exactly one of these is set, depending on the constructor.
   std::vector<uint8_t>* const bytes_;
+  ByteSink* const sink_;
+  const bool definite_length_;
   cbor::EnvelopeEncoder envelope_;
 };
 
@@ -152,6 +216,8 @@ struct ProtocolTypeTraits<std::vector<T>> {
       return false;
     }
     assert(value->empty());
+    if (tokenizer->HasDefiniteLength())
+      value->reserve(tokenizer->GetDefiniteLength());
     tokenizer->Next();
     for (; tokenizer->TokenTag() != cbor::CBORTokenTag::STOP;
          tokenizer->Next()) {
@@ -170,6 +236,14 @@ struct ProtocolTypeTraits<std::vector<T>> {
       ProtocolTypeTraits<T>::Serialize(item, bytes);
     container_serializer.EncodeStop();
   }
+
+  static void Serialize(const std::vector<T>& value, ByteSink* bytes) {
+    ContainerSerializer container_serializer(
+        bytes, cbor::EncodeIndefiniteLengthArrayStart());
+    for (const auto& item : value)
+      SerializeToSink(item, bytes);
+    container_serializer.EncodeStop();
+  }
 };
 
 template <typename T>
@@ -186,6 +260,10 @@ struct ProtocolTypeTraits<std::unique_ptr<std::vector<T>>> {
                         std::vector<uint8_t>* bytes) {
     ProtocolTypeTraits<std::vector<T>>::Serialize(*value, bytes);
   }
+  static void Serialize(const std::unique_ptr<std::vector<T>>& value,
+                        ByteSink* bytes) {
+    ProtocolTypeTraits<std::vector<T>>::Serialize(*value, bytes);
+  }
 };
 
 class CRDTP_EXPORT DeferredMessage : public Serializable {
@@ -207,6 +285,8 @@ struct CRDTP_EXPORT ProtocolTypeTraits<std::unique_ptr<DeferredMessage>> {
                           std::unique_ptr<DeferredMessage>* value);
   static void Serialize(const std::unique_ptr<DeferredMessage>& value,
                         std::vector<uint8_t>* bytes);
+  static void Serialize(const std::unique_ptr<DeferredMessage>& value,
+                        ByteSink* bytes);
 };
 
 template <typename T>
@@ -224,6 +304,10 @@ struct ProtocolTypeTraits<detail::ValueMaybe<T>> {
                         std::vector<uint8_t>* bytes) {
     ProtocolTypeTraits<T>::Serialize(value.fromJust(), bytes);
   }
+
+  static void Serialize(const detail::ValueMaybe<T>& value, ByteSink* bytes) {
+    SerializeToSink(value.fromJust(), bytes);
+  }
 };
 
 template <typename T>
@@ -241,6 +325,10 @@ struct ProtocolTypeTraits<detail::PtrMaybe<T>> {
                         std::vector<uint8_t>* bytes) {
     ProtocolTypeTraits<T>::Serialize(*value.fromJust(), bytes);
   }
+
+  static void Serialize(const detail::PtrMaybe<T>& value, ByteSink* bytes) {
+    SerializeToSink(*value.fromJust(), bytes);
+  }
 };
 
 template <typename T>
@@ -311,6 +399,7 @@ class ProtocolObject : public Serializable,
 
  protected:
   using ProtocolType = T;
+  using ByteSinkType = ByteSink;
 
   ProtocolObject() = default;
 };
@@ -327,6 +416,10 @@ struct ProtocolTypeTraits<
   static void Serialize(const T& value, std::vector<uint8_t>* bytes) {
     value.AppendSerialized(bytes);
   }
+
+  static void Serialize(const T& value, ByteSink* bytes) {
+    value.AppendSerializedToSink(bytes);
+  }
 };
 
 template <typename T>
@@ -346,6 +439,10 @@ struct ProtocolTypeTraits<
                         std::vector<uint8_t>* bytes) {
     ProtocolTypeTraits<T>::Serialize(*value, bytes);
   }
+
+  static void Serialize(const std::unique_ptr<T>& value, ByteSink* bytes) {
+    ProtocolTypeTraits<T>::Serialize(*value, bytes);
+  }
 };
 
 #define DECLARE_DESERIALIZATION_SUPPORT()  \
@@ -355,8 +452,11 @@ struct ProtocolTypeTraits<
 #define DECLARE_SERIALIZATION_SUPPORT()                              \
  public:                                                             \
   void AppendSerialized(std::vector<uint8_t>* bytes) const override; \
+  void AppendSerializedToSink(ByteSinkType* bytes) const override;   \
                                                                      \
  private:                                                            \
+  template <typename Out>                                            \
+  void AppendSerializedImpl(Out* bytes) const;                       \
   friend DeserializableBase<ProtocolType>;                           \
   static const DeserializerDescriptorType& deserializer_descriptor()
 
@@ -387,10 +487,19 @@ struct ProtocolTypeTraits<
 #define CRDTP_DESERIALIZE_FIELD_OPT(name, field) \
   CRDTP_DESERIALIZE_FILED_IMPL(name, field, true)
 
-#define CRDTP_BEGIN_SERIALIZER(type)                               \
-  void type::AppendSerialized(std::vector<uint8_t>* bytes) const { \
-    using namespace crdtp;                                         \
-    ContainerSerializer __serializer(bytes,                        \
+// The serializer body is a template, so that it encodes directly into
+// either a std::vector<uint8_t> or a ByteSink.
+#define CRDTP_BEGIN_SERIALIZER(type)                                   \
+  void type::AppendSerialized(std::vector<uint8_t>* bytes) const {     \
+    AppendSerializedImpl(bytes);                                       \
+  }                                                                    \
+  void type::AppendSerializedToSink(ByteSinkType* bytes) const {       \
+    AppendSerializedImpl(bytes);                                       \
+  }                                                                    \
+  template <typename Out>                                              \
+  void type::AppendSerializedImpl(Out* bytes) const {                  \
+    using namespace crdtp;                                             \
+    ContainerSerializer __serializer(bytes,                            \
                                      cbor::EncodeIndefiniteLengthMapStart());
 
 #define CRDTP_SERIALIZE_FIELD(name, field) \
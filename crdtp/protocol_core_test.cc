@@ -4,6 +4,7 @@
 
 #include "protocol_core.h"
 
+#include <limits>
 #include <memory>
 
 #include "cbor.h"
@@ -74,6 +75,36 @@ TEST(ProtocolCoreTest, FailedToDeserializeTestTypeBasic) {
   EXPECT_THAT(result.status(), StatusIs(Error::CBOR_INVALID_STRING8, 0));
 }
 
+TEST(ProtocolCoreTest, SkipsUnknownFields) {
+  // Encodes {"unknown1": [1, {"x": 2}], "unknown2": {...}, "value": "foo"},
+  // where the value for "unknown1" isn't wrapped by an envelope.
+  std::vector<uint8_t> bytes;
+  cbor::EnvelopeEncoder envelope;
+  envelope.EncodeStart(&bytes);
+  bytes.push_back(cbor::EncodeIndefiniteLengthMapStart());
+  cbor::EncodeString8(SpanFrom("unknown1"), &bytes);
+  bytes.push_back(cbor::EncodeIndefiniteLengthArrayStart());
+  cbor::EncodeInt32(1, &bytes);
+  bytes.push_back(cbor::EncodeIndefiniteLengthMapStart());
+  cbor::EncodeString8(SpanFrom("x"), &bytes);
+  cbor::EncodeInt32(2, &bytes);
+  bytes.push_back(cbor::EncodeStop());
+  bytes.push_back(cbor::EncodeStop());
+  cbor::EncodeString8(SpanFrom("unknown2"), &bytes);
+  TestTypeBasic unknown;
+  unknown.SetValue("bar");
+  unknown.AppendSerialized(&bytes);
+  cbor::EncodeString8(SpanFrom("value"), &bytes);
+  cbor::EncodeString8(SpanFrom("foo"), &bytes);
+  bytes.push_back(cbor::EncodeStop());
+  envelope.EncodeStop(&bytes);
+
+  StatusOr<std::unique_ptr<TestTypeBasic>> result =
+      TestTypeBasic::ReadFrom(std::move(bytes));
+  ASSERT_THAT(result.status(), StatusIsOk());
+  EXPECT_THAT((*result)->GetValue(), Eq("foo"));
+}
+
 class TestTypeBasicDouble : public ProtocolObject<TestTypeBasicDouble> {
  public:
   TestTypeBasicDouble() = default;
@@ -114,6 +145,70 @@ TEST(TestBasicDouble, ParserAllowsAllowsDoubleEncodedAsInt) {
   EXPECT_THAT(obj->GetValue(), Eq(42));
 }
 
+class TestTypeBasicInt64 : public ProtocolObject<TestTypeBasicInt64> {
+ public:
+  TestTypeBasicInt64() = default;
+
+  int64_t GetValue() const { return value_; }
+  void SetValue(int64_t value) { value_ = value; }
+
+ private:
+  DECLARE_SERIALIZATION_SUPPORT();
+
+  int64_t value_ = 0;
+};
+
+// clang-format off
+CRDTP_BEGIN_DESERIALIZER(TestTypeBasicInt64)
+  CRDTP_DESERIALIZE_FIELD("value", value_)
+CRDTP_END_DESERIALIZER()
+
+CRDTP_BEGIN_SERIALIZER(TestTypeBasicInt64)
+  CRDTP_SERIALIZE_FIELD("value", value_);
+CRDTP_END_SERIALIZER();
+// clang-format on
+
+TEST(TestBasicInt64, Roundtrip) {
+  for (int64_t value : {int64_t(0), int64_t(-1), int64_t(9007199254740993),
+                        std::numeric_limits<int64_t>::min(),
+                        std::numeric_limits<int64_t>::max()}) {
+    SCOPED_TRACE(value);
+    TestTypeBasicInt64 obj;
+    obj.SetValue(value);
+    std::vector<uint8_t> encoded = obj.Serialize();
+    auto decoded = TestTypeBasicInt64::ReadFrom(encoded).value();
+    ASSERT_THAT(decoded, Not(testing::IsNull()));
+    EXPECT_THAT(decoded->GetValue(), Eq(value));
+  }
+}
+
+TEST(TestBasicInt64, ParserAllowsIntegralDouble) {
+  // Some clients emit integers as doubles, e.g. JavaScript for values
+  // above 2^53; we accept these if they're integral and in range.
+  std::vector<uint8_t> encoded;
+  crdtp::cbor::EnvelopeEncoder envelope;
+  envelope.EncodeStart(&encoded);
+  encoded.push_back(crdtp::cbor::EncodeIndefiniteLengthMapStart());
+  crdtp::cbor::EncodeString8(crdtp::SpanFrom("value"), &encoded);
+  crdtp::cbor::EncodeDouble(9007199254740992.0, &encoded);
+  encoded.push_back(crdtp::cbor::EncodeStop());
+  envelope.EncodeStop(&encoded);
+  auto obj = TestTypeBasicInt64::ReadFrom(encoded).value();
+  ASSERT_THAT(obj, Not(testing::IsNull()));
+  EXPECT_THAT(obj->GetValue(), Eq(int64_t(9007199254740992)));
+
+  encoded.clear();
+  envelope = crdtp::cbor::EnvelopeEncoder();
+  envelope.EncodeStart(&encoded);
+  encoded.push_back(crdtp::cbor::EncodeIndefiniteLengthMapStart());
+  crdtp::cbor::EncodeString8(crdtp::SpanFrom("value"), &encoded);
+  crdtp::cbor::EncodeDouble(0.5, &encoded);
+  encoded.push_back(crdtp::cbor::EncodeStop());
+  envelope.EncodeStop(&encoded);
+  EXPECT_EQ(Error::BINDINGS_INT64_VALUE_EXPECTED,
+            TestTypeBasicInt64::ReadFrom(encoded).status().error);
+}
+
 class TestTypeComposite : public ProtocolObject<TestTypeComposite> {
  public:
   bool GetBoolField() const { return bool_field_; }
@@ -182,6 +277,29 @@ TEST(ProtocolCoreTest, Composite) {
   EXPECT_THAT(obj2->GetTestTypeBasicField()->GetValue(), Eq("bazzzz"));
 }
 
+TEST(ProtocolCoreTest, CompositeSerializesIntoByteSink) {
+  TestTypeComposite obj;
+  obj.SetBoolField(true);
+  obj.SetIntField(42);
+  obj.SetDoubleField(2.718281828);
+  obj.SetStrField("bar");
+  auto val = std::make_unique<TestTypeBasic>();
+  val->SetValue("bazzzz");
+  obj.SetTestTypeBasicField(std::move(val));
+
+  std::vector<uint8_t> expected;
+  obj.AppendSerialized(&expected);
+
+  // The chunk size is chosen so that envelope sizes straddle chunk
+  // boundaries.
+  ChunkedByteSink sink(/*chunk_size=*/5);
+  obj.AppendSerializedToSink(&sink);
+  std::vector<uint8_t> joined;
+  for (const std::vector<uint8_t>& chunk : sink.chunks())
+    joined.insert(joined.end(), chunk.begin(), chunk.end());
+  EXPECT_THAT(joined, testing::ElementsAreArray(expected));
+}
+
 class CompositeParsingTest : public testing::Test {
  public:
   CompositeParsingTest() {
@@ -347,6 +465,35 @@ TEST_F(CompositeParsingTest, Arrays) {
   EXPECT_THAT(obj2->GetTestTypeBasicArray()->front()->GetValue(), Eq("bazzzz"));
 }
 
+TEST(ProtocolCoreTest, DefiniteLengthArrays) {
+  std::vector<uint8_t> bytes;
+  ContainerSerializer top(&bytes, cbor::EncodeIndefiniteLengthMapStart());
+  cbor::EncodeString8(SpanFrom("int_array"), &bytes);
+  ContainerSerializer int_array(&bytes, cbor::MajorType::ARRAY, 3);
+  for (int32_t value : {1, 3, 5})
+    cbor::EncodeInt32(value, &bytes);
+  int_array.EncodeStop();
+  cbor::EncodeString8(SpanFrom("test_type_basic_array"), &bytes);
+  ContainerSerializer basic_array(&bytes, cbor::MajorType::ARRAY, 1);
+  TestTypeBasic basic;
+  basic.SetValue("foo");
+  basic.AppendSerialized(&bytes);
+  basic_array.EncodeStop();
+  cbor::EncodeString8(SpanFrom("str_array"), &bytes);
+  ContainerSerializer str_array(&bytes, cbor::MajorType::ARRAY, 0);
+  str_array.EncodeStop();
+  top.EncodeStop();
+
+  StatusOr<std::unique_ptr<TestTypeArrays>> result =
+      TestTypeArrays::ReadFrom(std::move(bytes));
+  ASSERT_THAT(result.status(), StatusIsOk());
+  EXPECT_THAT(*(*result)->GetIntArray(), testing::ElementsAre(1, 3, 5));
+  EXPECT_THAT((*result)->GetStrArray()->size(), Eq(0ul));
+  ASSERT_THAT((*result)->GetTestTypeBasicArray()->size(), Eq(1ul));
+  EXPECT_THAT((*result)->GetTestTypeBasicArray()->front()->GetValue(),
+              Eq("foo"));
+}
+
 class TestTypeOptional : public ProtocolObject<TestTypeOptional> {
  public:
   TestTypeOptional() = default;
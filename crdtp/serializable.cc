@@ -17,6 +17,12 @@ std::vector<uint8_t> Serializable::Serialize() const {
   return out;
 }
 
+void Serializable::AppendSerializedToSink(ByteSink* out) const {
+  std::vector<uint8_t> bytes;
+  AppendSerialized(&bytes);
+  out->Append(SpanFrom(bytes));
+}
+
 namespace {
 class PreSerialized : public Serializable {
  public:
@@ -27,6 +33,10 @@ class PreSerialized : public Serializable {
     out->insert(out->end(), bytes_.begin(), bytes_.end());
   }
 
+  void AppendSerializedToSink(ByteSink* out) const override {
+    out->Append(SpanFrom(bytes_));
+  }
+
  private:
   std::vector<uint8_t> bytes_;
 };
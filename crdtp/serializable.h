@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <memory>
 #include <vector>
+#include "byte_sink.h"
 #include "export.h"
 
 namespace crdtp {
@@ -21,6 +22,12 @@ class CRDTP_EXPORT Serializable {
 
   virtual void AppendSerialized(std::vector<uint8_t>* out) const = 0;
 
+  // Appends the serialized bytes to |out|. The default implementation
+  // serializes into a temporary vector and copies it into |out|; subclasses
+  // (e.g. protocol objects defined with CRDTP_BEGIN_SERIALIZER) override this
+  // to encode into |out| directly.
+  virtual void AppendSerializedToSink(ByteSink* out) const;
+
   virtual ~Serializable() = default;
 
   // Wraps a vector of |bytes| into a Serializable for situations in which we
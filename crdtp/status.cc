@@ -84,6 +84,12 @@ std::string Status::Message() const {
       return "CBOR: array start expected";
     case Error::CBOR_ENVELOPE_SIZE_LIMIT_EXCEEDED:
       return "CBOR: envelope size limit exceeded";
+    case Error::CBOR_INVALID_DEFINITE_LENGTH:
+      return "CBOR: invalid definite length";
+    case Error::CBOR_INVALID_INT64:
+      return "CBOR: invalid int64";
+    case Error::CBOR_INVALID_STRING_REF:
+      return "CBOR: invalid string reference";
 
     case Error::MESSAGE_MUST_BE_AN_OBJECT:
       return "Message must be an object";
@@ -115,6 +121,8 @@ std::string Status::Message() const {
       return "BINDINGS: binary value expected";
     case Error::BINDINGS_DICTIONARY_VALUE_EXPECTED:
       return "BINDINGS: dictionary value expected";
+    case Error::BINDINGS_INT64_VALUE_EXPECTED:
+      return "BINDINGS: int64 value expected";
   }
   // Some compilers can't figure out that we can't get here.
   return "INVALID ERROR CODE";
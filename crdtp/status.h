@@ -59,6 +59,10 @@ enum class Error {
   CBOR_MAP_STOP_EXPECTED = 0x21,
   CBOR_ARRAY_START_EXPECTED = 0x22,
   CBOR_ENVELOPE_SIZE_LIMIT_EXCEEDED = 0x23,
+  // Added later, hence out of sequence.
+  CBOR_INVALID_DEFINITE_LENGTH = 0x38,
+  CBOR_INVALID_INT64 = 0x39,
+  CBOR_INVALID_STRING_REF = 0x3b,
 
   // Message errors are constraints we place on protocol messages coming
   // from a protocol client; these are checked in crdtp::Dispatchable
@@ -78,6 +82,7 @@ enum class Error {
   BINDINGS_STRING8_VALUE_EXPECTED = 0x35,
   BINDINGS_BINARY_VALUE_EXPECTED = 0x36,
   BINDINGS_DICTIONARY_VALUE_EXPECTED = 0x37,
+  BINDINGS_INT64_VALUE_EXPECTED = 0x3a,
 };
 
 // A status value with position that can be copied. The default status
@@ -12,8 +12,8 @@ import sys
 description = ''
 
 
-primitiveTypes = ['integer', 'number', 'boolean', 'string', 'object',
-                  'any', 'array', 'binary']
+primitiveTypes = ['integer', 'integer64', 'number', 'boolean', 'string',
+                  'object', 'any', 'array', 'binary']
 
 
 def assignType(item, type, is_array=False, map_binary_to_string=False):